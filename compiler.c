@@ -1,10 +1,12 @@
 #include "private.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
 static bool lux_compiler_expression(compiler_t* comp, closure_t* closure, vmtype_t* wishtype, unsigned char* _retreg, vmtype_t** _rettype, bool allowprimary);
 static bool lux_compiler_scope(compiler_t* comp, closure_t* closure);
+static bool lux_compiler_statement(compiler_t* comp, closure_t* closure, token_t* token);
 
 //-----------------------------------------------
 // Initilazes the compiler_t struct
@@ -16,6 +18,24 @@ void lux_compiler_init(compiler_t* comp, vm_t* vm, lexer_t* lex)
   lux_compiler_clear_registers(comp);
   comp->z = 0;
   comp->vc = 0;
+  comp->optlevel = LUX_OPT_FULL;
+  comp->inlined = 0;
+  comp->numclones = 0;
+  lux_compiler_forget_emitted(comp);
+}
+
+//-----------------------------------------------
+// Forgets the offsets of recently emitted
+// instructions so nothing gets rewritten
+// across them
+//-----------------------------------------------
+void lux_compiler_forget_emitted(compiler_t* comp)
+{
+  comp->lastcall = -1;
+  comp->lastbinop = -1;
+  comp->lastldi = -1;
+  comp->ldirun = -1;
+  comp->jc = 0;
 }
 
 //-----------------------------------------------
@@ -150,575 +170,2386 @@ static bool lux_instruction_for_operator(vm_t* vm, vmtype_t* ltype, vmtype_t* rt
 }
 
 //-----------------------------------------------
-// Parses arguments for a function call
-// Returns false on fatal error
+// Returns k if value is 2^k
+// Returns -1 otherwise
 //-----------------------------------------------
-static bool lux_compiler_function_call(compiler_t* comp, closure_t* closure, closure_t* called)
+static int lux_power_of_two(int value)
 {
-  TRY(lux_lexer_expect_token(comp->lex, '('))
-  for(int i = 0; i < called->numargs; i++)
+  if(value < 1 || (value & (value - 1)))
   {
-    vmtype_t* argtype;
-    unsigned char reg;
-    TRY(lux_compiler_expression(comp, closure, called->args[i], &reg, &argtype, false))
-
-    if(argtype != called->args[i])
-    {
-      lux_vm_set_error_ss(comp->vm, "Function expected argument of type %s, got %s instead", called->args[i]->name, argtype->name);
-      return false;
-    }
-
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
-    lux_vm_closure_append_byte(comp->vm, closure, reg);
-    lux_vm_closure_append_byte(comp->vm, closure, i + 1);
-
-    lux_compiler_free_register_generic(comp, reg);
+    return -1;
+  }
 
-    if(i < called->numargs - 1)
-    {
-      TRY(lux_lexer_expect_token(comp->lex, ','))
-    }
+  int k = 0;
+  while((1 << k) != value)
+  {
+    k++;
   }
-  TRY(lux_lexer_expect_token(comp->lex, ')'))
+  return k;
+}
 
-  return true;
+//-----------------------------------------------
+// Returns the absolute value of an int, defined
+// for INT_MIN too
+//-----------------------------------------------
+static unsigned int lux_absolute(int value)
+{
+  return value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
 }
 
 //-----------------------------------------------
-// Parses a value and tries to cast it
-// A value can be a single number, variable,
-// function call or an entire expression
+// Emits a register-immediate instruction,
+// multiplies, divides and remainders by
+// constants are strength reduced to shifts,
+// masks and magic number multiplies first
 // Returns false on fatal error
 //-----------------------------------------------
-static bool lux_compiler_parse_value(compiler_t* comp, closure_t* closure, token_t* value, unsigned char* ret, vmtype_t** rettype)
+static bool lux_compiler_emit_immediate(compiler_t* comp, closure_t* closure, unsigned char op, unsigned char reg, int value, unsigned char resreg)
 {
-  int mod = TT_EOF;
-  switch(value->type)
+  int k = lux_power_of_two(value);
+  if(op == OP_MULI_K && k != -1)
   {
-    case TT_PLUS:
-    case TT_MINUS:
-    case TT_LOGICNOT:
-    case TT_BWNOT:
-    {
-      mod = value->type;
-      lux_lexer_get_token(comp->lex, value);
-    }
+    op = OP_LSFT_K;
+    value = k;
   }
-
-  // Parse the value
-  cpvar_t* var;
-  closure_t* c;
-  if(lux_token_is_c(value, '('))
+  else if(op == OP_DIVI_K && k != -1)
   {
-    TRY(lux_compiler_expression(comp, closure, NULL, ret, rettype, false))
-    TRY(lux_lexer_expect_token(comp->lex, ')'))
+    op = OP_DIVI_P;
+    value = k;
   }
-  else if(value->type == TT_NAME && (var = lux_compiler_get_var(comp, value)) != NULL)
+  else if(op == OP_MOD_K && k != -1)
   {
-    *ret = var->r;
-    *rettype = var->type;
+    op = OP_MOD_P;
+    value = value - 1;
   }
-  else if (value->type == TT_NAME && (c = lux_vm_get_function_t(comp->vm, value)) != NULL)
+  else if((op == OP_DIVI_K || op == OP_MOD_K) && (lux_absolute(value) & (lux_absolute(value) - 1)))
   {
-    TRY(lux_compiler_function_call(comp, closure, c))
-      
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 11));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
-    lux_vm_closure_append_byte(comp->vm, closure, 0);
-    lux_vm_closure_append_int(comp->vm, closure, c->index);
-
-    lux_vm_closure_append_byte(comp->vm, closure, OP_CALL);
-    lux_vm_closure_append_byte(comp->vm, closure, 0);
+    // floor(2^(31 + s) / |d|) + 1 with s = ceil(log2(|d|)) fits in 32 bits
+    // and is exact for every 32 bit dividend once negative quotients are
+    // rounded back toward zero, powers of 2 would need one more bit
+    unsigned int d = lux_absolute(value);
+    int shift = 0;
+    while((1ull << shift) < d)
+    {
+      shift++;
+    }
+    unsigned int magic = (unsigned int)((1ull << (31 + shift)) / d + 1);
 
-    TRY(lux_compiler_alloc_register_generic(comp, ret))
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 11));
+    comp->lastbinop = closure->used;
+    lux_vm_closure_append_byte(comp->vm, closure, op == OP_DIVI_K ? OP_DIVI_M : OP_MOD_M);
+    lux_vm_closure_append_byte(comp->vm, closure, reg);
+    lux_vm_closure_append_int(comp->vm, closure, value);
+    lux_vm_closure_append_int(comp->vm, closure, (int)magic);
+    lux_vm_closure_append_byte(comp->vm, closure, resreg);
+    return true;
+  }
 
-    lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
-    lux_vm_closure_append_byte(comp->vm, closure, 0);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 7));
+  comp->lastbinop = closure->used;
+  lux_vm_closure_append_byte(comp->vm, closure, op);
+  lux_vm_closure_append_byte(comp->vm, closure, reg);
+  lux_vm_closure_append_int(comp->vm, closure, value);
+  lux_vm_closure_append_byte(comp->vm, closure, resreg);
+  return true;
+}
 
-    *rettype = c->rettype;
-  }
-  else if(value->type == TT_INT)
+//-----------------------------------------------
+// Returns the opcode computing the same result
+// with its two operands swapped
+// Returns OP_NOP if there is none
+//-----------------------------------------------
+static unsigned char lux_swapped_instruction(unsigned char op)
+{
+  switch(op)
   {
-    TRY(lux_compiler_alloc_register_generic(comp, ret))
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
-    lux_vm_closure_append_int(comp->vm, closure, value->ivalue);
-    *rettype = comp->vm->tint;
+    case OP_ADDI:
+    case OP_MULI:
+    case OP_ADDF:
+    case OP_MULF:
+    case OP_EQI:
+    case OP_NEQI:
+    case OP_EQF:
+    case OP_NEQF:
+    case OP_BAND:
+    case OP_BXOR:
+    case OP_BOR:
+      return op;
+    case OP_LTI: return OP_MTI;
+    case OP_LTEI: return OP_MTEI;
+    case OP_MTI: return OP_LTI;
+    case OP_MTEI: return OP_LTEI;
+    case OP_LTF: return OP_MTF;
+    case OP_LTEF: return OP_MTEF;
+    case OP_MTF: return OP_LTF;
+    case OP_MTEF: return OP_LTEF;
   }
-  else if(value->type == TT_FLOAT)
+
+  return OP_NOP;
+}
+
+//-----------------------------------------------
+// Returns the compare and branch opcode which
+// branches when comparison 'op' evaluates to
+// 'jumpif'
+// Returns OP_NOP if 'op' isn't a comparison
+//-----------------------------------------------
+static unsigned char lux_branch_for_comparison(unsigned char op, bool jumpif)
+{
+  switch(op)
   {
-    TRY(lux_compiler_alloc_register_generic(comp, ret))
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
-    lux_vm_closure_append_float(comp->vm, closure, value->fvalue);
-    *rettype = comp->vm->tfloat;
+    case OP_EQI: return jumpif ? OP_BEQI : OP_BNEQI;
+    case OP_NEQI: return jumpif ? OP_BNEQI : OP_BEQI;
+    case OP_LTI: return jumpif ? OP_BLTI : OP_BMTEI;
+    case OP_LTEI: return jumpif ? OP_BLTEI : OP_BMTI;
+    case OP_MTI: return jumpif ? OP_BMTI : OP_BLTEI;
+    case OP_MTEI: return jumpif ? OP_BMTEI : OP_BLTI;
+    // Ordered float comparisons are false for NaN so they can't just be flipped
+    case OP_EQF: return jumpif ? OP_BEQF : OP_BNEQF;
+    case OP_NEQF: return jumpif ? OP_BNEQF : OP_BEQF;
+    case OP_LTF: return jumpif ? OP_BLTF : OP_BNLTF;
+    case OP_LTEF: return jumpif ? OP_BLTEF : OP_BNLTEF;
+    case OP_MTF: return jumpif ? OP_BMTF : OP_BNMTF;
+    case OP_MTEF: return jumpif ? OP_BMTEF : OP_BNMTEF;
+    case OP_EQI_K: return jumpif ? OP_BEQI_K : OP_BNEQI_K;
+    case OP_NEQI_K: return jumpif ? OP_BNEQI_K : OP_BEQI_K;
+    case OP_LTI_K: return jumpif ? OP_BLTI_K : OP_BMTEI_K;
+    case OP_LTEI_K: return jumpif ? OP_BLTEI_K : OP_BMTI_K;
+    case OP_MTI_K: return jumpif ? OP_BMTI_K : OP_BLTEI_K;
+    case OP_MTEI_K: return jumpif ? OP_BMTEI_K : OP_BLTI_K;
   }
-  else if(value->type == TT_BOOL)
+
+  return OP_NOP;
+}
+
+//-----------------------------------------------
+// Points every jump in 'chain' at 'target'
+//-----------------------------------------------
+static void lux_compiler_patch(closure_t* closure, int chain, int target)
+{
+  while(chain != -1)
   {
-    TRY(lux_compiler_alloc_register_generic(comp, ret))
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
-    lux_vm_closure_append_int(comp->vm, closure, value->ivalue);
-    *rettype = comp->vm->tbool;
+    int next = *(int*)(closure->code + chain);
+    *(int*)(closure->code + chain) = target;
+    chain = next;
   }
-  else
+}
+
+//-----------------------------------------------
+// Appends the offset field of a jump emitted
+// right now to 'chain'
+//-----------------------------------------------
+static void lux_compiler_append_chain(compiler_t* comp, closure_t* closure, int* chain)
+{
+  int next = *chain;
+  *chain = closure->used;
+  lux_vm_closure_append_int(comp->vm, closure, next);
+}
+
+//-----------------------------------------------
+// Emits a branch taken when 'cond' equals 'jumpif'
+// If 'cond' is the result of the comparison
+// emitted right before, the two are fused into a
+// single compare and branch instruction
+// If it's the result of a short circuit operator
+// its jumps are sent straight to the targets
+// '_patch' is the chain of jumps for the caller
+// to patch once the target is known, start it
+// at -1
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_branch(compiler_t* comp, closure_t* closure, unsigned char cond, bool jumpif, int* _patch)
+{
+  if(comp->jc > 0 && comp->joins[comp->jc - 1].end == closure->used && comp->joins[comp->jc - 1].reg == cond)
   {
-    lux_vm_set_error_t(comp->vm, "Failed to get value from: '%s'", value);
-    return false;
+    // Drop the join and branch on the right operand instead
+    cpjoin_t join = comp->joins[--comp->jc];
+    closure->used = join.start;
+    TRY(lux_compiler_branch(comp, closure, join.rreg, jumpif, _patch))
+
+    for(int i = 0; i < join.jumpc; i++)
+    {
+      if(join.jumpif == jumpif)
+      {
+        // Jumps skipping the right operand take this branch too
+        *(int*)(closure->code + join.jumps[i]) = *_patch;
+        *_patch = join.jumps[i];
+      }
+      else
+      {
+        // Or never do
+        *(int*)(closure->code + join.jumps[i]) = closure->used;
+      }
+    }
+    return true;
   }
 
-  if(mod == TT_PLUS && *rettype == comp->vm->tint)
+  unsigned char op = comp->lastbinop != -1 ? lux_branch_for_comparison(closure->code[comp->lastbinop], jumpif) : OP_NOP;
+  if(op >= OP_BEQI_K && op <= OP_BMTEI_K && comp->lastbinop + 7 == closure->used && closure->code[comp->lastbinop + 6] == cond)
   {
-    // Do nothing
+    // <1op,1reg,4value,1reg> comparison
+    unsigned char lreg = closure->code[comp->lastbinop + 1];
+    int value = *(int*)(closure->code + comp->lastbinop + 2);
+    closure->used = comp->lastbinop;
+    comp->lastbinop = -1;
+
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 10));
+    lux_vm_closure_append_byte(comp->vm, closure, op);
+    lux_vm_closure_append_byte(comp->vm, closure, lreg);
+    lux_vm_closure_append_int(comp->vm, closure, value);
+    lux_compiler_append_chain(comp, closure, _patch);
+    return true;
   }
-  else if(mod == TT_PLUS && *rettype == comp->vm->tfloat)
+  else if(op != OP_NOP && op < OP_BEQI_K && comp->lastbinop + 4 == closure->used && closure->code[comp->lastbinop + 3] == cond)
   {
-    // Do nothing
+    // <1op,1reg,1reg,1reg> comparison
+    unsigned char lreg = closure->code[comp->lastbinop + 1];
+    unsigned char rreg = closure->code[comp->lastbinop + 2];
+    closure->used = comp->lastbinop;
+    comp->lastbinop = -1;
+
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 7));
+    lux_vm_closure_append_byte(comp->vm, closure, op);
+    lux_vm_closure_append_byte(comp->vm, closure, lreg);
+    lux_vm_closure_append_byte(comp->vm, closure, rreg);
+    lux_compiler_append_chain(comp, closure, _patch);
+    return true;
   }
-  else if(mod == TT_MINUS && *rettype == comp->vm->tint)
-  {
-    // Multiply by -1 int
-    unsigned char o, r;
-    TRY(lux_compiler_alloc_register_generic(comp, &o))
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 10));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
-    lux_vm_closure_append_byte(comp->vm, closure, o);
-    lux_vm_closure_append_int(comp->vm, closure, -1);
-
-    TRY(lux_compiler_alloc_register_generic(comp, &r))
-
-    lux_vm_closure_append_byte(comp->vm, closure, OP_MULI);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
-    lux_vm_closure_append_byte(comp->vm, closure, o);
-    lux_vm_closure_append_byte(comp->vm, closure, r);
 
-    lux_compiler_free_register_generic(comp, o);
-    lux_compiler_free_register_generic(comp, *ret);
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
+  lux_vm_closure_append_byte(comp->vm, closure, jumpif ? OP_BNEZ : OP_BEQZ);
+  lux_vm_closure_append_byte(comp->vm, closure, cond);
+  lux_compiler_append_chain(comp, closure, _patch);
+  return true;
+}
 
-    *ret = r;
-  }
-  else if(mod == TT_MINUS && *rettype == comp->vm->tfloat)
+//-----------------------------------------------
+// Loads a literal into a new generic register
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_load_literal(compiler_t* comp, closure_t* closure, vmregister_t value, unsigned char* ret)
+{
+  TRY(lux_compiler_alloc_register_generic(comp, ret))
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
+  if(comp->lastldi == -1 || comp->lastldi + 6 != closure->used)
   {
-    // Multiply by -1 float
-    unsigned char o, r;
-    TRY(lux_compiler_alloc_register_generic(comp, &o))
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 10));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
-    lux_vm_closure_append_byte(comp->vm, closure, o);
-    lux_vm_closure_append_float(comp->vm, closure, -1.0);
+    comp->ldirun = closure->used;
+  }
+  comp->lastldi = closure->used;
+  lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
+  lux_vm_closure_append_byte(comp->vm, closure, *ret);
+  lux_vm_closure_append_int(comp->vm, closure, value.ivalue);
+  return true;
+}
 
-    TRY(lux_compiler_alloc_register_generic(comp, &r))
+//-----------------------------------------------
+// Finds the OP_LDI that loaded the literal in
+// 'reg' if nothing but other literals has been
+// emitted since
+// Returns -1 if 'reg' doesn't hold such a literal
+//-----------------------------------------------
+static int lux_compiler_find_literal(compiler_t* comp, closure_t* closure, unsigned char reg)
+{
+  if(comp->lastldi == -1 || comp->lastldi + 6 != closure->used || comp->r[reg] != RS_GENERIC)
+  {
+    return -1;
+  }
 
-    lux_vm_closure_append_byte(comp->vm, closure, OP_MULF);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
-    lux_vm_closure_append_byte(comp->vm, closure, o);
-    lux_vm_closure_append_byte(comp->vm, closure, r);
+  for(int i = comp->lastldi; i >= comp->ldirun; i -= 6)
+  {
+    if(closure->code[i + 1] == reg)
+    {
+      return i;
+    }
+  }
 
-    lux_compiler_free_register_generic(comp, o);
-    lux_compiler_free_register_generic(comp, *ret);
+  return -1;
+}
 
-    *ret = r;
-  }
-  else if(mod == TT_LOGICNOT && *rettype == comp->vm->tbool)
+//-----------------------------------------------
+// Makes the instruction that just computed the
+// generic 'reg' write its result to 'to' instead
+// so it doesn't have to be moved there
+// Returns false if there's no such instruction
+//-----------------------------------------------
+static bool lux_compiler_retarget(compiler_t* comp, closure_t* closure, unsigned char reg, unsigned char to)
+{
+  // Short circuit values are written in two places
+  if(comp->r[reg] != RS_GENERIC || (comp->jc > 0 && comp->joins[comp->jc - 1].end == closure->used))
   {
-    // Logic not
-    unsigned char r;
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-    TRY(lux_compiler_alloc_register_generic(comp, &r))
-    lux_vm_closure_append_byte(comp->vm, closure, OP_LNOT);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
-    lux_vm_closure_append_byte(comp->vm, closure, r);
-
-    lux_compiler_free_register_generic(comp, *ret);
+    return false;
+  }
 
-    *ret = r;
+  int at = -1;
+  if(comp->lastldi != -1 && comp->lastldi + 6 == closure->used)
+  {
+    at = comp->lastldi;
   }
-  else if(mod == TT_BWNOT && *rettype == comp->vm->tint)
+  else if(comp->lastbinop != -1 && comp->lastbinop + lux_opcode_size(closure->code[comp->lastbinop]) == closure->used)
   {
-    // Bitwise not on int
-    unsigned char r;
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-    TRY(lux_compiler_alloc_register_generic(comp, &r))
-    lux_vm_closure_append_byte(comp->vm, closure, OP_BNOT);
-    lux_vm_closure_append_byte(comp->vm, closure, *ret);
-    lux_vm_closure_append_byte(comp->vm, closure, r);
-
-    lux_compiler_free_register_generic(comp, *ret);
-
-    *ret = r;
+    at = comp->lastbinop;
   }
-  else if(mod != TT_EOF)
+
+  int result = at != -1 ? lux_opcode_result(closure->code[at]) : 0;
+  if(result == 0 || closure->code[at + result] != reg)
   {
-    lux_vm_set_error(comp->vm, "Unexpected token in front of value");
     return false;
   }
 
+  closure->code[at + result] = to;
+  lux_compiler_forget_emitted(comp);
   return true;
 }
 
 //-----------------------------------------------
-// Tries to cast a value, return false if it
-// couldn't
-// NOTE: Doesn't allocate memory, you need to
-//       alloc 3 bytes before calling this!!!
+// Gets the register holding a variable, spilled
+// variables are reloaded into a generic one
+// Returns false on fatal error
 //-----------------------------------------------
-static bool lux_compiler_try_cast(compiler_t* comp, closure_t* closure, vmtype_t* ft, unsigned char fr, vmtype_t* tt, unsigned char* rr)
+static bool lux_compiler_load_var(compiler_t* comp, closure_t* closure, cpvar_t* var, unsigned char* ret)
 {
-  if(ft == comp->vm->tint && tt == comp->vm->tfloat) // int -> float
-  {
-    lux_compiler_alloc_register_generic(comp, rr);
-    lux_vm_closure_append_byte(comp->vm, closure, OP_ITOF);
-    lux_vm_closure_append_byte(comp->vm, closure, fr);
-    lux_vm_closure_append_byte(comp->vm, closure, *rr);
-    lux_compiler_free_register_generic(comp, fr);
-    return true;
-  }
-  else if(ft == comp->vm->tfloat && tt == comp->vm->tint) // float -> int
+  if(var->slot == -1)
   {
-    lux_compiler_alloc_register_generic(comp, rr);
-    lux_vm_closure_append_byte(comp->vm, closure, OP_FTOI);
-    lux_vm_closure_append_byte(comp->vm, closure, fr);
-    lux_vm_closure_append_byte(comp->vm, closure, *rr);
-    lux_compiler_free_register_generic(comp, fr);
+    *ret = var->r;
     return true;
   }
 
-  return false;
+  TRY(lux_compiler_alloc_register_generic(comp, ret))
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
+  lux_vm_closure_append_byte(comp->vm, closure, OP_RELOAD);
+  lux_vm_closure_append_byte(comp->vm, closure, *ret);
+  lux_vm_closure_append_int(comp->vm, closure, var->slot);
+  return true;
 }
 
 //-----------------------------------------------
-// Parses the operator and value after it
-// Uses recursion for operator precedence
+// Stores 'reg' into a variable, freeing it if
+// it's generic and the variable has a register
+// 'ret' receives a register holding the value
 // Returns false on fatal error
 //-----------------------------------------------
-static bool lux_compiler_expression_e(compiler_t* comp, closure_t* closure, int priority, unsigned char lreg, vmtype_t* ltype, unsigned char* _retreg, vmtype_t** _rettype)
+static bool lux_compiler_store_var(compiler_t* comp, closure_t* closure, cpvar_t* var, unsigned char reg, unsigned char* ret)
 {
-  // Get op
-  token_t op;
-  lux_lexer_get_token(comp->lex, &op);
-  if(!lux_operator_supported(&op))
+  if(var->slot == -1)
   {
-    // Invalid op, end of expression
-    lux_lexer_unget_last_token(comp->lex);
-    *_retreg = lreg;
-    *_rettype = ltype;
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+    lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+    lux_vm_closure_append_byte(comp->vm, closure, reg);
+    lux_vm_closure_append_byte(comp->vm, closure, var->r);
+    lux_compiler_free_register_generic(comp, reg);
+    *ret = var->r;
     return true;
   }
 
-  if(lux_operator_priority(&op) < priority)
-  {
-    // End of higher priority chain
-    lux_lexer_unget_last_token(comp->lex);
-    *_retreg = lreg;
-    *_rettype = ltype;
-    return true;
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
+  lux_vm_closure_append_byte(comp->vm, closure, OP_SPILL);
+  lux_vm_closure_append_byte(comp->vm, closure, reg);
+  lux_vm_closure_append_int(comp->vm, closure, var->slot);
+  *ret = reg;
+  return true;
+}
+
+//-----------------------------------------------
+// Returns true if a call can be replaced by the
+// body of the called function
+//-----------------------------------------------
+static bool lux_compiler_can_inline(compiler_t* comp, closure_t* closure, closure_t* called, unsigned char base)
+{
+  if(comp->optlevel == LUX_OPT_NONE || !comp->vm->inlining || called->native || called == closure)
+  {
+    return false;
   }
 
-  // Get op rvalue
-  token_t rvalue;
-  lux_lexer_get_token(comp->lex, &rvalue);
+  if(called->used > LUX_INLINE_SIZE || comp->inlined + called->used > LUX_INLINE_BUDGET)
+  {
+    return false;
+  }
 
-  unsigned char rval;
-  vmtype_t* rvtype;
-  TRY(lux_compiler_parse_value(comp, closure, &rvalue, &rval, &rvtype))
+  // Spill slots would have to be merged with ours
+  if(called->numslots > 0 || base + called->numregs > 256)
+  {
+    return false;
+  }
 
-  // Peek next op
-  token_t nextop;
-  lux_lexer_get_token(comp->lex, &nextop);
-  lux_lexer_unget_last_token(comp->lex);
-  while(lux_operator_priority(&nextop) > lux_operator_priority(&op) && lux_operator_supported(&nextop))
+  // Recursive functions are never flattened and tail calls would replace our frame
+  for(int offset = 0; offset < called->used; offset += lux_opcode_size(called->code[offset]))
   {
-    // Next operation has higher priority, do it first
-    unsigned char res;
-    vmtype_t* restype;
-    TRY(lux_compiler_expression_e(comp, closure, lux_operator_priority(&nextop), rval, rvtype, &res, &restype))
-    rval = res;
-    rvtype = restype;
-    // The next operation after is also higher priority (loop till we can break out)
-    lux_lexer_get_token(comp->lex, &nextop);
-    lux_lexer_unget_last_token(comp->lex);
+    unsigned char op = called->code[offset];
+    if(op == OP_TCALL || (op == OP_CALL && *(int*)(called->code + offset + 2) == called->index))
+    {
+      return false;
+    }
   }
 
-  // If at least one value is a float promote the other to float too
-  if(ltype == comp->vm->tfloat || rvtype == comp->vm->tfloat)
+  return true;
+}
+
+//-----------------------------------------------
+// Copies the code of a called function in place
+// of the call, its registers moved up to the
+// call window so the result lands in 'base'
+// like a call would leave it
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_inline_call(compiler_t* comp, closure_t* closure, closure_t* called, unsigned char base)
+{
+  // Returns become jumps to the end, the last one just falls through
+  int newoffset[LUX_INLINE_SIZE + 1];
+  int size = 0;
+  for(int offset = 0; offset < called->used; offset += lux_opcode_size(called->code[offset]))
   {
-    unsigned char tempreg;
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
-    if(lux_compiler_try_cast(comp, closure, ltype, lreg, comp->vm->tfloat, &tempreg))
+    newoffset[offset] = size;
+    if(called->code[offset] == OP_RET)
     {
-      ltype = comp->vm->tfloat;
-      lreg = tempreg;
+      size += offset + 1 == called->used ? 0 : 5;
     }
-    if(lux_compiler_try_cast(comp, closure, rvtype, rval, comp->vm->tfloat, &tempreg))
+    else
     {
-      rvtype = comp->vm->tfloat;
-      rval = tempreg;
+      size += lux_opcode_size(called->code[offset]);
     }
   }
+  newoffset[called->used] = size;
 
-  unsigned char resreg;
-  unsigned char resop;
-  vmtype_t* restype;
-  TRY(lux_instruction_for_operator(comp->vm, ltype, rvtype, &op, &resop, &restype))
-  TRY(lux_compiler_alloc_register_generic(comp, &resreg))
-
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 4));
-  lux_vm_closure_append_byte(comp->vm, closure, resop);
-  lux_vm_closure_append_byte(comp->vm, closure, lreg);
-  lux_vm_closure_append_byte(comp->vm, closure, rval);
-  lux_vm_closure_append_byte(comp->vm, closure, resreg);
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, size));
+  int start = closure->used;
+  for(int offset = 0; offset < called->used; offset += lux_opcode_size(called->code[offset]))
+  {
+    unsigned char* code = called->code + offset;
+    if(*code == OP_RET)
+    {
+      if(offset + 1 < called->used)
+      {
+        lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
+        lux_vm_closure_append_int(comp->vm, closure, start + size);
+      }
+      continue;
+    }
 
-  lux_compiler_free_register_generic(comp, lreg);
-  lux_compiler_free_register_generic(comp, rval);
+    unsigned char* c = closure->code + closure->used;
+    lux_vm_closure_append_bytes(comp->vm, closure, code, lux_opcode_size(*code));
 
-  *_retreg = rval = resreg;
-  *_rettype = rvtype = restype;
+    int positions[3];
+    int numregs = lux_opcode_registers(*code, positions);
+    for(int i = 0; i < numregs; i++)
+    {
+      c[positions[i]] += base;
+    }
 
-  // If we're the first iteration check again for more
-  if(priority == -1)
-  {
-    TRY(lux_compiler_expression_e(comp, closure, -1, rval, rvtype, _retreg, _rettype))
+    int target = lux_opcode_target(*code);
+    if(target)
+    {
+      *(int*)(c + target) = start + newoffset[*(int*)(code + target)];
+    }
   }
 
+  comp->rmax = base + called->numregs > comp->rmax ? base + called->numregs : comp->rmax;
+  comp->inlined += size;
+  comp->vm->inlinedcalls++;
+  lux_compiler_forget_emitted(comp);
   return true;
 }
 
 //-----------------------------------------------
-// Parses an expression
-// Parses the initial value then relies on
-// lux_compiler_expression_e to recursively
-// parse
-// Returns false on fatal error
+// Returns true if a call is worth running at
+// compile time once its arguments turn out to
+// be literals
 //-----------------------------------------------
-static bool lux_compiler_expression(compiler_t* comp, closure_t* closure, vmtype_t* wishtype, unsigned char* _retreg, vmtype_t** _rettype, bool allowprimary)
+static bool lux_compiler_can_evaluate(compiler_t* comp, closure_t* called)
 {
-  // Get value
-  token_t value;
-  lux_lexer_get_token(comp->lex, &value);
+  return comp->optlevel != LUX_OPT_NONE && comp->vm->evaluation && called->pure && called->rettype->can_be_variable;
+}
 
-  unsigned char valr;
-  vmtype_t* valtype;
-  // Check if we're trying to asign an expression to a variable
-  cpvar_t* var = lux_compiler_get_var(comp, &value);
-  if(var != NULL)
+//-----------------------------------------------
+// Returns true if a clone of a called function
+// with some arguments fixed to literals is worth
+// making, which is when one of them is tested by
+// a branch or switched on so the optimizer could
+// then decide where it goes
+//-----------------------------------------------
+static bool lux_compiler_can_specialize(compiler_t* comp, closure_t* closure, closure_t* called, bool* known)
+{
+  if(comp->optlevel < LUX_OPT_FULL || !comp->vm->specialization || called->native || called == closure)
   {
-    token_t nextop;
-    lux_lexer_get_token(comp->lex, &nextop);
+    return false;
+  }
 
-    if(nextop.type == TT_ASIGN)
+  for(int offset = 0; offset < called->used; offset += lux_opcode_size(called->code[offset]))
+  {
+    unsigned char op = called->code[offset];
+    if(op == OP_JMP || (!lux_opcode_target(op) && op != OP_JTAB))
     {
-      TRY(lux_compiler_expression(comp, closure, var->type, &valr, &valtype, false));
+      continue;
+    }
 
-      if(valtype != var->type)
+    int positions[3];
+    int numregs = lux_opcode_registers(op, positions);
+    for(int i = 0; i < numregs; i++)
+    {
+      int reg = called->code[offset + positions[i]];
+      if(reg >= 1 && reg <= called->numargs && known[reg - 1])
       {
-        lux_vm_set_error_ss(comp->vm, "Can't assign %s to %s", valtype->name, var->type->name);
-        return false;
+        return true;
       }
+    }
+  }
 
-      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
-      lux_vm_closure_append_byte(comp->vm, closure, valr);
-      lux_vm_closure_append_byte(comp->vm, closure, var->r);
-
-      lux_compiler_free_register_generic(comp, valr);
+  return false;
+}
 
-      *_retreg = var->r;
-      *_rettype = var->type;
+//-----------------------------------------------
+// Replaces 'called' with its clone for the known
+// literal arguments, making the clone the first
+// time they're seen
+// The clone loads the literals over the arguments
+// before running the original code, then goes
+// through the optimizer which folds them into it
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_specialize(compiler_t* comp, closure_t* closure, closure_t** called, bool* known, vmregister_t* literals)
+{
+  closure_t* original = *called;
+  if(!lux_compiler_can_specialize(comp, closure, original, known))
+  {
+    return true;
+  }
 
+  for(int c = 0; c < comp->numclones; c++)
+  {
+    cpclone_t* cached = &comp->clones[c];
+    bool same = cached->original == original;
+    for(int i = 0; same && i < original->numargs; i++)
+    {
+      same = cached->known[i] == known[i] && (!known[i] || cached->values[i].ivalue == literals[i].ivalue);
+    }
+    if(same)
+    {
+      *called = cached->clone;
+      comp->vm->specializedcalls++;
       return true;
     }
-    lux_lexer_unget_last_token(comp->lex);
   }
-  // Check if we're declaring a new variable
-  vmtype_t* type = lux_vm_get_type_t(comp->vm, &value);
-  if(allowprimary && type != NULL)
+
+  if(comp->numclones >= LUX_MAX_CLONES)
   {
-    token_t name;
-    lux_lexer_get_token(comp->lex, &name);
-    if(name.type != TT_NAME)
+    return true;
+  }
+
+  // The name can't be written in a script so it never clashes
+  char name[160];
+  snprintf(name, sizeof(name), "%s'%d", original->name, comp->vm->clones);
+  closure_t* clone = lux_vm_register_function_s(comp->vm, name, original->rettype);
+  TRY(clone)
+  clone->numargs = original->numargs;
+  memcpy(clone->args, original->args, sizeof(vmtype_t*) * original->numargs);
+  clone->numregs = original->numregs;
+  clone->numslots = original->numslots;
+  clone->pure = original->pure;
+
+  int prefix = 0;
+  for(int i = 0; i < original->numargs; i++)
+  {
+    prefix += known[i] ? 6 : 0;
+  }
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, clone, prefix + original->used));
+  for(int i = 0; i < original->numargs; i++)
+  {
+    if(known[i])
     {
-      lux_vm_set_error_t(comp->vm, "Expected variable name, got %s", &name);
-      return false;
+      lux_vm_closure_append_byte(comp->vm, clone, OP_LDI);
+      lux_vm_closure_append_byte(comp->vm, clone, i + 1);
+      lux_vm_closure_append_int(comp->vm, clone, literals[i].ivalue);
+    }
+  }
+  lux_vm_closure_append_bytes(comp->vm, clone, original->code, original->used);
+  for(int offset = prefix; offset < clone->used; offset += lux_opcode_size(clone->code[offset]))
+  {
+    int target = lux_opcode_target(clone->code[offset]);
+    if(target)
+    {
+      *(int*)(clone->code + offset + target) += prefix;
     }
+  }
+  lux_vm_closure_finish(comp->vm, clone, comp->optlevel);
+
+  cpclone_t* cached = &comp->clones[comp->numclones++];
+  cached->original = original;
+  cached->clone = clone;
+  memcpy(cached->known, known, sizeof(bool) * original->numargs);
+  memcpy(cached->values, literals, sizeof(vmregister_t) * original->numargs);
+  comp->vm->clones++;
+  comp->vm->specializedcalls++;
+  *called = clone;
+  return true;
+}
 
-    cpvar_t* var;
-    TRY(lux_compiler_register_var(comp, type, &name, &var))
+//-----------------------------------------------
+// Parses arguments for a function call and emits
+// the call, small functions are inlined instead
+// and pure ones called with literals are run
+// right away, leaving just their result, others
+// called with some literals call a clone
+// specialized for them
+// The arguments are placed in a window above all
+// used registers which becomes the callee's frame
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_function_call(compiler_t* comp, closure_t* closure, closure_t* called, unsigned char* ret)
+{
+  unsigned char base;
+  TRY(lux_compiler_alloc_register_window(comp, called->numargs + 1, &base))
 
-    token_t nextop;
-    lux_lexer_get_token(comp->lex, &nextop);
+  vmregister_t literals[LUX_MAX_ARGS];
+  bool known[LUX_MAX_ARGS];
+  bool constant = lux_compiler_can_evaluate(comp, called);
+  int start = closure->used;
+  int lastcall = comp->lastcall;
+  int lastbinop = comp->lastbinop;
+  int lastldi = comp->lastldi;
+  int ldirun = comp->ldirun;
 
-    if(nextop.type != TT_ASIGN)
-    {
-      if(!lux_operator_supported(&nextop))
-      {
-        lux_lexer_unget_last_token(comp->lex);
-        printf("WARN: Variable '%s' not initilazed\n", var->name);
-        return true;
-      }
+  TRY(lux_lexer_expect_token(comp->lex, '('))
+  for(int i = 0; i < called->numargs; i++)
+  {
+    vmtype_t* argtype;
+    unsigned char reg;
+    TRY(lux_compiler_expression(comp, closure, called->args[i], &reg, &argtype, false))
 
-      lux_vm_set_error(comp->vm, "Expected '='");
+    if(argtype != called->args[i])
+    {
+      lux_vm_set_error_ss(comp->vm, "Function expected argument of type %s, got %s instead", called->args[i]->name, argtype->name);
       return false;
     }
 
-    TRY(lux_compiler_expression(comp, closure, var->type, &valr, &valtype, false));
-
-    if(valtype != var->type)
+    int literal = lux_compiler_find_literal(comp, closure, reg);
+    known[i] = literal >= start;
+    if(known[i])
     {
-      lux_vm_set_error_ss(comp->vm, "Can't assign %s to %s", valtype->name, type->name);
-      return false;
+      literals[i] = *(vmregister_t*)(closure->code + literal + 2);
+    }
+    else
+    {
+      constant = false;
     }
 
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
-    lux_vm_closure_append_byte(comp->vm, closure, valr);
-    lux_vm_closure_append_byte(comp->vm, closure, var->r);
-
-    lux_compiler_free_register_generic(comp, valr);
+    // Arguments are computed straight into the window when possible
+    if(!lux_compiler_retarget(comp, closure, reg, base + i + 1))
+    {
+      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+      lux_vm_closure_append_byte(comp->vm, closure, reg);
+      lux_vm_closure_append_byte(comp->vm, closure, base + i + 1);
+    }
 
-    *_retreg = var->r;
-    *_rettype = var->type;
+    lux_compiler_free_register_generic(comp, reg);
 
-    return true;
+    if(i < called->numargs - 1)
+    {
+      TRY(lux_lexer_expect_token(comp->lex, ','))
+    }
   }
+  TRY(lux_lexer_expect_token(comp->lex, ')'))
 
-  // Try to get the value and parse the rest of the expression
-  TRY(lux_compiler_parse_value(comp, closure, &value, &valr, &valtype))
+  // Nothing but the literal arguments was emitted since 'start', they go
+  // away with the call and what came before can still be folded into
+  vmregister_t result;
+  if(constant && lux_vm_evaluate(comp->vm, called, literals, LUX_EVAL_STEPS, &result))
+  {
+    closure->used = start;
+    comp->lastcall = lastcall;
+    comp->lastbinop = lastbinop;
+    comp->lastldi = lastldi;
+    comp->ldirun = ldirun;
+    comp->jc = 0;
+    for(int i = 0; i <= called->numargs; i++)
+    {
+      lux_compiler_free_register_generic(comp, base + i);
+    }
+    comp->vm->evaluatedcalls++;
+    return lux_compiler_load_literal(comp, closure, result, ret);
+  }
 
-  // Peek next op
-  token_t nextop;
-  lux_lexer_get_token(comp->lex, &nextop);
-  lux_lexer_unget_last_token(comp->lex);
-  if(lux_operator_supported(&nextop))
+  if(lux_compiler_can_inline(comp, closure, called, base))
   {
-    // We got a valid operator, recurse
-    TRY(lux_compiler_expression_e(comp, closure, -1, valr, valtype, _retreg, _rettype))
+    TRY(lux_compiler_inline_call(comp, closure, called, base))
   }
   else
   {
-    // Only single value, set out vars
-    *_retreg = valr;
-    *_rettype = valtype;
+    TRY(lux_compiler_specialize(comp, closure, &called, known, literals))
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
+    comp->lastcall = closure->used;
+    lux_vm_closure_append_byte(comp->vm, closure, OP_CALL);
+    lux_vm_closure_append_byte(comp->vm, closure, base);
+    lux_vm_closure_append_int(comp->vm, closure, called->index);
   }
 
-  // Try to cast to desired type
-  unsigned char cr;
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-  if(lux_compiler_try_cast(comp, closure, *_rettype, *_retreg, wishtype, &cr))
+  // The return value stays in the window base
+  for(int i = 0; i < called->numargs; i++)
   {
-    *_retreg = cr;
-    *_rettype = wishtype;
+    lux_compiler_free_register_generic(comp, base + i + 1);
   }
+  *ret = base;
 
   return true;
 }
 
+// Intrinsics run inline in the interpreter instead of going through a
+// native call, script and native functions of the same name take precedence
+static const cpintrinsic_t lux_intrinsics[] =
+{
+  {"sqrt", 1, OP_NOP, OP_SQRTF},
+  {"abs", 1, OP_ABSI, OP_ABSF},
+  {"min", 2, OP_MINI, OP_MINF},
+  {"max", 2, OP_MAXI, OP_MAXF},
+  {"floor", 1, OP_NOP, OP_FLOORF},
+  {"fma", 3, OP_NOP, OP_FMAF},
+  {"clz", 1, OP_CLZ, OP_NOP},
+  {"popcount", 1, OP_POPCNT, OP_NOP},
+};
+
 //-----------------------------------------------
-// Parses an if statement
-// Uses recursion for 'else if' and 'else' chains
-// Returns false on fatal error
+// Returns the intrinsic called 'name', NULL if
+// there's none
 //-----------------------------------------------
-bool lux_compiler_if_statement(compiler_t* comp, closure_t* closure)
+static const cpintrinsic_t* lux_compiler_get_intrinsic(token_t* name)
 {
-  // Parse expression
-  TRY(lux_lexer_expect_token(comp->lex, '('))
-  unsigned char resval;
-  vmtype_t* restype;
-  TRY(lux_compiler_expression(comp, closure, comp->vm->tbool, &resval, &restype, false))
-  TRY(lux_lexer_expect_token(comp->lex, ')'))
-
-  if(restype != comp->vm->tbool)
+  for(int i = 0; i < (int)(sizeof(lux_intrinsics) / sizeof(lux_intrinsics[0])); i++)
   {
-    lux_vm_set_error_s(comp->vm, "Expected type bool in if expression, got %s", restype->name);
-    return false;
+    if(!strncmp(lux_intrinsics[i].name, name->buf, name->length) && strlen(lux_intrinsics[i].name) == name->length)
+    {
+      return &lux_intrinsics[i];
+    }
   }
 
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
-  lux_vm_closure_append_byte(comp->vm, closure, OP_BEQZ);
-  lux_vm_closure_append_byte(comp->vm, closure, resval);
-  int beqzoffset = closure->used;
-  lux_vm_closure_append_int(comp->vm, closure, 0);
+  return NULL;
+}
+
+//-----------------------------------------------
+// Parses the arguments of an intrinsic and emits
+// its instruction, literal arguments are folded
+// The first argument picks the int or float form
+// and the others are cast to its type
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_intrinsic_call(compiler_t* comp, closure_t* closure, const cpintrinsic_t* intrinsic, unsigned char* ret, vmtype_t** rettype)
+{
+  vmtype_t* type = intrinsic->iop == OP_NOP ? comp->vm->tfloat : intrinsic->fop == OP_NOP ? comp->vm->tint : NULL;
+  unsigned char regs[3];
+  int literals[3];
+
+  TRY(lux_lexer_expect_token(comp->lex, '('))
+  for(int i = 0; i < intrinsic->numargs; i++)
+  {
+    vmtype_t* argtype;
+    TRY(lux_compiler_expression(comp, closure, type, &regs[i], &argtype, false))
+
+    if(argtype != comp->vm->tint && argtype != comp->vm->tfloat)
+    {
+      lux_vm_set_error_ss(comp->vm, "Intrinsic %s expected an int or float argument, got %s instead", intrinsic->name, argtype->name);
+      return false;
+    }
+    if(type != NULL && argtype != type)
+    {
+      lux_vm_set_error_ss(comp->vm, "Intrinsic expected argument of type %s, got %s instead", type->name, argtype->name);
+      return false;
+    }
+    type = argtype;
+
+    if(i < intrinsic->numargs - 1)
+    {
+      TRY(lux_lexer_expect_token(comp->lex, ','))
+    }
+  }
+  TRY(lux_lexer_expect_token(comp->lex, ')'))
+
+  unsigned char op = type == comp->vm->tint ? intrinsic->iop : intrinsic->fop;
+  if(op == OP_NOP)
+  {
+    lux_vm_set_error_ss(comp->vm, "Intrinsic %s doesn't take %s arguments", intrinsic->name, type->name);
+    return false;
+  }
+  *rettype = type;
+
+  // Literals loaded back to back are folded into the first one
+  bool literal = intrinsic->numargs <= 2;
+  for(int i = 0; i < intrinsic->numargs && literal; i++)
+  {
+    literals[i] = lux_compiler_find_literal(comp, closure, regs[i]);
+    literal = literals[i] != -1 && literals[i] == literals[0] + i * 6;
+  }
+  vmregister_t folded;
+  if(literal && literals[intrinsic->numargs - 1] == comp->lastldi &&
+     lux_opcode_fold(op, *(vmregister_t*)(closure->code + literals[0] + 2), *(vmregister_t*)(closure->code + comp->lastldi + 2), &folded))
+  {
+    *(vmregister_t*)(closure->code + literals[0] + 2) = folded;
+    closure->used = literals[0] + 6;
+    comp->lastldi = literals[0];
+    comp->ldirun = comp->ldirun > literals[0] ? literals[0] : comp->ldirun;
+    for(int i = 1; i < intrinsic->numargs; i++)
+    {
+      lux_compiler_free_register_generic(comp, regs[i]);
+    }
+    *ret = regs[0];
+    return true;
+  }
+
+  if(op == OP_FMAF)
+  {
+    // The addend is overwritten by the result so it needs its own register
+    if(comp->r[regs[2]] != RS_GENERIC)
+    {
+      TRY(lux_compiler_alloc_register_generic(comp, ret))
+      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+      lux_vm_closure_append_byte(comp->vm, closure, regs[2]);
+      lux_vm_closure_append_byte(comp->vm, closure, *ret);
+    }
+    else
+    {
+      *ret = regs[2];
+    }
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 4));
+    lux_vm_closure_append_byte(comp->vm, closure, OP_FMAF);
+    lux_vm_closure_append_byte(comp->vm, closure, regs[0]);
+    lux_vm_closure_append_byte(comp->vm, closure, regs[1]);
+    lux_vm_closure_append_byte(comp->vm, closure, *ret);
+    lux_compiler_free_register_generic(comp, regs[0]);
+    lux_compiler_free_register_generic(comp, regs[1]);
+    return true;
+  }
+
+  TRY(lux_compiler_alloc_register_generic(comp, ret))
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 4));
+  comp->lastbinop = closure->used;
+  lux_vm_closure_append_byte(comp->vm, closure, op);
+  for(int i = 0; i < intrinsic->numargs; i++)
+  {
+    lux_vm_closure_append_byte(comp->vm, closure, regs[i]);
+    lux_compiler_free_register_generic(comp, regs[i]);
+  }
+  lux_vm_closure_append_byte(comp->vm, closure, *ret);
+
+  return true;
+}
+
+//-----------------------------------------------
+// Parses a value and tries to cast it
+// A value can be a single number, variable,
+// function call or an entire expression
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_parse_value(compiler_t* comp, closure_t* closure, token_t* value, unsigned char* ret, vmtype_t** rettype)
+{
+  int mod = TT_EOF;
+  switch(value->type)
+  {
+    case TT_PLUS:
+    case TT_MINUS:
+    case TT_LOGICNOT:
+    case TT_BWNOT:
+    {
+      mod = value->type;
+      lux_lexer_get_token(comp->lex, value);
+    }
+  }
+
+  // Parse the value
+  cpvar_t* var;
+  closure_t* c;
+  const cpintrinsic_t* intrinsic;
+  int literal;
+  if(lux_token_is_c(value, '('))
+  {
+    TRY(lux_compiler_expression(comp, closure, NULL, ret, rettype, false))
+    TRY(lux_lexer_expect_token(comp->lex, ')'))
+  }
+  else if(value->type == TT_NAME && (var = lux_compiler_get_var(comp, value)) != NULL)
+  {
+    TRY(lux_compiler_load_var(comp, closure, var, ret))
+    *rettype = var->type;
+  }
+  else if (value->type == TT_NAME && (c = lux_vm_get_function_t(comp->vm, value)) != NULL)
+  {
+    TRY(lux_compiler_function_call(comp, closure, c, ret))
+    *rettype = c->rettype;
+  }
+  else if(value->type == TT_NAME && (intrinsic = lux_compiler_get_intrinsic(value)) != NULL)
+  {
+    TRY(lux_compiler_intrinsic_call(comp, closure, intrinsic, ret, rettype))
+  }
+  else if(value->type == TT_INT)
+  {
+    vmregister_t literal;
+    literal.ivalue = value->ivalue;
+    TRY(lux_compiler_load_literal(comp, closure, literal, ret))
+    *rettype = comp->vm->tint;
+  }
+  else if(value->type == TT_FLOAT)
+  {
+    vmregister_t literal;
+    literal.fvalue = value->fvalue;
+    TRY(lux_compiler_load_literal(comp, closure, literal, ret))
+    *rettype = comp->vm->tfloat;
+  }
+  else if(value->type == TT_BOOL)
+  {
+    vmregister_t literal;
+    literal.ivalue = value->ivalue;
+    TRY(lux_compiler_load_literal(comp, closure, literal, ret))
+    *rettype = comp->vm->tbool;
+  }
+  else
+  {
+    lux_vm_set_error_t(comp->vm, "Failed to get value from: '%s'", value);
+    return false;
+  }
+
+  if(mod == TT_PLUS && *rettype == comp->vm->tint)
+  {
+    // Do nothing
+  }
+  else if(mod == TT_PLUS && *rettype == comp->vm->tfloat)
+  {
+    // Do nothing
+  }
+  else if((mod == TT_MINUS || mod == TT_LOGICNOT || mod == TT_BWNOT) && (literal = lux_compiler_find_literal(comp, closure, *ret)) != -1)
+  {
+    // Fold into the literal
+    vmregister_t* v = (vmregister_t*)(closure->code + literal + 2);
+    if(mod == TT_MINUS && *rettype == comp->vm->tint)
+    {
+      v->ivalue = (int)(0u - (unsigned int)v->ivalue);
+    }
+    else if(mod == TT_MINUS && *rettype == comp->vm->tfloat)
+    {
+      v->fvalue = -v->fvalue;
+    }
+    else if(mod == TT_LOGICNOT && *rettype == comp->vm->tbool)
+    {
+      v->ivalue = !v->ivalue;
+    }
+    else if(mod == TT_BWNOT && *rettype == comp->vm->tint)
+    {
+      v->ivalue = ~v->ivalue;
+    }
+    else
+    {
+      lux_vm_set_error(comp->vm, "Unexpected token in front of value");
+      return false;
+    }
+  }
+  else if(mod == TT_MINUS && (*rettype == comp->vm->tint || *rettype == comp->vm->tfloat))
+  {
+    // Negate
+    unsigned char r;
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+    TRY(lux_compiler_alloc_register_generic(comp, &r))
+    lux_vm_closure_append_byte(comp->vm, closure, *rettype == comp->vm->tint ? OP_NEGI : OP_NEGF);
+    lux_vm_closure_append_byte(comp->vm, closure, *ret);
+    lux_vm_closure_append_byte(comp->vm, closure, r);
+
+    lux_compiler_free_register_generic(comp, *ret);
+
+    *ret = r;
+  }
+  else if(mod == TT_LOGICNOT && *rettype == comp->vm->tbool)
+  {
+    // Logic not
+    unsigned char r;
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+    TRY(lux_compiler_alloc_register_generic(comp, &r))
+    lux_vm_closure_append_byte(comp->vm, closure, OP_LNOT);
+    lux_vm_closure_append_byte(comp->vm, closure, *ret);
+    lux_vm_closure_append_byte(comp->vm, closure, r);
+
+    lux_compiler_free_register_generic(comp, *ret);
+
+    *ret = r;
+  }
+  else if(mod == TT_BWNOT && *rettype == comp->vm->tint)
+  {
+    // Bitwise not on int
+    unsigned char r;
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+    TRY(lux_compiler_alloc_register_generic(comp, &r))
+    lux_vm_closure_append_byte(comp->vm, closure, OP_BNOT);
+    lux_vm_closure_append_byte(comp->vm, closure, *ret);
+    lux_vm_closure_append_byte(comp->vm, closure, r);
+
+    lux_compiler_free_register_generic(comp, *ret);
+
+    *ret = r;
+  }
+  else if(mod != TT_EOF)
+  {
+    lux_vm_set_error(comp->vm, "Unexpected token in front of value");
+    return false;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Tries to cast a value, return false if it
+// couldn't
+// NOTE: Doesn't allocate memory, you need to
+//       alloc 3 bytes before calling this!!!
+//-----------------------------------------------
+static bool lux_compiler_try_cast(compiler_t* comp, closure_t* closure, vmtype_t* ft, unsigned char fr, vmtype_t* tt, unsigned char* rr)
+{
+  // A literal is converted in place
+  int literal = lux_compiler_find_literal(comp, closure, fr);
+  if(literal != -1 && ft == comp->vm->tint && tt == comp->vm->tfloat)
+  {
+    vmregister_t* v = (vmregister_t*)(closure->code + literal + 2);
+    v->fvalue = (float)v->ivalue;
+    *rr = fr;
+    return true;
+  }
+  else if(literal != -1 && ft == comp->vm->tfloat && tt == comp->vm->tint)
+  {
+    // Out of range literals are left to OP_FTOI, converting them is undefined
+    vmregister_t* v = (vmregister_t*)(closure->code + literal + 2);
+    if(v->fvalue > -2147483649.0f && v->fvalue < 2147483648.0f)
+    {
+      v->ivalue = (int)v->fvalue;
+      *rr = fr;
+      return true;
+    }
+  }
+
+  if(ft == comp->vm->tint && tt == comp->vm->tfloat) // int -> float
+  {
+    lux_compiler_alloc_register_generic(comp, rr);
+    lux_vm_closure_append_byte(comp->vm, closure, OP_ITOF);
+    lux_vm_closure_append_byte(comp->vm, closure, fr);
+    lux_vm_closure_append_byte(comp->vm, closure, *rr);
+    lux_compiler_free_register_generic(comp, fr);
+    return true;
+  }
+  else if(ft == comp->vm->tfloat && tt == comp->vm->tint) // float -> int
+  {
+    lux_compiler_alloc_register_generic(comp, rr);
+    lux_vm_closure_append_byte(comp->vm, closure, OP_FTOI);
+    lux_vm_closure_append_byte(comp->vm, closure, fr);
+    lux_vm_closure_append_byte(comp->vm, closure, *rr);
+    lux_compiler_free_register_generic(comp, fr);
+    return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------
+// Parses the operator and value after it
+// Uses recursion for operator precedence
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_expression_e(compiler_t* comp, closure_t* closure, int priority, unsigned char lreg, vmtype_t* ltype, unsigned char* _retreg, vmtype_t** _rettype)
+{
+  // Get op
+  token_t op;
+  lux_lexer_get_token(comp->lex, &op);
+  if(!lux_operator_supported(&op))
+  {
+    // Invalid op, end of expression
+    lux_lexer_unget_last_token(comp->lex);
+    *_retreg = lreg;
+    *_rettype = ltype;
+    return true;
+  }
+
+  if(lux_operator_priority(&op) < priority)
+  {
+    // End of higher priority chain
+    lux_lexer_unget_last_token(comp->lex);
+    *_retreg = lreg;
+    *_rettype = ltype;
+    return true;
+  }
+
+  // Short circuit operators skip the right operand once the left one decides
+  cpjoin_t join;
+  bool shortcircuit = (op.type == TT_LOGICAND || op.type == TT_LOGICOR) && ltype == comp->vm->tbool;
+  if(shortcircuit)
+  {
+    join.jumpif = op.type == TT_LOGICOR;
+    join.chain = -1;
+    TRY(lux_compiler_branch(comp, closure, lreg, join.jumpif, &join.chain))
+    lux_compiler_free_register_generic(comp, lreg);
+    TRY(lux_compiler_alloc_register_generic(comp, &join.reg))
+  }
+
+  // Get op rvalue
+  token_t rvalue;
+  lux_lexer_get_token(comp->lex, &rvalue);
+
+  unsigned char rval;
+  vmtype_t* rvtype;
+  TRY(lux_compiler_parse_value(comp, closure, &rvalue, &rval, &rvtype))
+
+  // Peek next op
+  token_t nextop;
+  lux_lexer_get_token(comp->lex, &nextop);
+  lux_lexer_unget_last_token(comp->lex);
+  while(lux_operator_priority(&nextop) > lux_operator_priority(&op) && lux_operator_supported(&nextop))
+  {
+    // Next operation has higher priority, do it first
+    unsigned char res;
+    vmtype_t* restype;
+    TRY(lux_compiler_expression_e(comp, closure, lux_operator_priority(&nextop), rval, rvtype, &res, &restype))
+    rval = res;
+    rvtype = restype;
+    // The next operation after is also higher priority (loop till we can break out)
+    lux_lexer_get_token(comp->lex, &nextop);
+    lux_lexer_unget_last_token(comp->lex);
+  }
+
+  // If at least one value is a float promote the other to float too
+  if(ltype == comp->vm->tfloat || rvtype == comp->vm->tfloat)
+  {
+    unsigned char tempreg;
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
+    if(lux_compiler_try_cast(comp, closure, ltype, lreg, comp->vm->tfloat, &tempreg))
+    {
+      ltype = comp->vm->tfloat;
+      lreg = tempreg;
+    }
+    if(lux_compiler_try_cast(comp, closure, rvtype, rval, comp->vm->tfloat, &tempreg))
+    {
+      rvtype = comp->vm->tfloat;
+      rval = tempreg;
+    }
+  }
+
+  unsigned char resreg;
+  unsigned char resop;
+  vmtype_t* restype;
+  TRY(lux_instruction_for_operator(comp->vm, ltype, rvtype, &op, &resop, &restype))
+
+  if(shortcircuit)
+  {
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 14));
+    join.rreg = rval;
+    join.start = closure->used;
+    lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+    lux_vm_closure_append_byte(comp->vm, closure, rval);
+    lux_vm_closure_append_byte(comp->vm, closure, join.reg);
+    lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
+    int jmpoffset = closure->used;
+    lux_vm_closure_append_int(comp->vm, closure, 0);
+
+    // Remember the jumps so a branch on the result can retarget them
+    join.jumpc = 0;
+    for(int chain = join.chain; chain != -1; chain = *(int*)(closure->code + chain))
+    {
+      if(join.jumpc < 8)
+      {
+        join.jumps[join.jumpc] = chain;
+      }
+      join.jumpc++;
+    }
+    lux_compiler_patch(closure, join.chain, closure->used);
+
+    lux_vm_closure_append_byte(comp->vm, closure, OP_LDI);
+    lux_vm_closure_append_byte(comp->vm, closure, join.reg);
+    lux_vm_closure_append_int(comp->vm, closure, join.jumpif);
+    *(int*)(closure->code + jmpoffset) = closure->used;
+    join.end = closure->used;
+
+    if(join.jumpc <= 8)
+    {
+      if(comp->jc == 16)
+      {
+        memmove(comp->joins, comp->joins + 1, sizeof(cpjoin_t) * 15);
+        comp->jc--;
+      }
+      comp->joins[comp->jc++] = join;
+    }
+
+    lux_compiler_free_register_generic(comp, rval);
+
+    *_retreg = rval = join.reg;
+    *_rettype = rvtype = restype;
+
+    // If we're the first iteration check again for more
+    if(priority == -1)
+    {
+      TRY(lux_compiler_expression_e(comp, closure, -1, rval, rvtype, _retreg, _rettype))
+    }
+
+    return true;
+  }
+
+  // Two literals loaded back to back are folded into one
+  int lliteral = lux_compiler_find_literal(comp, closure, lreg);
+  int rliteral = lux_compiler_find_literal(comp, closure, rval);
+  vmregister_t folded;
+  if(rliteral == comp->lastldi && lliteral != -1 && lliteral + 6 == rliteral &&
+     lux_opcode_fold(resop, *(vmregister_t*)(closure->code + lliteral + 2), *(vmregister_t*)(closure->code + rliteral + 2), &folded))
+  {
+    *(vmregister_t*)(closure->code + lliteral + 2) = folded;
+    closure->used = rliteral;
+    comp->lastldi = lliteral;
+    comp->ldirun = comp->ldirun > lliteral ? lliteral : comp->ldirun;
+    lux_compiler_free_register_generic(comp, rval);
+
+    *_retreg = rval = lreg;
+    *_rettype = rvtype = restype;
+
+    if(priority == -1)
+    {
+      TRY(lux_compiler_expression_e(comp, closure, -1, rval, rvtype, _retreg, _rettype))
+    }
+
+    return true;
+  }
+
+  TRY(lux_compiler_alloc_register_generic(comp, &resreg))
+
+  // A literal operand loaded right before becomes an immediate
+  unsigned char immop = lux_opcode_immediate(resop);
+  unsigned char swapop = lux_opcode_immediate(lux_swapped_instruction(resop));
+  if(immop != OP_NOP && rliteral == comp->lastldi && rliteral != -1)
+  {
+    int value = *(int*)(closure->code + comp->lastldi + 2);
+    closure->used = comp->lastldi;
+    comp->lastldi = -1;
+
+    TRY(lux_compiler_emit_immediate(comp, closure, immop, lreg, value, resreg))
+  }
+  else if(swapop != OP_NOP && lliteral == comp->lastldi && lliteral != -1)
+  {
+    int value = *(int*)(closure->code + comp->lastldi + 2);
+    closure->used = comp->lastldi;
+    comp->lastldi = -1;
+
+    TRY(lux_compiler_emit_immediate(comp, closure, swapop, rval, value, resreg))
+  }
+  else
+  {
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 4));
+    comp->lastbinop = closure->used;
+    lux_vm_closure_append_byte(comp->vm, closure, resop);
+    lux_vm_closure_append_byte(comp->vm, closure, lreg);
+    lux_vm_closure_append_byte(comp->vm, closure, rval);
+    lux_vm_closure_append_byte(comp->vm, closure, resreg);
+  }
+
+  lux_compiler_free_register_generic(comp, lreg);
+  lux_compiler_free_register_generic(comp, rval);
+
+  *_retreg = rval = resreg;
+  *_rettype = rvtype = restype;
+
+  // If we're the first iteration check again for more
+  if(priority == -1)
+  {
+    TRY(lux_compiler_expression_e(comp, closure, -1, rval, rvtype, _retreg, _rettype))
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Returns true if the expression ahead of 'lex'
+// can be computed whether or not its value gets
+// used, it calls nothing but intrinsics, assigns
+// nothing and only divides by nonzero literals
+// 'lex' is a copy of the compiler's lexer, it's
+// left at the token ending the expression and
+// 'tokens' gets the number of tokens added
+//-----------------------------------------------
+static bool lux_compiler_is_speculable(compiler_t* comp, lexer_t* lex, int* tokens)
+{
+  token_t token;
+  while(true)
+  {
+    lux_lexer_get_token(lex, &token);
+    (*tokens)++;
+    if(token.type == TT_PLUS || token.type == TT_MINUS || token.type == TT_LOGICNOT || token.type == TT_BWNOT)
+    {
+      lux_lexer_get_token(lex, &token);
+      (*tokens)++;
+    }
+
+    if(lux_token_is_c(&token, '('))
+    {
+      if(!lux_compiler_is_speculable(comp, lex, tokens) || lux_lexer_get_token(lex, &token) == TT_EOF || !lux_token_is_c(&token, ')'))
+      {
+        return false;
+      }
+      (*tokens)++;
+    }
+    else if(token.type == TT_NAME && lux_compiler_get_var(comp, &token) == NULL)
+    {
+      // Calls can have side effects, intrinsics can't
+      if(lux_vm_get_function_t(comp->vm, &token) != NULL || lux_compiler_get_intrinsic(&token) == NULL ||
+         lux_lexer_get_token(lex, &token) == TT_EOF || !lux_token_is_c(&token, '('))
+      {
+        return false;
+      }
+      do
+      {
+        (*tokens)++;
+        if(!lux_compiler_is_speculable(comp, lex, tokens) || lux_lexer_get_token(lex, &token) == TT_EOF)
+        {
+          return false;
+        }
+      } while(lux_token_is_c(&token, ','));
+      (*tokens)++;
+      if(!lux_token_is_c(&token, ')'))
+      {
+        return false;
+      }
+    }
+    else if(token.type != TT_NAME && token.type != TT_INT && token.type != TT_FLOAT && token.type != TT_BOOL)
+    {
+      return false;
+    }
+
+    lux_lexer_get_token(lex, &token);
+    if(lux_token_is_c(&token, '?'))
+    {
+      (*tokens)++;
+      if(!lux_compiler_is_speculable(comp, lex, tokens) || lux_lexer_get_token(lex, &token) == TT_EOF || !lux_token_is_c(&token, ':'))
+      {
+        return false;
+      }
+      (*tokens)++;
+      return lux_compiler_is_speculable(comp, lex, tokens);
+    }
+    else if(!lux_operator_supported(&token))
+    {
+      lux_lexer_unget_last_token(lex);
+      return token.type != TT_ASIGN;
+    }
+    (*tokens)++;
+
+    if(token.type == TT_DIV || token.type == TT_MOD)
+    {
+      // Division traps on zero, only nonzero literals are safe
+      lux_lexer_get_token(lex, &token);
+      lux_lexer_unget_last_token(lex);
+      if(!(token.type == TT_INT && token.ivalue != 0) && !(token.type == TT_FLOAT && token.fvalue != 0.0f))
+      {
+        return false;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------
+// Returns true if the compiler may pick between
+// values with a select
+//-----------------------------------------------
+static bool lux_compiler_can_select(compiler_t* comp)
+{
+  return comp->optlevel != LUX_OPT_NONE && comp->vm->selects;
+}
+
+//-----------------------------------------------
+// Parses the values of a ternary after its '?'
+// When both are cheap and safe to compute they
+// are and a select picks one, otherwise only the
+// one chosen by the bool in 'cond' runs
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_ternary(compiler_t* comp, closure_t* closure, unsigned char cond, vmtype_t* wishtype, unsigned char* _retreg, vmtype_t** _rettype)
+{
+  lexer_t lex = *comp->lex;
+  int atokens = 0;
+  int btokens = 0;
+  token_t token;
+  bool select = lux_compiler_can_select(comp) &&
+                lux_compiler_is_speculable(comp, &lex, &atokens) && atokens <= LUX_SELECT_TOKENS &&
+                lux_lexer_get_token(&lex, &token) != TT_EOF && lux_token_is_c(&token, ':') &&
+                lux_compiler_is_speculable(comp, &lex, &btokens) && btokens <= LUX_SELECT_TOKENS;
+
+  int elseoffset = -1;
+  if(!select)
+  {
+    TRY(lux_compiler_branch(comp, closure, cond, false, &elseoffset))
+    lux_compiler_free_register_generic(comp, cond);
+  }
+
+  unsigned char areg;
+  vmtype_t* atype;
+  TRY(lux_compiler_expression(comp, closure, wishtype, &areg, &atype, false))
+  TRY(lux_lexer_expect_token(comp->lex, ':'))
+
+  unsigned char res = areg;
+  int endoffset = -1;
+  if(!select)
+  {
+    // Both values end up in the same register
+    if(comp->r[areg] != RS_GENERIC)
+    {
+      TRY(lux_compiler_alloc_register_generic(comp, &res))
+      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+      lux_vm_closure_append_byte(comp->vm, closure, areg);
+      lux_vm_closure_append_byte(comp->vm, closure, res);
+    }
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 5));
+    lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
+    lux_compiler_append_chain(comp, closure, &endoffset);
+    lux_compiler_patch(closure, elseoffset, closure->used);
+    lux_compiler_forget_emitted(comp);
+  }
+
+  unsigned char breg;
+  vmtype_t* btype;
+  TRY(lux_compiler_expression(comp, closure, wishtype ? wishtype : atype, &breg, &btype, false))
+
+  if(atype != btype)
+  {
+    lux_vm_set_error_ss(comp->vm, "Ternary values have different types %s and %s", atype->name, btype->name);
+    return false;
+  }
+
+  if(!select)
+  {
+    if(!lux_compiler_retarget(comp, closure, breg, res))
+    {
+      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+      lux_vm_closure_append_byte(comp->vm, closure, breg);
+      lux_vm_closure_append_byte(comp->vm, closure, res);
+    }
+    lux_compiler_free_register_generic(comp, breg);
+    lux_compiler_patch(closure, endoffset, closure->used);
+    lux_compiler_forget_emitted(comp);
+
+    *_retreg = res;
+    *_rettype = atype;
+    return true;
+  }
+
+  // The second value is overwritten by the first one if the condition holds
+  res = breg;
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 7));
+  if(comp->r[breg] != RS_GENERIC)
+  {
+    TRY(lux_compiler_alloc_register_generic(comp, &res))
+    lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+    lux_vm_closure_append_byte(comp->vm, closure, breg);
+    lux_vm_closure_append_byte(comp->vm, closure, res);
+  }
+  lux_vm_closure_append_byte(comp->vm, closure, OP_SEL);
+  lux_vm_closure_append_byte(comp->vm, closure, cond);
+  lux_vm_closure_append_byte(comp->vm, closure, areg);
+  lux_vm_closure_append_byte(comp->vm, closure, res);
+  lux_compiler_free_register_generic(comp, cond);
+  lux_compiler_free_register_generic(comp, areg);
+  comp->vm->selectedbranches++;
+
+  *_retreg = res;
+  *_rettype = atype;
+  return true;
+}
+
+//-----------------------------------------------
+// Parses an expression
+// Parses the initial value then relies on
+// lux_compiler_expression_e to recursively
+// parse
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_expression(compiler_t* comp, closure_t* closure, vmtype_t* wishtype, unsigned char* _retreg, vmtype_t** _rettype, bool allowprimary)
+{
+  // Get value
+  token_t value;
+  lux_lexer_get_token(comp->lex, &value);
+
+  unsigned char valr;
+  vmtype_t* valtype;
+  // Check if we're trying to asign an expression to a variable
+  cpvar_t* var = lux_compiler_get_var(comp, &value);
+  if(var != NULL)
+  {
+    token_t nextop;
+    lux_lexer_get_token(comp->lex, &nextop);
+
+    if(nextop.type == TT_ASIGN)
+    {
+      TRY(lux_compiler_expression(comp, closure, var->type, &valr, &valtype, false));
+
+      if(valtype != var->type)
+      {
+        lux_vm_set_error_ss(comp->vm, "Can't assign %s to %s", valtype->name, var->type->name);
+        return false;
+      }
+
+      TRY(lux_compiler_store_var(comp, closure, var, valr, _retreg))
+      *_rettype = var->type;
+
+      return true;
+    }
+    lux_lexer_unget_last_token(comp->lex);
+  }
+  // Check if we're declaring a new variable
+  vmtype_t* type = lux_vm_get_type_t(comp->vm, &value);
+  if(allowprimary && type != NULL)
+  {
+    token_t name;
+    lux_lexer_get_token(comp->lex, &name);
+    if(name.type != TT_NAME)
+    {
+      lux_vm_set_error_t(comp->vm, "Expected variable name, got %s", &name);
+      return false;
+    }
+
+    cpvar_t* var;
+    TRY(lux_compiler_register_var(comp, type, &name, &var))
+
+    token_t nextop;
+    lux_lexer_get_token(comp->lex, &nextop);
+
+    if(nextop.type != TT_ASIGN)
+    {
+      if(!lux_operator_supported(&nextop))
+      {
+        lux_lexer_unget_last_token(comp->lex);
+        printf("WARN: Variable '%.*s' not initilazed\n", var->length, var->name);
+        return true;
+      }
+
+      lux_vm_set_error(comp->vm, "Expected '='");
+      return false;
+    }
+
+    TRY(lux_compiler_expression(comp, closure, var->type, &valr, &valtype, false));
+
+    if(valtype != var->type)
+    {
+      lux_vm_set_error_ss(comp->vm, "Can't assign %s to %s", valtype->name, type->name);
+      return false;
+    }
+
+    TRY(lux_compiler_store_var(comp, closure, var, valr, _retreg))
+    *_rettype = var->type;
+
+    return true;
+  }
+
+  // Try to get the value and parse the rest of the expression
+  TRY(lux_compiler_parse_value(comp, closure, &value, &valr, &valtype))
+
+  // Peek next op
+  token_t nextop;
+  lux_lexer_get_token(comp->lex, &nextop);
+  lux_lexer_unget_last_token(comp->lex);
+  if(lux_operator_supported(&nextop))
+  {
+    // We got a valid operator, recurse
+    TRY(lux_compiler_expression_e(comp, closure, -1, valr, valtype, _retreg, _rettype))
+  }
+  else
+  {
+    // Only single value, set out vars
+    *_retreg = valr;
+    *_rettype = valtype;
+  }
+
+  // A bool followed by '?' picks one of the two values after it
+  lux_lexer_get_token(comp->lex, &nextop);
+  if(lux_token_is_c(&nextop, '?'))
+  {
+    if(*_rettype != comp->vm->tbool)
+    {
+      lux_vm_set_error_s(comp->vm, "Expected type bool before '?', got %s", (*_rettype)->name);
+      return false;
+    }
+    TRY(lux_compiler_ternary(comp, closure, *_retreg, wishtype, _retreg, _rettype))
+  }
+  else
+  {
+    lux_lexer_unget_last_token(comp->lex);
+  }
+
+  // Try to cast to desired type
+  unsigned char cr;
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+  if(lux_compiler_try_cast(comp, closure, *_rettype, *_retreg, wishtype, &cr))
+  {
+    *_retreg = cr;
+    *_rettype = wishtype;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Returns the variable a block assigns if that
+// is all it does and the value can be computed
+// whether or not the block runs, NULL otherwise
+// 'lex' is a copy of the compiler's lexer, it's
+// left past the block
+//-----------------------------------------------
+static cpvar_t* lux_compiler_selectable_block(compiler_t* comp, lexer_t* lex)
+{
+  token_t token;
+  lux_lexer_get_token(lex, &token);
+  if(!lux_token_is_c(&token, '{'))
+  {
+    return NULL;
+  }
+
+  lux_lexer_get_token(lex, &token);
+  cpvar_t* var = token.type == TT_NAME ? lux_compiler_get_var(comp, &token) : NULL;
+  if(var == NULL || var->slot != -1 || lux_lexer_get_token(lex, &token) != TT_ASIGN)
+  {
+    return NULL;
+  }
+
+  int tokens = 0;
+  if(!lux_compiler_is_speculable(comp, lex, &tokens) || tokens > LUX_SELECT_TOKENS)
+  {
+    return NULL;
+  }
+
+  lux_lexer_get_token(lex, &token);
+  return lux_token_is_c(&token, '}') ? var : NULL;
+}
+
+//-----------------------------------------------
+// Parses a block lux_compiler_selectable_block
+// accepted up to the value assigned to 'var'
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_selectable_value(compiler_t* comp, closure_t* closure, cpvar_t* var, unsigned char* _retreg)
+{
+  token_t token;
+  TRY(lux_lexer_expect_token(comp->lex, '{'))
+  lux_lexer_get_token(comp->lex, &token);
+  lux_lexer_get_token(comp->lex, &token);
+
+  vmtype_t* type;
+  TRY(lux_compiler_expression(comp, closure, var->type, _retreg, &type, false))
+  TRY(lux_lexer_expect_token(comp->lex, '}'))
+
+  if(type != var->type)
+  {
+    lux_vm_set_error_ss(comp->vm, "Can't assign %s to %s", type->name, var->type->name);
+    return false;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Compiles an if statement that only assigns a
+// variable, optionally with an else assigning
+// the same one, to a select on 'cond'
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_select_assignment(compiler_t* comp, closure_t* closure, unsigned char cond, cpvar_t* var, bool haselse)
+{
+  unsigned char areg;
+  TRY(lux_compiler_selectable_value(comp, closure, var, &areg))
+
+  if(haselse)
+  {
+    // The variable gets the else value first, keep what the select reads
+    // out of it
+    unsigned char* keep[2] = {&cond, &areg};
+    for(int i = 0; i < 2; i++)
+    {
+      if(*keep[i] == var->r)
+      {
+        TRY(lux_compiler_alloc_register_generic(comp, keep[i]))
+        TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+        lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+        lux_vm_closure_append_byte(comp->vm, closure, var->r);
+        lux_vm_closure_append_byte(comp->vm, closure, *keep[i]);
+      }
+    }
+
+    token_t token;
+    lux_lexer_get_token(comp->lex, &token);
+    unsigned char breg;
+    TRY(lux_compiler_selectable_value(comp, closure, var, &breg))
+    if(!lux_compiler_retarget(comp, closure, breg, var->r))
+    {
+      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+      lux_vm_closure_append_byte(comp->vm, closure, breg);
+      lux_vm_closure_append_byte(comp->vm, closure, var->r);
+    }
+    lux_compiler_free_register_generic(comp, breg);
+  }
+
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 4));
+  lux_vm_closure_append_byte(comp->vm, closure, OP_SEL);
+  lux_vm_closure_append_byte(comp->vm, closure, cond);
+  lux_vm_closure_append_byte(comp->vm, closure, areg);
+  lux_vm_closure_append_byte(comp->vm, closure, var->r);
+  lux_compiler_free_register_generic(comp, cond);
+  lux_compiler_free_register_generic(comp, areg);
+  comp->vm->selectedbranches++;
+  return true;
+}
+
+//-----------------------------------------------
+// Parses an if statement
+// Uses recursion for 'else if' and 'else' chains
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_compiler_if_statement(compiler_t* comp, closure_t* closure)
+{
+  // Parse expression
+  TRY(lux_lexer_expect_token(comp->lex, '('))
+  unsigned char resval;
+  vmtype_t* restype;
+  TRY(lux_compiler_expression(comp, closure, comp->vm->tbool, &resval, &restype, false))
+  TRY(lux_lexer_expect_token(comp->lex, ')'))
+
+  if(restype != comp->vm->tbool)
+  {
+    lux_vm_set_error_s(comp->vm, "Expected type bool in if expression, got %s", restype->name);
+    return false;
+  }
+
+  // Assigning one variable in the if and maybe the same one in an else
+  // doesn't need a branch
+  lexer_t lex = *comp->lex;
+  cpvar_t* var = lux_compiler_can_select(comp) ? lux_compiler_selectable_block(comp, &lex) : NULL;
+  token_t token;
+  bool haselse = var != NULL && lux_lexer_get_token(&lex, &token) != TT_EOF && lux_token_is_str(&token, "else");
+  if(haselse && lux_compiler_selectable_block(comp, &lex) != var)
+  {
+    var = NULL;
+  }
+  if(var != NULL)
+  {
+    return lux_compiler_select_assignment(comp, closure, resval, var, haselse);
+  }
+
+  int branchoffset = -1;
+  TRY(lux_compiler_branch(comp, closure, resval, false, &branchoffset))
+
+  lux_compiler_free_register_generic(comp, resval);
+
+  TRY(lux_compiler_scope(comp, closure))
+
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 5));
+  lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
+  int jmpoffset = closure->used;
+  lux_vm_closure_append_int(comp->vm, closure, 0);
+
+  lux_compiler_patch(closure, branchoffset, closure->used);
+
+  // Check for chain
+  lux_lexer_get_token(comp->lex, &token);
+  if(lux_token_is_str(&token, "else"))
+  {
+    lux_lexer_get_token(comp->lex, &token);
+    if(lux_token_is_str(&token, "if"))
+    {
+      TRY(lux_compiler_if_statement(comp, closure));
+      *(int*)(closure->code + jmpoffset) = closure->used;
+      return true;
+    }
+    else
+    {
+      lux_lexer_unget_last_token(comp->lex);
+    }
+    TRY(lux_compiler_scope(comp, closure))
+    *(int*)(closure->code + jmpoffset) = closure->used;
+  }
+  else
+  {
+    *(int*)(closure->code + jmpoffset) = closure->used;
+    lux_lexer_unget_last_token(comp->lex);
+  }
 
-  lux_compiler_free_register_generic(comp, resval);
+  return true;
+}
 
-  TRY(lux_compiler_scope(comp, closure))
+//-----------------------------------------------
+// Skips tokens up to and including 'end' outside
+// of any parentheses
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_skip_past(compiler_t* comp, char end)
+{
+  int depth = 0;
+  token_t token;
+  while(lux_lexer_get_token(comp->lex, &token) != TT_EOF)
+  {
+    if(depth == 0 && lux_token_is_c(&token, end))
+    {
+      return true;
+    }
+    depth += lux_token_is_c(&token, '(') - lux_token_is_c(&token, ')');
+  }
+
+  lux_vm_set_error_t(comp->vm, "Unexpected token: %s", &token);
+  return false;
+}
+
+//-----------------------------------------------
+// Reads the case values of a switch ahead of
+// its body into 'cases', sorted by value
+// 'lex' is a copy of the compiler's lexer right
+// past the '{' of the switch, left where an
+// error was found
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_switch_cases(compiler_t* comp, lexer_t* lex, cpcase_t* cases, int* _numcases)
+{
+  int numcases = 0;
+  int numclauses = 0;
+  int depth = 0;
+  token_t token;
+  while(true)
+  {
+    if(lux_lexer_get_token(lex, &token) == TT_EOF)
+    {
+      lux_vm_set_error(comp->vm, "Expected '}' at the end of the switch");
+      return false;
+    }
+    if(depth == 0 && lux_token_is_c(&token, '}'))
+    {
+      break;
+    }
+    depth += lux_token_is_c(&token, '{') - lux_token_is_c(&token, '}');
+    if(depth != 0 || !lux_token_is_str(&token, "case"))
+    {
+      continue;
+    }
+
+    do
+    {
+      lux_lexer_get_token(lex, &token);
+      bool negative = token.type == TT_MINUS;
+      if(negative)
+      {
+        lux_lexer_get_token(lex, &token);
+      }
+      if(token.type != TT_INT)
+      {
+        lux_vm_set_error_t(comp->vm, "Expected an int literal after case, got %s", &token);
+        return false;
+      }
+      if(numcases == LUX_MAX_CASES)
+      {
+        lux_vm_set_error(comp->vm, "Too many cases in a switch");
+        return false;
+      }
+
+      int value = negative ? (int)(0u - (unsigned int)token.ivalue) : token.ivalue;
+      int at = numcases++;
+      for(; at > 0 && cases[at - 1].value > value; at--)
+      {
+        cases[at] = cases[at - 1];
+      }
+      if(at > 0 && cases[at - 1].value == value)
+      {
+        char number[16];
+        snprintf(number, sizeof(number), "%d", value);
+        lux_vm_set_error_s(comp->vm, "Duplicate case value %s", number);
+        return false;
+      }
+      cases[at].value = value;
+      cases[at].clause = numclauses;
+
+      lux_lexer_get_token(lex, &token);
+    } while(lux_token_is_c(&token, ','));
+
+    if(!lux_token_is_c(&token, ':'))
+    {
+      lux_vm_set_error_t(comp->vm, "Expected ':' after the case values, got %s", &token);
+      return false;
+    }
+    numclauses++;
+  }
+
+  *_numcases = numcases;
+  return true;
+}
+
+//-----------------------------------------------
+// Emits a binary search for the value of a
+// switch among cases[lo] .. cases[hi - 1], the
+// last few get compared one by one
+// Jumps to every clause are added to its chain
+// in 'chains', ones for values without a case to
+// 'defaultchain'
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_switch_search(compiler_t* comp, closure_t* closure, unsigned char value, cpcase_t* cases, int lo, int hi, int* chains, int* defaultchain)
+{
+  if(hi - lo <= 3)
+  {
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, (hi - lo) * 10 + 5));
+    for(int i = lo; i < hi; i++)
+    {
+      lux_vm_closure_append_byte(comp->vm, closure, OP_BEQI_K);
+      lux_vm_closure_append_byte(comp->vm, closure, value);
+      lux_vm_closure_append_int(comp->vm, closure, cases[i].value);
+      lux_compiler_append_chain(comp, closure, &chains[cases[i].clause]);
+    }
+    lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
+    lux_compiler_append_chain(comp, closure, defaultchain);
+    return true;
+  }
+
+  int mid = lo + (hi - lo) / 2;
+  int below = -1;
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 10));
+  lux_vm_closure_append_byte(comp->vm, closure, OP_BLTI_K);
+  lux_vm_closure_append_byte(comp->vm, closure, value);
+  lux_vm_closure_append_int(comp->vm, closure, cases[mid].value);
+  lux_compiler_append_chain(comp, closure, &below);
+
+  TRY(lux_compiler_switch_search(comp, closure, value, cases, mid, hi, chains, defaultchain))
+  lux_compiler_patch(closure, below, closure->used);
+  return lux_compiler_switch_search(comp, closure, value, cases, lo, mid, chains, defaultchain);
+}
+
+//-----------------------------------------------
+// Emits the jumps from the value of a switch to
+// its clauses, through a jump table when the
+// case values are dense enough and a binary
+// search otherwise
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_switch_dispatch(compiler_t* comp, closure_t* closure, unsigned char value, cpcase_t* cases, int numcases, int* chains, int* defaultchain)
+{
+  long long span = numcases > 0 ? (long long)cases[numcases - 1].value - cases[0].value + 1 : 0;
+  if(numcases < LUX_SWITCH_TABLE || span > (long long)numcases * LUX_SWITCH_DENSITY)
+  {
+    return lux_compiler_switch_search(comp, closure, value, cases, 0, numcases, chains, defaultchain);
+  }
+
+  // One entry for every value in the span and a last one for the rest,
+  // values without a case go to the default too
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 10 + ((int)span + 1) * 5));
+  lux_vm_closure_append_byte(comp->vm, closure, OP_JTAB);
+  lux_vm_closure_append_byte(comp->vm, closure, value);
+  lux_vm_closure_append_int(comp->vm, closure, cases[0].value);
+  lux_vm_closure_append_int(comp->vm, closure, (int)span);
+  for(int i = 0, entry = 0; entry < span; entry++)
+  {
+    lux_vm_closure_append_byte(comp->vm, closure, OP_CASE);
+    if(cases[i].value == cases[0].value + entry)
+    {
+      lux_compiler_append_chain(comp, closure, &chains[cases[i++].clause]);
+    }
+    else
+    {
+      lux_compiler_append_chain(comp, closure, defaultchain);
+    }
+  }
+  lux_vm_closure_append_byte(comp->vm, closure, OP_CASE);
+  lux_compiler_append_chain(comp, closure, defaultchain);
+  return true;
+}
+
+//-----------------------------------------------
+// Parses a switch statement over an int
+// Every case clause runs up to the next one and
+// leaves the switch, there's no falling through
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_compiler_switch_statement(compiler_t* comp, closure_t* closure)
+{
+  TRY(lux_lexer_expect_token(comp->lex, '('))
+  unsigned char value;
+  vmtype_t* type;
+  TRY(lux_compiler_expression(comp, closure, comp->vm->tint, &value, &type, false))
+  TRY(lux_lexer_expect_token(comp->lex, ')'))
+
+  if(type != comp->vm->tint)
+  {
+    lux_vm_set_error_s(comp->vm, "Expected type int in switch expression, got %s", type->name);
+    return false;
+  }
+
+  TRY(lux_lexer_expect_token(comp->lex, '{'))
+  cpcase_t cases[LUX_MAX_CASES];
+  int chains[LUX_MAX_CASES];
+  int numcases;
+  lexer_t lex = *comp->lex;
+  if(!lux_compiler_switch_cases(comp, &lex, cases, &numcases))
+  {
+    // Errors are reported where the scan ahead stopped, not at the '{'
+    comp->lex->line = lex.line;
+    comp->lex->column = lex.column;
+    return false;
+  }
+
+  // The value is dispatched on before any clause runs
+  int defaultchain = -1;
+  for(int i = 0; i < numcases; i++)
+  {
+    chains[i] = -1;
+  }
+  TRY(lux_compiler_switch_dispatch(comp, closure, value, cases, numcases, chains, &defaultchain))
+  lux_compiler_free_register_generic(comp, value);
+
+  int endchain = -1;
+  int clause = 0;
+  bool hasdefault = false;
+  token_t token;
+  lux_lexer_get_token(comp->lex, &token);
+  while(!lux_token_is_c(&token, '}'))
+  {
+    if(lux_token_is_str(&token, "case"))
+    {
+      // The values were read ahead
+      TRY(lux_compiler_skip_past(comp, ':'))
+      lux_compiler_patch(closure, chains[clause++], closure->used);
+    }
+    else if(lux_token_is_str(&token, "default") && !hasdefault)
+    {
+      TRY(lux_lexer_expect_token(comp->lex, ':'))
+      lux_compiler_patch(closure, defaultchain, closure->used);
+      defaultchain = -1;
+      hasdefault = true;
+    }
+    else
+    {
+      lux_vm_set_error_t(comp->vm, "Expected case or default, got %s", &token);
+      return false;
+    }
+    lux_compiler_forget_emitted(comp);
+
+    lux_compiler_enter_scope(comp);
+    lux_lexer_get_token(comp->lex, &token);
+    while(!lux_token_is_c(&token, '}') && !lux_token_is_str(&token, "case") && !lux_token_is_str(&token, "default"))
+    {
+      TRY(lux_compiler_statement(comp, closure, &token))
+      lux_lexer_get_token(comp->lex, &token);
+    }
+    lux_compiler_leave_scope(comp);
+
+    if(!lux_token_is_c(&token, '}'))
+    {
+      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 5));
+      lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
+      lux_compiler_append_chain(comp, closure, &endchain);
+    }
+  }
+
+  lux_compiler_patch(closure, defaultchain, closure->used);
+  lux_compiler_patch(closure, endchain, closure->used);
+  lux_compiler_forget_emitted(comp);
+  return true;
+}
 
+//-----------------------------------------------
+// Emits the jump into a loop, the condition is
+// compiled at the bottom so an iteration only
+// takes the branch back to the top
+// Returns the offset of the jump's target in
+// 'jmpoffset'
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_enter_loop(compiler_t* comp, closure_t* closure, int* jmpoffset)
+{
   TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 5));
   lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
-  int jmpoffset = closure->used;
+  *jmpoffset = closure->used;
   lux_vm_closure_append_int(comp->vm, closure, 0);
+  return true;
+}
+
+//-----------------------------------------------
+// Parses a while statement
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_compiler_while_statement(compiler_t* comp, closure_t* closure)
+{
+  // Skip the expression, it goes after the body
+  TRY(lux_lexer_expect_token(comp->lex, '('))
+  lexer_t condition = *comp->lex;
+  TRY(lux_compiler_skip_past(comp, ')'))
+
+  int jmpoffset;
+  TRY(lux_compiler_enter_loop(comp, closure, &jmpoffset))
+  int start = closure->used;
 
-  *(int*)(closure->code + beqzoffset) = closure->used;
+  TRY(lux_compiler_scope(comp, closure))
 
-  // Check for chain
+  // Parse expression
+  *(int*)(closure->code + jmpoffset) = closure->used;
+  lux_compiler_forget_emitted(comp);
+  lexer_t end = *comp->lex;
+  *comp->lex = condition;
+
+  unsigned char resval;
+  vmtype_t* restype;
+  TRY(lux_compiler_expression(comp, closure, comp->vm->tbool, &resval, &restype, false))
+  TRY(lux_lexer_expect_token(comp->lex, ')'))
+
+  if(restype != comp->vm->tbool)
+  {
+    lux_vm_set_error_s(comp->vm, "Expected type bool in if expression, got %s", restype->name);
+    return false;
+  }
+
+  int branchoffset = -1;
+  TRY(lux_compiler_branch(comp, closure, resval, true, &branchoffset))
+  lux_compiler_patch(closure, branchoffset, start);
+
+  lux_compiler_free_register_generic(comp, resval);
+
+  *comp->lex = end;
+  return true;
+}
+
+//-----------------------------------------------
+// Returns the register variable a token names,
+// NULL if it isn't the name of an int variable
+// held in a register
+//-----------------------------------------------
+static cpvar_t* lux_compiler_int_register_var(compiler_t* comp, token_t* token)
+{
+  cpvar_t* var = token->type == TT_NAME ? lux_compiler_get_var(comp, token) : NULL;
+  return var != NULL && var->type == comp->vm->tint && var->slot == -1 ? var : NULL;
+}
+
+//-----------------------------------------------
+// Checks if a for loop steps an int variable by a
+// constant towards a variable or literal limit,
+// like for(int i = 0; i < n; i = i + 1)
+// 'condition' and 'increment' are where those
+// clauses start
+// Fills the counter, the comparison, the limit
+// and the step if so
+//-----------------------------------------------
+static bool lux_compiler_counted_loop(compiler_t* comp, lexer_t* condition, lexer_t* increment, unsigned char* counter, unsigned char* cmp, token_t* limit, int* step)
+{
+  lexer_t lex = *condition;
+  token_t t[6];
+  for(int i = 0; i < 4; i++)
+  {
+    lux_lexer_get_token(&lex, &t[i]);
+  }
+
+  cpvar_t* var = lux_compiler_int_register_var(comp, &t[0]);
+  if(var == NULL || !lux_token_is_c(&t[3], ';') || (t[2].type != TT_INT && lux_compiler_int_register_var(comp, &t[2]) == NULL))
+  {
+    return false;
+  }
+  switch(t[1].type)
+  {
+    case TT_LESS: *cmp = OP_LTI; break;
+    case TT_LESSEQ: *cmp = OP_LTEI; break;
+    case TT_MORE: *cmp = OP_MTI; break;
+    case TT_MOREEQ: *cmp = OP_MTEI; break;
+    default: return false;
+  }
+  *counter = var->r;
+  *limit = t[2];
+
+  // i = i + step, i = i - step or i = step + i
+  lex = *increment;
+  for(int i = 0; i < 6; i++)
+  {
+    lux_lexer_get_token(&lex, &t[i]);
+  }
+  if(lux_compiler_int_register_var(comp, &t[0]) != var || t[1].type != TT_ASIGN || !lux_token_is_c(&t[5], ')'))
+  {
+    return false;
+  }
+  if(lux_compiler_int_register_var(comp, &t[2]) == var && (t[3].type == TT_PLUS || t[3].type == TT_MINUS) && t[4].type == TT_INT)
+  {
+    *step = t[3].type == TT_PLUS ? t[4].ivalue : -t[4].ivalue;
+    return true;
+  }
+  if(t[2].type == TT_INT && t[3].type == TT_PLUS && lux_compiler_int_register_var(comp, &t[4]) == var)
+  {
+    *step = t[2].ivalue;
+    return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------
+// Works out how many times a counted loop runs
+// when its counter was just set to a literal and
+// its limit is one, the body starting at 'body'
+// must not assign the counter
+// Fills the trip count and the number of tokens
+// in the body if so
+//-----------------------------------------------
+static bool lux_compiler_trip_count(compiler_t* comp, closure_t* closure, lexer_t* body, unsigned char counter, unsigned char cmp, token_t* limit, int step, int* count, int* tokens)
+{
+  // The literal is either loaded straight into the counter or moved there
+  int ldi = comp->lastldi;
+  if(limit->type != TT_INT || ldi == -1)
+  {
+    return false;
+  }
+  unsigned char* mov = closure->code + ldi + 6;
+  if(!(ldi + 6 == closure->used && closure->code[ldi + 1] == counter) &&
+     !(ldi + 9 == closure->used && mov[0] == OP_MOV && mov[1] == closure->code[ldi + 1] && mov[2] == counter))
+  {
+    return false;
+  }
+
+  long long from = *(int*)(closure->code + ldi + 2);
+  long long to = limit->ivalue;
+  long long n;
+  if(cmp == OP_LTI && step > 0)
+  {
+    n = from < to ? (to - from + step - 1) / step : 0;
+  }
+  else if(cmp == OP_LTEI && step > 0)
+  {
+    n = from <= to ? (to - from) / step + 1 : 0;
+  }
+  else if(cmp == OP_MTI && step < 0)
+  {
+    n = from > to ? (from - to - step - 1) / -step : 0;
+  }
+  else if(cmp == OP_MTEI && step < 0)
+  {
+    n = from >= to ? (from - to) / -step + 1 : 0;
+  }
+  else
+  {
+    return false;
+  }
+
+  // The counter would wrap around before reaching the limit
+  if(n == 0 || from + n * step < INT_MIN || from + n * step > INT_MAX)
+  {
+    return false;
+  }
+
+  lexer_t lex = *body;
   token_t token;
-  lux_lexer_get_token(comp->lex, &token);
-  if(lux_token_is_str(&token, "else"))
+  int depth = 0;
+  *tokens = 0;
+  do
+  {
+    if(lux_lexer_get_token(&lex, &token) == TT_EOF)
+    {
+      return false;
+    }
+    depth += lux_token_is_c(&token, '{') - lux_token_is_c(&token, '}');
+    (*tokens)++;
+
+    cpvar_t* var = lux_compiler_int_register_var(comp, &token);
+    if(var != NULL && var->r == counter)
+    {
+      token_t next;
+      lux_lexer_get_token(&lex, &next);
+      lux_lexer_unget_last_token(&lex);
+      if(next.type == TT_ASIGN)
+      {
+        return false;
+      }
+    }
+  } while(depth > 0);
+
+  *count = n > INT_MAX ? INT_MAX : (int)n;
+  return true;
+}
+
+//-----------------------------------------------
+// Compiles copies of a loop body starting at
+// 'body', each followed by a step of the counter
+// but the last one when 'steplast' is false
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_unroll(compiler_t* comp, closure_t* closure, lexer_t* body, unsigned char counter, int step, int copies, bool steplast)
+{
+  for(int i = 0; i < copies; i++)
   {
-    lux_lexer_get_token(comp->lex, &token);
-    if(lux_token_is_str(&token, "if"))
-    {
-      TRY(lux_compiler_if_statement(comp, closure));
-      *(int*)(closure->code + jmpoffset) = closure->used;
-      return true;
-    }
-    else
+    *comp->lex = *body;
+    TRY(lux_compiler_scope(comp, closure))
+    if(i < copies - 1 || steplast)
     {
-      lux_lexer_unget_last_token(comp->lex);
+      TRY(lux_compiler_emit_immediate(comp, closure, OP_ADDI_K, counter, step, counter))
     }
-    TRY(lux_compiler_scope(comp, closure))
-    *(int*)(closure->code + jmpoffset) = closure->used;
-  }
-  else
-  {
-    *(int*)(closure->code + jmpoffset) = closure->used;
-    lux_lexer_unget_last_token(comp->lex);
   }
 
   return true;
 }
 
 //-----------------------------------------------
-// Parses a while statement
+// Compiles the body of a counted for loop, the
+// condition is checked once on entry and a single
+// instruction steps the counter and checks it
+// again at the bottom
+// Loops with a known trip count are unrolled,
+// short ones fully, so the optimizer sees the
+// counter as a literal in every copy, longer
+// ones into a few copies per check
 // Returns false on fatal error
 //-----------------------------------------------
-bool lux_compiler_while_statement(compiler_t* comp, closure_t* closure)
+static bool lux_compiler_counted_for(compiler_t* comp, closure_t* closure, unsigned char counter, unsigned char cmp, token_t* limit, int step)
 {
-  int start = closure->used;
-  
-  // Parse expression
-  TRY(lux_lexer_expect_token(comp->lex, '('))
-  unsigned char resval;
-  vmtype_t* restype;
-  TRY(lux_compiler_expression(comp, closure, comp->vm->tbool, &resval, &restype, false))
-  TRY(lux_lexer_expect_token(comp->lex, ')'))
-
-  if(restype != comp->vm->tbool)
+  int count;
+  int tokens;
+  int copies = 1;
+  lexer_t body = *comp->lex;
+  if(comp->optlevel != LUX_OPT_NONE && comp->vm->unrolling && lux_compiler_trip_count(comp, closure, &body, counter, cmp, limit, step, &count, &tokens))
   {
-    lux_vm_set_error_s(comp->vm, "Expected type bool in if expression, got %s", restype->name);
-    return false;
+    if(count <= LUX_UNROLL_FULL && count * tokens <= LUX_UNROLL_TOKENS)
+    {
+      comp->vm->unrolledloops++;
+      return lux_compiler_unroll(comp, closure, &body, counter, step, count, true);
+    }
+    if(count >= LUX_UNROLL_FACTOR && LUX_UNROLL_FACTOR * tokens <= LUX_UNROLL_TOKENS)
+    {
+      // Leftover iterations go first so the loop runs a whole number of times
+      copies = LUX_UNROLL_FACTOR;
+      comp->vm->unrolledloops++;
+      TRY(lux_compiler_unroll(comp, closure, &body, counter, step, count % copies, true))
+    }
   }
 
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
-  lux_vm_closure_append_byte(comp->vm, closure, OP_BEQZ);
-  lux_vm_closure_append_byte(comp->vm, closure, resval);
-  int beqzoffset = closure->used;
-  lux_vm_closure_append_int(comp->vm, closure, 0);
+  unsigned char reg;
+  if(limit->type == TT_INT)
+  {
+    vmregister_t value;
+    value.ivalue = limit->ivalue;
+    TRY(lux_compiler_load_literal(comp, closure, value, &reg))
+  }
+  else
+  {
+    reg = lux_compiler_get_var(comp, limit)->r;
+  }
 
-  lux_compiler_free_register_generic(comp, resval);
+  // Unrolled loops are known to run at least once
+  int exitoffset = -1;
+  if(copies == 1)
+  {
+    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 7));
+    lux_vm_closure_append_byte(comp->vm, closure, lux_branch_for_comparison(cmp, false));
+    lux_vm_closure_append_byte(comp->vm, closure, counter);
+    lux_vm_closure_append_byte(comp->vm, closure, reg);
+    exitoffset = closure->used;
+    lux_vm_closure_append_int(comp->vm, closure, 0);
+  }
+  lux_compiler_forget_emitted(comp);
+  int start = closure->used;
 
-  TRY(lux_compiler_scope(comp, closure))
+  TRY(lux_compiler_unroll(comp, closure, &body, counter, step, copies, false))
 
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 5));
-  lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
+  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 11));
+  lux_vm_closure_append_byte(comp->vm, closure, OP_FORLT + (cmp - OP_LTI));
+  lux_vm_closure_append_byte(comp->vm, closure, counter);
+  lux_vm_closure_append_byte(comp->vm, closure, reg);
+  lux_vm_closure_append_int(comp->vm, closure, step);
   lux_vm_closure_append_int(comp->vm, closure, start);
+  if(exitoffset != -1)
+  {
+    *(int*)(closure->code + exitoffset) = closure->used;
+  }
+  lux_compiler_forget_emitted(comp);
 
-  *(int*)(closure->code + beqzoffset) = closure->used;
-
+  if(limit->type == TT_INT)
+  {
+    lux_compiler_free_register_generic(comp, reg);
+  }
   return true;
 }
 
@@ -756,30 +2587,32 @@ bool lux_compiler_for_statement(compiler_t* comp, closure_t* closure)
 
   TRY(lux_lexer_expect_token(comp->lex, ';'))
 
-  int start = closure->used;
-  
-  // Conditional expression
-  unsigned char resval;
-  vmtype_t* restype;
-  TRY(lux_compiler_expression(comp, closure, comp->vm->tbool, &resval, &restype, true))
-
-  if(restype != comp->vm->tbool)
+  // Skip the other two, they go after the body
+  lexer_t condition = *comp->lex;
+  TRY(lux_compiler_skip_past(comp, ';'))
+  lexer_t increment = *comp->lex;
+  TRY(lux_compiler_skip_past(comp, ')'))
+
+  unsigned char counter;
+  unsigned char cmp;
+  token_t limit;
+  int step;
+  if(lux_compiler_counted_loop(comp, &condition, &increment, &counter, &cmp, &limit, &step))
   {
-    lux_vm_set_error_s(comp->vm, "for loop condition needs to evaluate to 'bool' not '%s'", restype->name);
-    return false;
+    TRY(lux_compiler_counted_for(comp, closure, counter, cmp, &limit, step))
+    lux_compiler_leave_scope(comp);
+    return true;
   }
 
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 6));
-  lux_vm_closure_append_byte(comp->vm, closure, OP_BEQZ);
-  lux_vm_closure_append_byte(comp->vm, closure, resval);
-  int beqzoffset = closure->used;
-  lux_vm_closure_append_int(comp->vm, closure, 0);
+  int jmpoffset;
+  TRY(lux_compiler_enter_loop(comp, closure, &jmpoffset))
+  int start = closure->used;
 
-  TRY(lux_lexer_expect_token(comp->lex, ';'))
-  
-  // Third set of expressions appended to the end
-  closure_t tempclosure;
-  memset(&tempclosure, 0, sizeof(closure_t));
+  TRY(lux_compiler_scope(comp, closure))
+  lexer_t end = *comp->lex;
+
+  // Third set of expressions
+  *comp->lex = increment;
   seconditer = false;
   while(true)
   {
@@ -798,26 +2631,34 @@ bool lux_compiler_for_statement(compiler_t* comp, closure_t* closure)
 
     unsigned char resval;
     vmtype_t* restype;
-    TRY(lux_compiler_expression(comp, &tempclosure, NULL, &resval, &restype, true))
+    TRY(lux_compiler_expression(comp, closure, NULL, &resval, &restype, true))
     lux_compiler_free_register_generic(comp, resval);
     seconditer = true;
   }
 
-  TRY(lux_lexer_expect_token(comp->lex, ')'))
+  // Conditional expression
+  *(int*)(closure->code + jmpoffset) = closure->used;
+  lux_compiler_forget_emitted(comp);
+  *comp->lex = condition;
 
-  TRY(lux_compiler_scope(comp, closure))
+  unsigned char resval;
+  vmtype_t* restype;
+  TRY(lux_compiler_expression(comp, closure, comp->vm->tbool, &resval, &restype, true))
+  TRY(lux_lexer_expect_token(comp->lex, ';'))
 
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, tempclosure.used));
-  lux_vm_closure_append_bytes(comp->vm, closure, tempclosure.code, tempclosure.used);
-  xfree(comp->vm, tempclosure.code);
-  
-  // Jump to condition at the start
-  TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 5));
-  lux_vm_closure_append_byte(comp->vm, closure, OP_JMP);
-  lux_vm_closure_append_int(comp->vm, closure, start);
+  if(restype != comp->vm->tbool)
+  {
+    lux_vm_set_error_s(comp->vm, "for loop condition needs to evaluate to 'bool' not '%s'", restype->name);
+    return false;
+  }
+
+  int branchoffset = -1;
+  TRY(lux_compiler_branch(comp, closure, resval, true, &branchoffset))
+  lux_compiler_patch(closure, branchoffset, start);
 
-  *(int*)(closure->code + beqzoffset) = closure->used;
+  lux_compiler_free_register_generic(comp, resval);
 
+  *comp->lex = end;
   lux_compiler_leave_scope(comp);
   return true;
 }
@@ -848,10 +2689,31 @@ bool lux_compiler_return_statement(compiler_t* comp, closure_t* closure)
       return false;
     }
 
-    TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-    lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
-    lux_vm_closure_append_byte(comp->vm, closure, retvalue);
-    lux_vm_closure_append_byte(comp->vm, closure, 0);
+    // 'return f(...)' where the call is the last thing emitted and its
+    // result is returned as is, reuse our frame for the callee
+    if(comp->lastcall != -1 && comp->lastcall + 6 == closure->used && closure->code[comp->lastcall + 1] == retvalue)
+    {
+      closure_t* called = comp->vm->functiontable[*(int*)(closure->code + comp->lastcall + 2)];
+      if(!called->native)
+      {
+        closure->code[comp->lastcall] = OP_TCALL;
+        lux_compiler_free_register_generic(comp, retvalue);
+
+        // Never reached, keeps the closure ending in OP_RET
+        TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 1));
+        lux_vm_closure_append_byte(comp->vm, closure, OP_RET);
+        return true;
+      }
+    }
+
+    // r0 is the caller's destination, compute the value right into it
+    if(!lux_compiler_retarget(comp, closure, retvalue, 0))
+    {
+      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
+      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
+      lux_vm_closure_append_byte(comp->vm, closure, retvalue);
+      lux_vm_closure_append_byte(comp->vm, closure, 0);
+    }
 
     lux_compiler_free_register_generic(comp, retvalue);
   }
@@ -874,53 +2736,78 @@ static bool lux_compiler_scope(compiler_t* comp, closure_t* closure)
     token_t token;
     lux_lexer_get_token(comp->lex, &token);
 
-    if(lux_token_is_c(&token, '{'))
-    {
-      lux_lexer_unget_last_token(comp->lex);
-      TRY(lux_compiler_scope(comp, closure))
-      continue;
-    }
-    else if(lux_token_is_c(&token, '}'))
+    if(lux_token_is_c(&token, '}'))
     {
       lux_compiler_leave_scope(comp);
       return true;
     }
-    else if(lux_token_is_str(&token, "if"))
-    {
-      TRY(lux_compiler_if_statement(comp, closure))
-      continue;
-    }
-    else if(lux_token_is_str(&token, "while"))
-    {
-      TRY(lux_compiler_while_statement(comp, closure))
-      continue;
-    }
-    else if(lux_token_is_str(&token, "for"))
-    {
-      TRY(lux_compiler_for_statement(comp, closure))
-      continue;
-    }
-    else if(lux_token_is_str(&token, "return"))
-    {
-      TRY(lux_compiler_return_statement(comp, closure))
-      continue;
-    }
-    else
+
+    TRY(lux_compiler_statement(comp, closure, &token))
+  }
+}
+
+//-----------------------------------------------
+// Parses the statement starting with 'token',
+// the last token read
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_compiler_statement(compiler_t* comp, closure_t* closure, token_t* token)
+{
+  if(lux_token_is_c(token, '{'))
+  {
+    lux_lexer_unget_last_token(comp->lex);
+    return lux_compiler_scope(comp, closure);
+  }
+  else if(lux_token_is_str(token, "if"))
+  {
+    return lux_compiler_if_statement(comp, closure);
+  }
+  else if(lux_token_is_str(token, "switch"))
+  {
+    return lux_compiler_switch_statement(comp, closure);
+  }
+  else if(lux_token_is_str(token, "while"))
+  {
+    return lux_compiler_while_statement(comp, closure);
+  }
+  else if(lux_token_is_str(token, "for"))
+  {
+    return lux_compiler_for_statement(comp, closure);
+  }
+  else if(lux_token_is_str(token, "return"))
+  {
+    return lux_compiler_return_statement(comp, closure);
+  }
+
+  lux_lexer_unget_last_token(comp->lex);
+  unsigned char resval;
+  vmtype_t* restype;
+  TRY(lux_compiler_expression(comp, closure, NULL, &resval, &restype, true));
+  lux_compiler_free_register_generic(comp, resval);
+  return true;
+}
+
+//-----------------------------------------------
+// Returns true if a finished script function
+// can't have side effects, it only calls itself
+// and other pure functions
+//-----------------------------------------------
+static bool lux_compiler_is_pure(vm_t* vm, closure_t* closure)
+{
+  for(int offset = 0; offset < closure->used; offset += lux_opcode_size(closure->code[offset]))
+  {
+    unsigned char op = closure->code[offset];
+    if(op == OP_CALL || op == OP_TCALL)
     {
-      lux_lexer_unget_last_token(comp->lex);
-      unsigned char resval;
-      vmtype_t* restype;
-      TRY(lux_compiler_expression(comp, closure, NULL, &resval, &restype, true));
-      lux_compiler_free_register_generic(comp, resval);
-      continue;
+      closure_t* called = vm->functiontable[*(int*)(closure->code + offset + 2)];
+      if(called != closure && !called->pure)
+      {
+        return false;
+      }
     }
-
-    lux_vm_set_error_t(comp->vm, "Unexpected token: %s", &token);
-    return false;
   }
 
-  assert(false);
-  return false;
+  return true;
 }
 
 //-----------------------------------------------
@@ -933,6 +2820,8 @@ bool lux_compiler_compile_file(compiler_t* comp)
   while(lux_lexer_get_token(comp->lex, &dummy) != TT_EOF)
   {
     lux_compiler_clear_registers(comp);
+    lux_compiler_forget_emitted(comp);
+    comp->inlined = 0;
 
     lux_lexer_unget_last_token(comp->lex);
     token_t rettype;
@@ -971,6 +2860,9 @@ bool lux_compiler_compile_file(compiler_t* comp)
 
     lux_compiler_enter_scope(comp);
 
+    // Variables for the arguments are bound to the registers the
+    // arguments arrive in once they're all known
+    token_t argnames[LUX_MAX_ARGS];
     TRY(lux_lexer_expect_token(comp->lex, '('))
     bool read_function_args = !lux_lexer_expect_token(comp->lex, ')');
     if(read_function_args)
@@ -1005,22 +2897,16 @@ bool lux_compiler_compile_file(compiler_t* comp)
       token_t name;
       lux_lexer_get_token(comp->lex, &name);
 
-      cpvar_t* var;
-      TRY(lux_compiler_register_var(comp, vt, &name, &var))
-      if(closure->numargs > 12)
+      if(closure->numargs == LUX_MAX_ARGS)
       {
-        lux_vm_set_error(comp->vm, "A function can only have up to 12 arguments");
+        lux_vm_set_error(comp->vm, "A function has too many arguments");
         return false;
       }
 
+      argnames[closure->numargs] = name;
       closure->args[closure->numargs] = vt;
       closure->numargs++;
 
-      TRYMEM(lux_vm_closure_ensure_free(comp->vm, closure, 3));
-      lux_vm_closure_append_byte(comp->vm, closure, OP_MOV);
-      lux_vm_closure_append_byte(comp->vm, closure, closure->numargs);
-      lux_vm_closure_append_byte(comp->vm, closure, var->r);
-
       if(lux_lexer_expect_token(comp->lex, ')'))
       {
         break;
@@ -1035,6 +2921,12 @@ bool lux_compiler_compile_file(compiler_t* comp)
       lux_lexer_unget_last_token(comp->lex);
     }
 
+    lux_compiler_reserve_arguments(comp, closure->numargs);
+    for(int i = 0; i < closure->numargs; i++)
+    {
+      TRY(lux_compiler_register_arg(comp, closure->args[i], &argnames[i], i + 1))
+    }
+
     TRY(lux_compiler_scope(comp, closure));
 
     if(!lux_vm_closure_last_byte_is(comp->vm, closure, OP_RET))
@@ -1050,19 +2942,79 @@ bool lux_compiler_compile_file(compiler_t* comp)
         lux_vm_closure_append_byte(comp->vm, closure, OP_RET);
       }
     }
-    lux_vm_closure_finish(comp->vm, closure);
+    closure->numregs = comp->rmax > closure->numargs + 1 ? comp->rmax : closure->numargs + 1;
+    closure->numslots = comp->maxslots;
+    lux_vm_closure_finish(comp->vm, closure, comp->optlevel);
+    closure->pure = lux_compiler_is_pure(comp->vm, closure);
     lux_compiler_leave_scope(comp);
   }
   return true;
 }
 
 //-----------------------------------------------
-// Clears all registers to RS_NOT_USED
+// Clears all registers to RS_NOT_USED and frees
+// every spill slot
 //-----------------------------------------------
 void lux_compiler_clear_registers(compiler_t* comp)
 {
   memset(comp->r, 0, sizeof(int) * 256);
+  memset(comp->rbits, 0, sizeof(comp->rbits));
   comp->r[0] = true;
+  comp->rbits[0] = 1;
+  comp->rmax = 1;
+  comp->slots = 0;
+  comp->maxslots = 0;
+}
+
+//-----------------------------------------------
+// Marks a register as used with the given state
+//-----------------------------------------------
+static void lux_compiler_take_register(compiler_t* comp, int reg, int state)
+{
+  comp->r[reg] = state;
+  comp->rbits[reg / 32] |= 1u << (reg % 32);
+  comp->rmax = reg + 1 > comp->rmax ? reg + 1 : comp->rmax;
+}
+
+//-----------------------------------------------
+// Keeps r1... for the arguments of the function
+// being compiled for as long as it's compiled,
+// their variables live right there
+//-----------------------------------------------
+void lux_compiler_reserve_arguments(compiler_t* comp, int numargs)
+{
+  for(int i = 1; i <= numargs; i++)
+  {
+    lux_compiler_take_register(comp, i, RS_ARGUMENT);
+  }
+}
+
+//-----------------------------------------------
+// Returns the lowest register at or above 'from'
+// whose bit is clear in a set of 256 registers,
+// -1 if there's none
+//-----------------------------------------------
+int lux_register_set_first_free(unsigned int* set, int from)
+{
+  for(int w = from / 32; w < 8; w++)
+  {
+    unsigned int free = ~set[w];
+    if(w == from / 32)
+    {
+      free &= ~0u << (from % 32);
+    }
+    if(free)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+      return w * 32 + __builtin_ctz(free);
+#else
+      int bit = 0;
+      for(; !(free & 1u); free >>= 1, bit++) {}
+      return w * 32 + bit;
+#endif
+    }
+  }
+  return -1;
 }
 
 //-----------------------------------------------
@@ -1071,40 +3023,65 @@ void lux_compiler_clear_registers(compiler_t* comp)
 //-----------------------------------------------
 bool lux_compiler_alloc_register_generic(compiler_t* comp, unsigned char* reg)
 {
-  // r0 is return values
-  // r1 - 12 is func args
-  for(int i = 1 + 12; i < 256; i++)
+  int i = lux_register_set_first_free(comp->rbits, 1);
+  if(i == -1)
   {
-    if(comp->r[i] == RS_NOT_USED)
-    {
-      comp->r[i] = RS_GENERIC;
-      *reg = i;
-      return true;
-    }
+    lux_vm_set_error(comp->vm, "Compiler ran out of registers");
+    return false;
   }
-  lux_vm_set_error(comp->vm, "Compiler ran out of registers");
-  return false;
+
+  lux_compiler_take_register(comp, i, RS_GENERIC);
+  *reg = i;
+  return true;
 }
 
 //-----------------------------------------------
 // Allocates a register of type RS_VARIABLE
-// Returns false on fatal error
+// Variables only get registers below
+// LUX_VARIABLE_REGISTERS so temporaries and call
+// windows always have room
+// Returns false if there's none left, the
+// variable has to be spilled
 //-----------------------------------------------
 bool lux_compiler_alloc_register_variable(compiler_t* comp, unsigned char* reg)
 {
-  // r0 is return values
-  // r1 - 12 is func args
-  for(int i = 1 + 12; i < 256; i++)
+  int i = lux_register_set_first_free(comp->rbits, 1);
+  if(i == -1 || i >= LUX_VARIABLE_REGISTERS)
   {
-    if(comp->r[i] == RS_NOT_USED)
-    {
-      comp->r[i] = RS_VARIABLE;
-      *reg = i;
-      return true;
-    }
+    return false;
   }
-  lux_vm_set_error(comp->vm, "Compiler ran out of registers");
-  return false;
+
+  lux_compiler_take_register(comp, i, RS_VARIABLE);
+  *reg = i;
+  return true;
+}
+
+//-----------------------------------------------
+// Allocates 'num' consecutive registers of type
+// RS_GENERIC above every register in use
+// Used as the frame window of a call, everything
+// above 'base' gets clobbered by the callee
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_compiler_alloc_register_window(compiler_t* comp, int num, unsigned char* base)
+{
+  int w = 7;
+  for(; w > 0 && comp->rbits[w] == 0; w--) {}
+  int top = w * 32 + 31;
+  for(; top > 0 && comp->r[top] == RS_NOT_USED; top--) {}
+
+  if(top + num > 255)
+  {
+    lux_vm_set_error(comp->vm, "Compiler ran out of registers");
+    return false;
+  }
+
+  for(int i = top + 1; i <= top + num; i++)
+  {
+    lux_compiler_take_register(comp, i, RS_GENERIC);
+  }
+  *base = top + 1;
+  return true;
 }
 
 //-----------------------------------------------
@@ -1116,6 +3093,7 @@ void lux_compiler_free_register_generic(compiler_t* comp, unsigned char reg)
   if(comp->r[reg] == RS_GENERIC)
   {
     comp->r[reg] = RS_NOT_USED;
+    comp->rbits[reg / 32] &= ~(1u << (reg % 32));
   }
 }
 
@@ -1128,18 +3106,19 @@ void lux_compiler_free_register_variable(compiler_t* comp, unsigned char reg)
   if(comp->r[reg] == RS_VARIABLE)
   {
     comp->r[reg] = RS_NOT_USED;
+    comp->rbits[reg / 32] &= ~(1u << (reg % 32));
   }
 }
 
 //-----------------------------------------------
-// Registers a variable
+// Adds a variable without a place to live yet
 // Returns false on fatal error
 //-----------------------------------------------
-bool lux_compiler_register_var(compiler_t* comp, vmtype_t* type, token_t* name, cpvar_t** var)
+static bool lux_compiler_new_var(compiler_t* comp, vmtype_t* type, token_t* name, cpvar_t** var)
 {
   for(int i = 0; i < comp->vc; i++)
   {
-    if(!strncmp(comp->vars[i].name, name->buf, name->length) && strlen(comp->vars[i].name) == name->length)
+    if(comp->vars[i].length == name->length && !strncmp(comp->vars[i].name, name->buf, name->length))
     {
       lux_vm_set_error_t(comp->vm, "Variable %s already exists", name);
       return false;
@@ -1154,29 +3133,56 @@ bool lux_compiler_register_var(compiler_t* comp, vmtype_t* type, token_t* name,
     }
   }
 
-  if(comp->vc == 128)
-  {
-    lux_vm_set_error(comp->vm, "Maximum allowed number of local variables is 128");
-    return false;
-  }
-
-  if(name->length > 127)
+  if(comp->vc == LUX_MAX_LOCALS)
   {
-    lux_vm_set_error(comp->vm, "A variable name can be up to 128 bytes");
+    lux_vm_set_error(comp->vm, "Function has too many local variables");
     return false;
   }
 
   cpvar_t* v = *var = &comp->vars[comp->vc];
-  strncpy(v->name, name->buf, name->length);
-  v->name[name->length] = '\0';
+  v->name = name->buf;
+  v->length = name->length;
   v->type = type;
+  v->r = 0;
+  v->slot = -1;
   v->z = comp->z;
-  TRY(lux_compiler_alloc_register_variable(comp, &v->r))
   comp->vc++;
 
   return true;
 }
 
+//-----------------------------------------------
+// Registers a variable
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_compiler_register_var(compiler_t* comp, vmtype_t* type, token_t* name, cpvar_t** var)
+{
+  TRY(lux_compiler_new_var(comp, type, name, var))
+
+  cpvar_t* v = *var;
+  if(!lux_compiler_alloc_register_variable(comp, &v->r))
+  {
+    // Out of registers, the variable lives in a spill slot
+    v->slot = comp->slots++;
+    comp->maxslots = comp->slots > comp->maxslots ? comp->slots : comp->maxslots;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Registers the variable of an argument, bound
+// to the register it arrives in
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_compiler_register_arg(compiler_t* comp, vmtype_t* type, token_t* name, unsigned char reg)
+{
+  cpvar_t* var;
+  TRY(lux_compiler_new_var(comp, type, name, &var))
+  var->r = reg;
+  return true;
+}
+
 //-----------------------------------------------
 // Gets a variable
 // Returns NULL if it doesn't exist
@@ -1185,7 +3191,7 @@ cpvar_t* lux_compiler_get_var(compiler_t* comp, token_t* name)
 {
   for(int i = 0; i < comp->vc; i++)
   {
-    if(!strncmp(comp->vars[i].name, name->buf, name->length) && strlen(comp->vars[i].name) == name->length)
+    if(comp->vars[i].length == name->length && !strncmp(comp->vars[i].name, name->buf, name->length))
     {
       return &comp->vars[i];
     }
@@ -1214,7 +3220,16 @@ void lux_compiler_leave_scope(compiler_t* comp)
   {
     if(comp->vars[i].z > comp->z)
     {
-      lux_compiler_free_register_variable(comp, comp->vars[i].r);
+      // Variables leave in the reverse order they came in so their
+      // slots are always the last ones taken
+      if(comp->vars[i].slot != -1)
+      {
+        comp->slots--;
+      }
+      else
+      {
+        lux_compiler_free_register_variable(comp, comp->vars[i].r);
+      }
     }
     else
     {
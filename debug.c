@@ -27,7 +27,7 @@ void lux_debug_dump_code(closure_t* closure)
       printf(", ");
     }
   }
-  printf(") (index: %d) %d Bytes\n", closure->index, closure->used);
+  printf(") (index: %d) %d Bytes %d Registers\n", closure->index, closure->used, closure->numregs);
 
   if(closure->native)
   {
@@ -67,9 +67,10 @@ void lux_debug_dump_code(closure_t* closure)
       break;
       case OP_CALL:
       {
-        const unsigned char idx = *(unsigned char*)(cursor + 1);
-        printf("call   %d  // call r[%d]\n", idx, idx);
-        cursor += 2;
+        const unsigned char base = *(unsigned char*)(cursor + 1);
+        const int idx = *(int*)(cursor + 2);
+        printf("call   %d %d  // r[%d] <- function %d(r[%d]...)\n", base, idx, base, idx, base + 1);
+        cursor += 6;
       }
       break;
       case OP_MOV:
@@ -296,7 +297,7 @@ void lux_debug_dump_code(closure_t* closure)
         const unsigned char lv = *(unsigned char*)(cursor + 1);
         const unsigned char rv = *(unsigned char*)(cursor + 2);
         const unsigned char res = *(unsigned char*)(cursor + 3);
-        printf("land   %d %d %d  // r[%d] <- (bool)(r[%d] >= r[%d])\n", lv, rv, res, res, lv, rv);
+        printf("land   %d %d %d  // r[%d] <- (bool)(r[%d] && r[%d])\n", lv, rv, res, res, lv, rv);
         cursor += 4;
       }
       break;
@@ -305,7 +306,7 @@ void lux_debug_dump_code(closure_t* closure)
         const unsigned char lv = *(unsigned char*)(cursor + 1);
         const unsigned char rv = *(unsigned char*)(cursor + 2);
         const unsigned char res = *(unsigned char*)(cursor + 3);
-        printf("lor    %d %d %d  // r[%d] <- (bool)(r[%d] >= r[%d])\n", lv, rv, res, res, lv, rv);
+        printf("lor    %d %d %d  // r[%d] <- (bool)(r[%d] || r[%d])\n", lv, rv, res, res, lv, rv);
         cursor += 4;
       }
       break;
@@ -385,6 +386,682 @@ void lux_debug_dump_code(closure_t* closure)
         cursor += 6;
       }
       break;
+      case OP_TCALL:
+      {
+        const unsigned char base = *(unsigned char*)(cursor + 1);
+        const int idx = *(int*)(cursor + 2);
+        printf("tcall  %d %d  // return function %d(r[%d]...)\n", base, idx, idx, base + 1);
+        cursor += 6;
+      }
+      break;
+      case OP_BNEZ:
+      {
+        const unsigned char r = *(unsigned char*)(cursor + 1);
+        const int offset = *(int*)(cursor + 2);
+        printf("bnez   %d %d\n", r, offset);
+        cursor += 6;
+      }
+      break;
+      case OP_BEQI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("beqi   %d %d %d  // if(r[%d] == r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BNEQI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bneqi  %d %d %d  // if(r[%d] != r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BLTI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("blti   %d %d %d  // if(r[%d] < r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BLTEI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bltei  %d %d %d  // if(r[%d] <= r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BMTI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bmti   %d %d %d  // if(r[%d] > r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BMTEI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bmtei  %d %d %d  // if(r[%d] >= r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BEQF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("beqf   %d %d %d  // if(r[%d] == r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BNEQF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bneqf  %d %d %d  // if(r[%d] != r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BLTF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bltf   %d %d %d  // if(r[%d] < r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BLTEF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bltef  %d %d %d  // if(r[%d] <= r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BMTF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bmtf   %d %d %d  // if(r[%d] > r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BMTEF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bmtef  %d %d %d  // if(r[%d] >= r[%d]) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BNLTF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bnltf  %d %d %d  // if(!(r[%d] < r[%d])) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BNLTEF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bnltef %d %d %d  // if(!(r[%d] <= r[%d])) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BNMTF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bnmtf  %d %d %d  // if(!(r[%d] > r[%d])) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_BNMTEF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int offset = *(int*)(cursor + 3);
+        printf("bnmtef %d %d %d  // if(!(r[%d] >= r[%d])) goto %d\n", lv, rv, offset, lv, rv, offset);
+        cursor += 7;
+      }
+      break;
+      case OP_ADDI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("addi_k %d %d %d  // r[%d] <- r[%d] + %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_SUBI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("subi_k %d %d %d  // r[%d] <- r[%d] - %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_MULI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("muli_k %d %d %d  // r[%d] <- r[%d] * %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_DIVI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("divi_k %d %d %d  // r[%d] <- r[%d] / %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_MOD_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("mod_k  %d %d %d  // r[%d] <- r[%d] %% %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_ADDF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("addf_k %d %f %d  // r[%d] <- r[%d] + %f\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_SUBF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("subf_k %d %f %d  // r[%d] <- r[%d] - %f\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_MULF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("mulf_k %d %f %d  // r[%d] <- r[%d] * %f\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_DIVF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("divf_k %d %f %d  // r[%d] <- r[%d] / %f\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_EQI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("eqi_k  %d %d %d  // r[%d] <- (bool)(r[%d] == %d)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_NEQI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("neqi_k %d %d %d  // r[%d] <- (bool)(r[%d] != %d)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_EQF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("eqf_k  %d %f %d  // r[%d] <- (bool)(r[%d] == %f)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_NEQF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("neqf_k %d %f %d  // r[%d] <- (bool)(r[%d] != %f)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_LTI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("lti_k  %d %d %d  // r[%d] <- (bool)(r[%d] < %d)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_LTEI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("ltei_k %d %d %d  // r[%d] <- (bool)(r[%d] <= %d)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_MTI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("mti_k  %d %d %d  // r[%d] <- (bool)(r[%d] > %d)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_MTEI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("mtei_k %d %d %d  // r[%d] <- (bool)(r[%d] >= %d)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_LTF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("ltf_k  %d %f %d  // r[%d] <- (bool)(r[%d] < %f)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_LTEF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("ltef_k %d %f %d  // r[%d] <- (bool)(r[%d] <= %f)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_MTF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("mtf_k  %d %f %d  // r[%d] <- (bool)(r[%d] > %f)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_MTEF_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const float value = *(float*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("mtef_k %d %f %d  // r[%d] <- (bool)(r[%d] >= %f)\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_BAND_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("band_k %d %d %d  // r[%d] <- r[%d] & %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_BXOR_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("bxor_k %d %d %d  // r[%d] <- r[%d] ^ %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_BOR_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("bor_k  %d %d %d  // r[%d] <- r[%d] | %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_LSFT_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("lsft_k %d %d %d  // r[%d] <- r[%d] << %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_RSFT_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("rsft_k %d %d %d  // r[%d] <- r[%d] >> %d\n", lv, value, res, res, lv, value);
+        cursor += 7;
+      }
+      break;
+      case OP_BEQI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const int offset = *(int*)(cursor + 6);
+        printf("beqi_k %d %d %d  // if(r[%d] == %d) goto %d\n", lv, value, offset, lv, value, offset);
+        cursor += 10;
+      }
+      break;
+      case OP_BNEQI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const int offset = *(int*)(cursor + 6);
+        printf("bneqi_k %d %d %d  // if(r[%d] != %d) goto %d\n", lv, value, offset, lv, value, offset);
+        cursor += 10;
+      }
+      break;
+      case OP_BLTI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const int offset = *(int*)(cursor + 6);
+        printf("blti_k %d %d %d  // if(r[%d] < %d) goto %d\n", lv, value, offset, lv, value, offset);
+        cursor += 10;
+      }
+      break;
+      case OP_BLTEI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const int offset = *(int*)(cursor + 6);
+        printf("bltei_k %d %d %d  // if(r[%d] <= %d) goto %d\n", lv, value, offset, lv, value, offset);
+        cursor += 10;
+      }
+      break;
+      case OP_BMTI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const int offset = *(int*)(cursor + 6);
+        printf("bmti_k %d %d %d  // if(r[%d] > %d) goto %d\n", lv, value, offset, lv, value, offset);
+        cursor += 10;
+      }
+      break;
+      case OP_BMTEI_K:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const int offset = *(int*)(cursor + 6);
+        printf("bmtei_k %d %d %d  // if(r[%d] >= %d) goto %d\n", lv, value, offset, lv, value, offset);
+        cursor += 10;
+      }
+      break;
+      case OP_NEGI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("negi   %d %d  // r[%d] <- -r[%d]\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_NEGF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("negf   %d %d  // r[%d] <- -r[%d]\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_SPILL:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int slot = *(int*)(cursor + 2);
+        printf("spill  %d %d  // s[%d] <- r[%d]\n", lv, slot, slot, lv);
+        cursor += 6;
+      }
+      break;
+      case OP_RELOAD:
+      {
+        const unsigned char to = *(unsigned char*)(cursor + 1);
+        const int slot = *(int*)(cursor + 2);
+        printf("reload %d %d  // r[%d] <- s[%d]\n", to, slot, to, slot);
+        cursor += 6;
+      }
+      break;
+      case OP_FORLT:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int value = *(int*)(cursor + 3);
+        const int offset = *(int*)(cursor + 7);
+        printf("forlt  %d %d %d %d  // r[%d] += %d; if(r[%d] < r[%d]) goto %d\n", lv, rv, value, offset, lv, value, lv, rv, offset);
+        cursor += 11;
+      }
+      break;
+      case OP_FORLTE:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int value = *(int*)(cursor + 3);
+        const int offset = *(int*)(cursor + 7);
+        printf("forlte %d %d %d %d  // r[%d] += %d; if(r[%d] <= r[%d]) goto %d\n", lv, rv, value, offset, lv, value, lv, rv, offset);
+        cursor += 11;
+      }
+      break;
+      case OP_FORMT:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int value = *(int*)(cursor + 3);
+        const int offset = *(int*)(cursor + 7);
+        printf("formt  %d %d %d %d  // r[%d] += %d; if(r[%d] > r[%d]) goto %d\n", lv, rv, value, offset, lv, value, lv, rv, offset);
+        cursor += 11;
+      }
+      break;
+      case OP_FORMTE:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const int value = *(int*)(cursor + 3);
+        const int offset = *(int*)(cursor + 7);
+        printf("formte %d %d %d %d  // r[%d] += %d; if(r[%d] >= r[%d]) goto %d\n", lv, rv, value, offset, lv, value, lv, rv, offset);
+        cursor += 11;
+      }
+      break;
+      case OP_DIVI_P:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("divi_p %d %d %d  // r[%d] <- r[%d] / %d\n", lv, value, res, res, lv, 1 << value);
+        cursor += 7;
+      }
+      break;
+      case OP_MOD_P:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 6);
+        printf("mod_p  %d %d %d  // r[%d] <- r[%d] %% %d\n", lv, value, res, res, lv, value + 1);
+        cursor += 7;
+      }
+      break;
+      case OP_DIVI_M:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned int magic = *(unsigned int*)(cursor + 6);
+        const unsigned char res = *(unsigned char*)(cursor + 10);
+        printf("divi_m %d %d %u %d  // r[%d] <- r[%d] / %d\n", lv, value, magic, res, res, lv, value);
+        cursor += 11;
+      }
+      break;
+      case OP_MOD_M:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const unsigned int magic = *(unsigned int*)(cursor + 6);
+        const unsigned char res = *(unsigned char*)(cursor + 10);
+        printf("mod_m  %d %d %u %d  // r[%d] <- r[%d] %% %d\n", lv, value, magic, res, res, lv, value);
+        cursor += 11;
+      }
+      break;
+      case OP_SEL:
+      {
+        const unsigned char cond = *(unsigned char*)(cursor + 1);
+        const unsigned char from = *(unsigned char*)(cursor + 2);
+        const unsigned char to = *(unsigned char*)(cursor + 3);
+        printf("sel    %d %d %d  // if(r[%d]) r[%d] <- r[%d]\n", cond, from, to, cond, to, from);
+        cursor += 4;
+      }
+      break;
+      case OP_JTAB:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const int value = *(int*)(cursor + 2);
+        const int count = *(int*)(cursor + 6);
+        printf("jtab   %d %d %d  // goto entry r[%d] - %d of %d\n", lv, value, count, lv, value, count);
+        cursor += 10;
+      }
+      break;
+      case OP_CASE:
+      {
+        const int offset = *(int*)(cursor + 1);
+        printf("case   %d\n", offset);
+        cursor += 5;
+      }
+      break;
+      case OP_SQRTF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("sqrtf  %d %d  // r[%d] <- sqrt(r[%d])\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_ABSI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("absi   %d %d  // r[%d] <- abs(r[%d])\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_ABSF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("absf   %d %d  // r[%d] <- abs(r[%d])\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_FLOORF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("floorf %d %d  // r[%d] <- floor(r[%d])\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_CLZ:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("clz    %d %d  // r[%d] <- clz(r[%d])\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_POPCNT:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        printf("popcnt %d %d  // r[%d] <- popcount(r[%d])\n", lv, rv, rv, lv);
+        cursor += 3;
+      }
+      break;
+      case OP_MINI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 3);
+        printf("mini   %d %d %d  // r[%d] <- min(r[%d], r[%d])\n", lv, rv, res, res, lv, rv);
+        cursor += 4;
+      }
+      break;
+      case OP_MAXI:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 3);
+        printf("maxi   %d %d %d  // r[%d] <- max(r[%d], r[%d])\n", lv, rv, res, res, lv, rv);
+        cursor += 4;
+      }
+      break;
+      case OP_MINF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 3);
+        printf("minf   %d %d %d  // r[%d] <- min(r[%d], r[%d])\n", lv, rv, res, res, lv, rv);
+        cursor += 4;
+      }
+      break;
+      case OP_MAXF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 3);
+        printf("maxf   %d %d %d  // r[%d] <- max(r[%d], r[%d])\n", lv, rv, res, res, lv, rv);
+        cursor += 4;
+      }
+      break;
+      case OP_FMAF:
+      {
+        const unsigned char lv = *(unsigned char*)(cursor + 1);
+        const unsigned char rv = *(unsigned char*)(cursor + 2);
+        const unsigned char res = *(unsigned char*)(cursor + 3);
+        printf("fmaf   %d %d %d  // r[%d] <- r[%d] * r[%d] + r[%d]\n", lv, rv, res, res, lv, rv, res);
+        cursor += 4;
+      }
+      break;
       default:
       {
         printf("Unknown opcode %c\n", *cursor);
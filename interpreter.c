@@ -1,277 +1,1201 @@
 #include "private.h"
 
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 
+// Threaded dispatch jumps straight from one handler to the next through a
+// label table. Compilers without labels as values, or builds defining
+// LUX_NO_COMPUTED_GOTO, fall back to a portable switch loop
+// Running under a step budget swaps in a table sending every opcode
+// through the sandbox check first so the unlimited path pays nothing
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LUX_NO_COMPUTED_GOTO)
+  #define LUX_COMPUTED_GOTO
+#endif
+
+#ifdef LUX_COMPUTED_GOTO
+  #define INTERPRET_LOOP goto *table[*cursor];
+  #define OPCODE(op) L_##op:
+  #define OPCODE_DEFAULT L_DEFAULT:
+  #define NEXT goto *table[*cursor]
+#else
+  #define INTERPRET_LOOP while(steps == NULL || lux_vm_sandbox_step(vm, cursor, r, steps)) switch(*cursor)
+  #define OPCODE(op) case op:
+  #define OPCODE_DEFAULT default:
+  #define NEXT break
+#endif
+
+//-----------------------------------------------
+// Checks an instruction about to run under a
+// step budget, it must not trap or reach native
+// code that could have side effects
+// Returns false with an error set if it can't
+// run
 //-----------------------------------------------
-// Interprets a vmframe_t closure stream
+static bool lux_vm_sandbox_step(vm_t* vm, unsigned char* cursor, vmregister_t* r, int* steps)
+{
+  if(--*steps < 0)
+  {
+    lux_vm_set_error(vm, "Ran out of steps");
+    return false;
+  }
+
+  int divisor = 1;
+  int dividend = 0;
+  switch(*cursor)
+  {
+    case OP_DIVI:
+    case OP_MOD:
+      dividend = r[*(unsigned char*)(cursor + 1)].ivalue;
+      divisor = r[*(unsigned char*)(cursor + 2)].ivalue;
+      break;
+    case OP_DIVI_K:
+    case OP_MOD_K:
+      dividend = r[*(unsigned char*)(cursor + 1)].ivalue;
+      divisor = *(int*)(cursor + 2);
+      break;
+    case OP_CALL:
+    case OP_TCALL:
+      if(vm->functiontable[*(int*)(cursor + 2)]->native)
+      {
+        lux_vm_set_error(vm, "Can't call native functions under a step budget");
+        return false;
+      }
+      break;
+  }
+
+  if(divisor == 0 || (divisor == -1 && dividend == INT_MIN))
+  {
+    lux_vm_set_error(vm, "Integer division overflow");
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------
+// Divides by an immediate int whose absolute
+// value isn't a power of 2 with a multiply by
+// its magic number and a shift by
+// 31 + ceil(log2(|d|))
+// Rounds toward zero like the / operator
+//-----------------------------------------------
+static inline int lux_divide_magic(int x, int d, unsigned int magic)
+{
+  const unsigned int ad = d < 0 ? 0u - (unsigned int)d : (unsigned int)d;
+#if defined(__GNUC__) || defined(__clang__)
+  const int shift = 63 - __builtin_clz(ad);
+#else
+  int shift = 31;
+  while((1u << (shift - 31)) < ad)
+  {
+    shift++;
+  }
+#endif
+  const long long m = d < 0 ? -(long long)magic : (long long)magic;
+  const int q = (int)(((long long)x * m) >> shift);
+  // Negative quotients come out one below, floored instead of truncated
+  return q + (int)((unsigned int)q >> 31);
+}
+
+//-----------------------------------------------
+// Interprets a vmframe_t closure stream and
+// every script closure it calls
+// 'steps' holds how many instructions may still
+// run, NULL for no limit
 // Returns false on fatal error
 //-----------------------------------------------
-bool lux_vm_interpret_frame(vm_t* vm, vmframe_t* frame)
+bool lux_vm_interpret_frame(vm_t* vm, vmframe_t* frame, int* steps)
 {
+#ifdef LUX_COMPUTED_GOTO
+  // Every opcode defaults to L_DEFAULT and the known ones override it
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Woverride-init"
+  static const void* dispatch[256] =
+  {
+    [0 ... 255] = &&L_DEFAULT,
+    [OP_NOP] = &&L_OP_NOP,
+    [OP_LDI] = &&L_OP_LDI,
+    [OP_CALL] = &&L_OP_CALL,
+    [OP_RET] = &&L_OP_RET,
+    [OP_MOV] = &&L_OP_MOV,
+    [OP_ADDI] = &&L_OP_ADDI,
+    [OP_SUBI] = &&L_OP_SUBI,
+    [OP_MULI] = &&L_OP_MULI,
+    [OP_DIVI] = &&L_OP_DIVI,
+    [OP_MOD] = &&L_OP_MOD,
+    [OP_ITOF] = &&L_OP_ITOF,
+    [OP_ADDF] = &&L_OP_ADDF,
+    [OP_SUBF] = &&L_OP_SUBF,
+    [OP_MULF] = &&L_OP_MULF,
+    [OP_DIVF] = &&L_OP_DIVF,
+    [OP_FTOI] = &&L_OP_FTOI,
+    [OP_EQI] = &&L_OP_EQI,
+    [OP_NEQI] = &&L_OP_NEQI,
+    [OP_EQF] = &&L_OP_EQF,
+    [OP_NEQF] = &&L_OP_NEQF,
+    [OP_LTI] = &&L_OP_LTI,
+    [OP_LTEI] = &&L_OP_LTEI,
+    [OP_MTI] = &&L_OP_MTI,
+    [OP_MTEI] = &&L_OP_MTEI,
+    [OP_LTF] = &&L_OP_LTF,
+    [OP_LTEF] = &&L_OP_LTEF,
+    [OP_MTF] = &&L_OP_MTF,
+    [OP_MTEF] = &&L_OP_MTEF,
+    [OP_LAND] = &&L_OP_LAND,
+    [OP_LOR] = &&L_OP_LOR,
+    [OP_LNOT] = &&L_OP_LNOT,
+    [OP_BAND] = &&L_OP_BAND,
+    [OP_BXOR] = &&L_OP_BXOR,
+    [OP_BOR] = &&L_OP_BOR,
+    [OP_BNOT] = &&L_OP_BNOT,
+    [OP_LSFT] = &&L_OP_LSFT,
+    [OP_RSFT] = &&L_OP_RSFT,
+    [OP_JMP] = &&L_OP_JMP,
+    [OP_BEQZ] = &&L_OP_BEQZ,
+    [OP_TCALL] = &&L_OP_TCALL,
+    [OP_BNEZ] = &&L_OP_BNEZ,
+    [OP_BEQI] = &&L_OP_BEQI,
+    [OP_BNEQI] = &&L_OP_BNEQI,
+    [OP_BLTI] = &&L_OP_BLTI,
+    [OP_BLTEI] = &&L_OP_BLTEI,
+    [OP_BMTI] = &&L_OP_BMTI,
+    [OP_BMTEI] = &&L_OP_BMTEI,
+    [OP_BEQF] = &&L_OP_BEQF,
+    [OP_BNEQF] = &&L_OP_BNEQF,
+    [OP_BLTF] = &&L_OP_BLTF,
+    [OP_BLTEF] = &&L_OP_BLTEF,
+    [OP_BMTF] = &&L_OP_BMTF,
+    [OP_BMTEF] = &&L_OP_BMTEF,
+    [OP_BNLTF] = &&L_OP_BNLTF,
+    [OP_BNLTEF] = &&L_OP_BNLTEF,
+    [OP_BNMTF] = &&L_OP_BNMTF,
+    [OP_BNMTEF] = &&L_OP_BNMTEF,
+    [OP_ADDI_K] = &&L_OP_ADDI_K,
+    [OP_SUBI_K] = &&L_OP_SUBI_K,
+    [OP_MULI_K] = &&L_OP_MULI_K,
+    [OP_DIVI_K] = &&L_OP_DIVI_K,
+    [OP_MOD_K] = &&L_OP_MOD_K,
+    [OP_ADDF_K] = &&L_OP_ADDF_K,
+    [OP_SUBF_K] = &&L_OP_SUBF_K,
+    [OP_MULF_K] = &&L_OP_MULF_K,
+    [OP_DIVF_K] = &&L_OP_DIVF_K,
+    [OP_EQI_K] = &&L_OP_EQI_K,
+    [OP_NEQI_K] = &&L_OP_NEQI_K,
+    [OP_EQF_K] = &&L_OP_EQF_K,
+    [OP_NEQF_K] = &&L_OP_NEQF_K,
+    [OP_LTI_K] = &&L_OP_LTI_K,
+    [OP_LTEI_K] = &&L_OP_LTEI_K,
+    [OP_MTI_K] = &&L_OP_MTI_K,
+    [OP_MTEI_K] = &&L_OP_MTEI_K,
+    [OP_LTF_K] = &&L_OP_LTF_K,
+    [OP_LTEF_K] = &&L_OP_LTEF_K,
+    [OP_MTF_K] = &&L_OP_MTF_K,
+    [OP_MTEF_K] = &&L_OP_MTEF_K,
+    [OP_BAND_K] = &&L_OP_BAND_K,
+    [OP_BXOR_K] = &&L_OP_BXOR_K,
+    [OP_BOR_K] = &&L_OP_BOR_K,
+    [OP_LSFT_K] = &&L_OP_LSFT_K,
+    [OP_RSFT_K] = &&L_OP_RSFT_K,
+    [OP_BEQI_K] = &&L_OP_BEQI_K,
+    [OP_BNEQI_K] = &&L_OP_BNEQI_K,
+    [OP_BLTI_K] = &&L_OP_BLTI_K,
+    [OP_BLTEI_K] = &&L_OP_BLTEI_K,
+    [OP_BMTI_K] = &&L_OP_BMTI_K,
+    [OP_BMTEI_K] = &&L_OP_BMTEI_K,
+    [OP_NEGI] = &&L_OP_NEGI,
+    [OP_NEGF] = &&L_OP_NEGF,
+    [OP_SPILL] = &&L_OP_SPILL,
+    [OP_RELOAD] = &&L_OP_RELOAD,
+    [OP_FORLT] = &&L_OP_FORLT,
+    [OP_FORLTE] = &&L_OP_FORLTE,
+    [OP_FORMT] = &&L_OP_FORMT,
+    [OP_FORMTE] = &&L_OP_FORMTE,
+    [OP_DIVI_P] = &&L_OP_DIVI_P,
+    [OP_MOD_P] = &&L_OP_MOD_P,
+    [OP_DIVI_M] = &&L_OP_DIVI_M,
+    [OP_MOD_M] = &&L_OP_MOD_M,
+    [OP_SEL] = &&L_OP_SEL,
+    [OP_JTAB] = &&L_OP_JTAB,
+    [OP_CASE] = &&L_OP_CASE,
+    [OP_SQRTF] = &&L_OP_SQRTF,
+    [OP_ABSI] = &&L_OP_ABSI,
+    [OP_ABSF] = &&L_OP_ABSF,
+    [OP_FLOORF] = &&L_OP_FLOORF,
+    [OP_CLZ] = &&L_OP_CLZ,
+    [OP_POPCNT] = &&L_OP_POPCNT,
+    [OP_MINI] = &&L_OP_MINI,
+    [OP_MAXI] = &&L_OP_MAXI,
+    [OP_MINF] = &&L_OP_MINF,
+    [OP_MAXF] = &&L_OP_MAXF,
+    [OP_FMAF] = &&L_OP_FMAF
+  };
+  #pragma GCC diagnostic pop
+  static const void* sandboxed[256] =
+  {
+    [0 ... 255] = &&L_SANDBOX
+  };
+  const void** table = steps == NULL ? dispatch : sandboxed;
+#endif
+
+  // Calls between script closures push and pop frames right here,
+  // we only return once 'entry' does
+  vmframe_t* entry = frame;
   unsigned char* code = frame->closure->code;
   unsigned char* cursor = code;
-  unsigned char* code_end = code + frame->closure->used;
+  vmregister_t* r = frame->r;
 
-  while(cursor < code_end)
+  INTERPRET_LOOP
   {
-    switch(*cursor)
+    OPCODE(OP_NOP)
+    {
+      cursor += 1;
+    }
+    NEXT;
+    OPCODE(OP_LDI)
+    {
+      r[*(unsigned char*)(cursor + 1)].ivalue = *(int*)(cursor + 2);
+      cursor += 6;
+    }
+    NEXT;
+    OPCODE(OP_CALL)
     {
-      case OP_NOP:
+      closure_t* func = vm->functiontable[*(int*)(cursor + 2)];
+      if(func->native)
       {
-        cursor += 1;
+        // The callback may call back into scripts and grow the stack
+        TRY(lux_vm_call_function_internal(vm, func, r + *(unsigned char*)(cursor + 1)));
+        r = frame->r;
+        cursor += 6;
       }
-      break;
-      case OP_LDI:
+      else
+      {
+        frame->cursor = cursor + 6;
+        frame = lux_vm_push_frame(vm, func, r + *(unsigned char*)(cursor + 1));
+        TRY(frame)
+        code = cursor = func->code;
+        r = frame->r;
+      }
+    }
+    NEXT;
+    OPCODE(OP_RET)
+    {
+      //printf("Function %s returning %d (%f)\n", frame->closure->name, r[0].ivalue, r[0].fvalue);
+      if(frame == entry)
+      {
+        return true;
+      }
+
+      vm->numframes--;
+      frame = vm->top = frame->caller;
+      code = frame->closure->code;
+      cursor = frame->cursor;
+      r = frame->r;
+    }
+    NEXT;
+    OPCODE(OP_MOV)
+    {
+      r[*(unsigned char*)(cursor + 2)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_ADDI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue + r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_SUBI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue - r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MULI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue * r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_DIVI)
+    {
+      assert(r[*(unsigned char*)(cursor + 2)].ivalue);
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue / r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MOD)
+    {
+      assert(r[*(unsigned char*)(cursor + 2)].ivalue);
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue % r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_ITOF)
+    {
+      r[*(unsigned char*)(cursor + 2)].fvalue = (float)r[*(unsigned char*)(cursor + 1)].ivalue;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_ADDF)
+    {
+      r[*(unsigned char*)(cursor + 3)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue + r[*(unsigned char*)(cursor + 2)].fvalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_SUBF)
+    {
+      r[*(unsigned char*)(cursor + 3)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue - r[*(unsigned char*)(cursor + 2)].fvalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MULF)
+    {
+      r[*(unsigned char*)(cursor + 3)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue * r[*(unsigned char*)(cursor + 2)].fvalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_DIVF)
+    {
+      assert(r[*(unsigned char*)(cursor + 2)].fvalue);
+      r[*(unsigned char*)(cursor + 3)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue / r[*(unsigned char*)(cursor + 2)].fvalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_FTOI)
+    {
+      r[*(unsigned char*)(cursor + 2)].ivalue = (int)r[*(unsigned char*)(cursor + 1)].fvalue;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_EQI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue == r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_NEQI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue != r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_EQF)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue == r[*(unsigned char*)(cursor + 2)].fvalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_NEQF)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue != r[*(unsigned char*)(cursor + 2)].fvalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_LTI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue < r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_LTEI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue <= r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MTI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue > r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MTEI)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue >= r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_LTF)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue < r[*(unsigned char*)(cursor + 2)].fvalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_LTEF)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue <= r[*(unsigned char*)(cursor + 2)].fvalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MTF)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue > r[*(unsigned char*)(cursor + 2)].fvalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MTEF)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue >= r[*(unsigned char*)(cursor + 2)].fvalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_LAND)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue && r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_LOR)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue || r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_LNOT)
+    {
+      r[*(unsigned char*)(cursor + 2)].ivalue = !r[*(unsigned char*)(cursor + 1)].ivalue;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_BAND)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue & r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_BXOR)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue ^ r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_BOR)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue | r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_BNOT)
+    {
+      r[*(unsigned char*)(cursor + 2)].ivalue = ~r[*(unsigned char*)(cursor + 1)].ivalue;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_LSFT)
+    {
+      // Shifted unsigned, negative values shifting left are undefined in C
+      r[*(unsigned char*)(cursor + 3)].ivalue = (int)((unsigned int)r[*(unsigned char*)(cursor + 1)].ivalue << r[*(unsigned char*)(cursor + 2)].ivalue);
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_RSFT)
+    {
+      r[*(unsigned char*)(cursor + 3)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue >> r[*(unsigned char*)(cursor + 2)].ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_JMP)
+    {
+      cursor = code + *(int*)(cursor + 1);
+    }
+    NEXT;
+    OPCODE(OP_BEQZ)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue == 0)
+      {
+        cursor = code + *(int*)(cursor + 2);
+      }
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 1)].ivalue = *(int*)(cursor + 2);
         cursor += 6;
       }
-      break;
-      case OP_CALL:
-      {
-        closure_t* closure = NULL;
-        for(closure = vm->functions; closure != NULL; closure = closure->next)
-        {
-          if(closure->index == frame->r[*(unsigned char*)(cursor + 1)].ivalue)
-          {
-            break;
-          }
-        }
-        TRY(lux_vm_call_function_internal(vm, closure, frame));
-        cursor += 2;
+    }
+    NEXT;
+    OPCODE(OP_TCALL)
+    {
+      closure_t* func = vm->functiontable[*(int*)(cursor + 2)];
+      // The callee's spill slots replace ours
+      vmregister_t* s = frame->s + frame->closure->numslots - func->numslots;
+      if(r + func->numregs > s)
+      {
+        TRY(lux_vm_grow_stack(vm, func, (int)(r + func->numregs - s)))
+        r = frame->r;
+        s = frame->s + frame->closure->numslots - func->numslots;
       }
-      break;
-      case OP_RET:
+
+      // Slide the arguments down into our own r1... and become the callee
+      vmregister_t* args = r + *(unsigned char*)(cursor + 1) + 1;
+      for(int i = 0; i < func->numargs; i++)
       {
-        //printf("Function %s returning %d (%f)\n", frame->closure->name, frame->r[0].ivalue, frame->r[0].fvalue);
-        return true;
+        r[i + 1] = args[i];
       }
-      break;
-      case OP_MOV:
+      frame->closure = func;
+      frame->s = s;
+      code = cursor = func->code;
+    }
+    NEXT;
+    OPCODE(OP_BNEZ)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue != 0)
       {
-        frame->r[*(unsigned char*)(cursor + 2)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue;
-        cursor += 3;
+        cursor = code + *(int*)(cursor + 2);
       }
-      break;
-      case OP_ADDI:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue + frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor += 6;
       }
-      break;
-      case OP_SUBI:
+    }
+    NEXT;
+    OPCODE(OP_BEQI)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue == r[*(unsigned char*)(cursor + 2)].ivalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue - frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_MULI:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue * frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_DIVI:
+    }
+    NEXT;
+    OPCODE(OP_BNEQI)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue != r[*(unsigned char*)(cursor + 2)].ivalue)
       {
-        assert(frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue / frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_MOD:
+      else
       {
-        assert(frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue % frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_ITOF:
+    }
+    NEXT;
+    OPCODE(OP_BLTI)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue < r[*(unsigned char*)(cursor + 2)].ivalue)
       {
-        frame->r[*(unsigned char*)(cursor + 2)].fvalue = (float)frame->r[*(unsigned char*)(cursor + 1)].ivalue;
-        cursor += 3;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_ADDF:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].fvalue = frame->r[*(unsigned char*)(cursor + 1)].fvalue + frame->r[*(unsigned char*)(cursor + 2)].fvalue;
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_SUBF:
+    }
+    NEXT;
+    OPCODE(OP_BLTEI)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue <= r[*(unsigned char*)(cursor + 2)].ivalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].fvalue = frame->r[*(unsigned char*)(cursor + 1)].fvalue - frame->r[*(unsigned char*)(cursor + 2)].fvalue;
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_MULF:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].fvalue = frame->r[*(unsigned char*)(cursor + 1)].fvalue * frame->r[*(unsigned char*)(cursor + 2)].fvalue;
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_DIVF:
+    }
+    NEXT;
+    OPCODE(OP_BMTI)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue > r[*(unsigned char*)(cursor + 2)].ivalue)
       {
-        assert(frame->r[*(unsigned char*)(cursor + 2)].fvalue);
-        frame->r[*(unsigned char*)(cursor + 3)].fvalue = frame->r[*(unsigned char*)(cursor + 1)].fvalue / frame->r[*(unsigned char*)(cursor + 2)].fvalue;
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_FTOI:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 2)].ivalue = (int)frame->r[*(unsigned char*)(cursor + 1)].fvalue;
-        cursor += 3;
+        cursor += 7;
       }
-      break;
-      case OP_EQI:
+    }
+    NEXT;
+    OPCODE(OP_BMTEI)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue >= r[*(unsigned char*)(cursor + 2)].ivalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue == frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_NEQI:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue != frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_EQF:
+    }
+    NEXT;
+    OPCODE(OP_BEQF)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].fvalue == r[*(unsigned char*)(cursor + 2)].fvalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].fvalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].fvalue == frame->r[*(unsigned char*)(cursor + 2)].fvalue);
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_NEQF:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].fvalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].fvalue != frame->r[*(unsigned char*)(cursor + 2)].fvalue);
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_LTI:
+    }
+    NEXT;
+    OPCODE(OP_BNEQF)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].fvalue != r[*(unsigned char*)(cursor + 2)].fvalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue < frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_LTEI:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue <= frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_MTI:
+    }
+    NEXT;
+    OPCODE(OP_BLTF)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].fvalue < r[*(unsigned char*)(cursor + 2)].fvalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue > frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_MTEI:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue >= frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_LTF:
+    }
+    NEXT;
+    OPCODE(OP_BLTEF)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].fvalue <= r[*(unsigned char*)(cursor + 2)].fvalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].fvalue < frame->r[*(unsigned char*)(cursor + 2)].fvalue);
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_LTEF:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].fvalue <= frame->r[*(unsigned char*)(cursor + 2)].fvalue);
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_MTF:
+    }
+    NEXT;
+    OPCODE(OP_BMTF)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].fvalue > r[*(unsigned char*)(cursor + 2)].fvalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].fvalue > frame->r[*(unsigned char*)(cursor + 2)].fvalue);
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_MTEF:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].fvalue >= frame->r[*(unsigned char*)(cursor + 2)].fvalue);
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_LAND:
+    }
+    NEXT;
+    OPCODE(OP_BMTEF)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].fvalue >= r[*(unsigned char*)(cursor + 2)].fvalue)
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue && frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_LOR:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = (bool)(frame->r[*(unsigned char*)(cursor + 1)].ivalue || frame->r[*(unsigned char*)(cursor + 2)].ivalue);
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_LNOT:
+    }
+    NEXT;
+    OPCODE(OP_BNLTF)
+    {
+      if(!(r[*(unsigned char*)(cursor + 1)].fvalue < r[*(unsigned char*)(cursor + 2)].fvalue))
       {
-        frame->r[*(unsigned char*)(cursor + 2)].ivalue = !frame->r[*(unsigned char*)(cursor + 1)].ivalue;
-        cursor += 3;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_BAND:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue & frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_BXOR:
+    }
+    NEXT;
+    OPCODE(OP_BNLTEF)
+    {
+      if(!(r[*(unsigned char*)(cursor + 1)].fvalue <= r[*(unsigned char*)(cursor + 2)].fvalue))
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue ^ frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_BOR:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue | frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_BNOT:
+    }
+    NEXT;
+    OPCODE(OP_BNMTF)
+    {
+      if(!(r[*(unsigned char*)(cursor + 1)].fvalue > r[*(unsigned char*)(cursor + 2)].fvalue))
       {
-        frame->r[*(unsigned char*)(cursor + 2)].ivalue = ~frame->r[*(unsigned char*)(cursor + 1)].ivalue;
-        cursor += 3;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_LSFT:
+      else
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue << frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor += 7;
       }
-      break;
-      case OP_RSFT:
+    }
+    NEXT;
+    OPCODE(OP_BNMTEF)
+    {
+      if(!(r[*(unsigned char*)(cursor + 1)].fvalue >= r[*(unsigned char*)(cursor + 2)].fvalue))
       {
-        frame->r[*(unsigned char*)(cursor + 3)].ivalue = frame->r[*(unsigned char*)(cursor + 1)].ivalue >> frame->r[*(unsigned char*)(cursor + 2)].ivalue;
-        cursor += 4;
+        cursor = code + *(int*)(cursor + 3);
       }
-      break;
-      case OP_JMP:
+      else
       {
-        cursor = code + *(int*)(cursor + 1);
+        cursor += 7;
       }
-      break;
-      case OP_BEQZ:
+    }
+    NEXT;
+    OPCODE(OP_ADDI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue + *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_SUBI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue - *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MULI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue * *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_DIVI_K)
+    {
+      assert(*(int*)(cursor + 2));
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue / *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MOD_K)
+    {
+      assert(*(int*)(cursor + 2));
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue % *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_ADDF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue + *(float*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_SUBF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue - *(float*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MULF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue * *(float*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_DIVF_K)
+    {
+      assert(*(float*)(cursor + 2));
+      r[*(unsigned char*)(cursor + 6)].fvalue = r[*(unsigned char*)(cursor + 1)].fvalue / *(float*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_EQI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue == *(int*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_NEQI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue != *(int*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_EQF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue == *(float*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_NEQF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue != *(float*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_LTI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue < *(int*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_LTEI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue <= *(int*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MTI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue > *(int*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MTEI_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].ivalue >= *(int*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_LTF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue < *(float*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_LTEF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue <= *(float*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MTF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue > *(float*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MTEF_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = (bool)(r[*(unsigned char*)(cursor + 1)].fvalue >= *(float*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_BAND_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue & *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_BXOR_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue ^ *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_BOR_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue | *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_LSFT_K)
+    {
+      // Also what x * 2^k reduces to, so x is often negative
+      r[*(unsigned char*)(cursor + 6)].ivalue = (int)((unsigned int)r[*(unsigned char*)(cursor + 1)].ivalue << *(int*)(cursor + 2));
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_RSFT_K)
+    {
+      r[*(unsigned char*)(cursor + 6)].ivalue = r[*(unsigned char*)(cursor + 1)].ivalue >> *(int*)(cursor + 2);
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_BEQI_K)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue == *(int*)(cursor + 2))
       {
-        if(frame->r[*(unsigned char*)(cursor + 1)].ivalue == 0)
-        {
-          cursor = code + *(int*)(cursor + 2);
-        }
-        else
-        {
-          cursor += 6;
-        }
+        cursor = code + *(int*)(cursor + 6);
       }
-      break;
-      default:
+      else
       {
-        lux_vm_set_error(frame->vm, "Unknown opcode");
-        return false;
+        cursor += 10;
+      }
+    }
+    NEXT;
+    OPCODE(OP_BNEQI_K)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue != *(int*)(cursor + 2))
+      {
+        cursor = code + *(int*)(cursor + 6);
+      }
+      else
+      {
+        cursor += 10;
+      }
+    }
+    NEXT;
+    OPCODE(OP_BLTI_K)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue < *(int*)(cursor + 2))
+      {
+        cursor = code + *(int*)(cursor + 6);
+      }
+      else
+      {
+        cursor += 10;
+      }
+    }
+    NEXT;
+    OPCODE(OP_BLTEI_K)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue <= *(int*)(cursor + 2))
+      {
+        cursor = code + *(int*)(cursor + 6);
+      }
+      else
+      {
+        cursor += 10;
+      }
+    }
+    NEXT;
+    OPCODE(OP_BMTI_K)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue > *(int*)(cursor + 2))
+      {
+        cursor = code + *(int*)(cursor + 6);
+      }
+      else
+      {
+        cursor += 10;
+      }
+    }
+    NEXT;
+    OPCODE(OP_BMTEI_K)
+    {
+      if(r[*(unsigned char*)(cursor + 1)].ivalue >= *(int*)(cursor + 2))
+      {
+        cursor = code + *(int*)(cursor + 6);
+      }
+      else
+      {
+        cursor += 10;
+      }
+    }
+    NEXT;
+    OPCODE(OP_NEGI)
+    {
+      r[*(unsigned char*)(cursor + 2)].ivalue = -r[*(unsigned char*)(cursor + 1)].ivalue;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_NEGF)
+    {
+      r[*(unsigned char*)(cursor + 2)].fvalue = -r[*(unsigned char*)(cursor + 1)].fvalue;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_SPILL)
+    {
+      frame->s[*(int*)(cursor + 2)] = r[*(unsigned char*)(cursor + 1)];
+      cursor += 6;
+    }
+    NEXT;
+    OPCODE(OP_RELOAD)
+    {
+      r[*(unsigned char*)(cursor + 1)] = frame->s[*(int*)(cursor + 2)];
+      cursor += 6;
+    }
+    NEXT;
+    OPCODE(OP_FORLT)
+    {
+      vmregister_t* counter = &r[*(unsigned char*)(cursor + 1)];
+      counter->ivalue += *(int*)(cursor + 3);
+      if(counter->ivalue < r[*(unsigned char*)(cursor + 2)].ivalue)
+      {
+        cursor = code + *(int*)(cursor + 7);
+      }
+      else
+      {
+        cursor += 11;
+      }
+    }
+    NEXT;
+    OPCODE(OP_FORLTE)
+    {
+      vmregister_t* counter = &r[*(unsigned char*)(cursor + 1)];
+      counter->ivalue += *(int*)(cursor + 3);
+      if(counter->ivalue <= r[*(unsigned char*)(cursor + 2)].ivalue)
+      {
+        cursor = code + *(int*)(cursor + 7);
+      }
+      else
+      {
+        cursor += 11;
+      }
+    }
+    NEXT;
+    OPCODE(OP_FORMT)
+    {
+      vmregister_t* counter = &r[*(unsigned char*)(cursor + 1)];
+      counter->ivalue += *(int*)(cursor + 3);
+      if(counter->ivalue > r[*(unsigned char*)(cursor + 2)].ivalue)
+      {
+        cursor = code + *(int*)(cursor + 7);
+      }
+      else
+      {
+        cursor += 11;
+      }
+    }
+    NEXT;
+    OPCODE(OP_FORMTE)
+    {
+      vmregister_t* counter = &r[*(unsigned char*)(cursor + 1)];
+      counter->ivalue += *(int*)(cursor + 3);
+      if(counter->ivalue >= r[*(unsigned char*)(cursor + 2)].ivalue)
+      {
+        cursor = code + *(int*)(cursor + 7);
+      }
+      else
+      {
+        cursor += 11;
       }
     }
+    NEXT;
+    OPCODE(OP_DIVI_P)
+    {
+      // Negative dividends are biased by 2^k - 1 so the shift rounds toward zero
+      const int value = r[*(unsigned char*)(cursor + 1)].ivalue;
+      const int shift = *(int*)(cursor + 2);
+      r[*(unsigned char*)(cursor + 6)].ivalue = (value + ((value >> 31) & ((1 << shift) - 1))) >> shift;
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_MOD_P)
+    {
+      // Remainders keep the sign of the dividend like the % operator
+      const int value = r[*(unsigned char*)(cursor + 1)].ivalue;
+      const int mask = *(int*)(cursor + 2);
+      const int bias = (value >> 31) & mask;
+      r[*(unsigned char*)(cursor + 6)].ivalue = ((value + bias) & mask) - bias;
+      cursor += 7;
+    }
+    NEXT;
+    OPCODE(OP_DIVI_M)
+    {
+      r[*(unsigned char*)(cursor + 10)].ivalue = lux_divide_magic(r[*(unsigned char*)(cursor + 1)].ivalue, *(int*)(cursor + 2), *(unsigned int*)(cursor + 6));
+      cursor += 11;
+    }
+    NEXT;
+    OPCODE(OP_MOD_M)
+    {
+      const int value = r[*(unsigned char*)(cursor + 1)].ivalue;
+      const int d = *(int*)(cursor + 2);
+      const int quotient = lux_divide_magic(value, d, *(unsigned int*)(cursor + 6));
+      r[*(unsigned char*)(cursor + 10)].ivalue = (int)((unsigned int)value - (unsigned int)quotient * (unsigned int)d);
+      cursor += 11;
+    }
+    NEXT;
+    OPCODE(OP_SEL)
+    {
+      // Both values are read so this compiles to a conditional move
+      vmregister_t* res = &r[*(unsigned char*)(cursor + 3)];
+      const int value = r[*(unsigned char*)(cursor + 2)].ivalue;
+      res->ivalue = r[*(unsigned char*)(cursor + 1)].ivalue ? value : res->ivalue;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_JTAB)
+    {
+      // Values below the first entry wrap around past the last one
+      const unsigned int entry = (unsigned int)r[*(unsigned char*)(cursor + 1)].ivalue - (unsigned int)*(int*)(cursor + 2);
+      const unsigned int count = (unsigned int)*(int*)(cursor + 6);
+      cursor += 10 + (entry < count ? entry : count) * 5;
+    }
+    NEXT;
+    OPCODE(OP_CASE)
+    {
+      cursor = code + *(int*)(cursor + 1);
+    }
+    NEXT;
+    OPCODE(OP_SQRTF)
+    {
+      r[*(unsigned char*)(cursor + 2)].fvalue = sqrtf(r[*(unsigned char*)(cursor + 1)].fvalue);
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_ABSI)
+    {
+      const int value = r[*(unsigned char*)(cursor + 1)].ivalue;
+      r[*(unsigned char*)(cursor + 2)].ivalue = value < 0 ? (int)(0u - (unsigned int)value) : value;
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_ABSF)
+    {
+      r[*(unsigned char*)(cursor + 2)].fvalue = fabsf(r[*(unsigned char*)(cursor + 1)].fvalue);
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_FLOORF)
+    {
+      r[*(unsigned char*)(cursor + 2)].fvalue = floorf(r[*(unsigned char*)(cursor + 1)].fvalue);
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_CLZ)
+    {
+      r[*(unsigned char*)(cursor + 2)].ivalue = lux_count_leading_zeros((unsigned int)r[*(unsigned char*)(cursor + 1)].ivalue);
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_POPCNT)
+    {
+      r[*(unsigned char*)(cursor + 2)].ivalue = lux_count_bits((unsigned int)r[*(unsigned char*)(cursor + 1)].ivalue);
+      cursor += 3;
+    }
+    NEXT;
+    OPCODE(OP_MINI)
+    {
+      const int lv = r[*(unsigned char*)(cursor + 1)].ivalue;
+      const int rv = r[*(unsigned char*)(cursor + 2)].ivalue;
+      r[*(unsigned char*)(cursor + 3)].ivalue = lv < rv ? lv : rv;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MAXI)
+    {
+      const int lv = r[*(unsigned char*)(cursor + 1)].ivalue;
+      const int rv = r[*(unsigned char*)(cursor + 2)].ivalue;
+      r[*(unsigned char*)(cursor + 3)].ivalue = lv > rv ? lv : rv;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MINF)
+    {
+      const float lv = r[*(unsigned char*)(cursor + 1)].fvalue;
+      const float rv = r[*(unsigned char*)(cursor + 2)].fvalue;
+      r[*(unsigned char*)(cursor + 3)].fvalue = lv < rv ? lv : rv;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_MAXF)
+    {
+      const float lv = r[*(unsigned char*)(cursor + 1)].fvalue;
+      const float rv = r[*(unsigned char*)(cursor + 2)].fvalue;
+      r[*(unsigned char*)(cursor + 3)].fvalue = lv > rv ? lv : rv;
+      cursor += 4;
+    }
+    NEXT;
+    OPCODE(OP_FMAF)
+    {
+      vmregister_t* res = &r[*(unsigned char*)(cursor + 3)];
+      res->fvalue = fmaf(r[*(unsigned char*)(cursor + 1)].fvalue, r[*(unsigned char*)(cursor + 2)].fvalue, res->fvalue);
+      cursor += 4;
+    }
+    NEXT;
+#ifdef LUX_COMPUTED_GOTO
+    L_SANDBOX:
+    {
+      TRY(lux_vm_sandbox_step(vm, cursor, r, steps))
+      goto *dispatch[*cursor];
+    }
+#endif
+    OPCODE_DEFAULT
+    {
+      lux_vm_set_error(frame->vm, "Unknown opcode");
+      return false;
+    }
   }
-  assert(false);
+
+  // Only the sandbox check leaves the switch loop
   return false;
 }
@@ -6,7 +6,9 @@
 #include "public.h"
 #include "private.h"
 
-#define MEMSIZE 1024 * 8
+// Call frames and registers of script calls come out of the arena too,
+// leave room for deep recursion
+#define MEMSIZE 1024 * 1024
 
 int main(int argc, char* argv[])
 {
@@ -52,6 +54,7 @@ int main(int argc, char* argv[])
   }
 
   printf("Compiled\n");
+  printf("Peephole removed %d bytes, %d instructions\n", vm.peepholebytes, vm.peepholeinstructions);
 
 #if 1
   lux_debug_dump_code_all(&vm);
@@ -0,0 +1,2228 @@
+#include "private.h"
+
+#include <string.h>
+
+/*
+ * Middle-end run on a closure once the compiler has emitted all of its code
+ * The bytecode is lifted into basic blocks and every register read is
+ * assigned the SSA value it holds, merges getting phi values. Values are
+ * then numbered so equal computations share a number, which drives
+ * common subexpression elimination and copy propagation. Dead code is
+ * dropped, pure computations that don't change inside a loop are hoisted
+ * in front of it, registers are renumbered with a linear scan over their
+ * live intervals and the blocks are lowered back into bytecode
+ *
+ * Values are numbered as follows, with R registers, N instructions and
+ * B blocks
+ *   [0, R)               value a register holds on entry
+ *   [R, R + N)           value an instruction produces
+ *   [R + N, R + N + B*R) phi of a register at the start of a block
+ */
+
+#define VALUE_UNKNOWN -1   // Not computed yet
+#define VALUE_CLOBBERED -2 // Overwritten by a call, never equal to anything
+
+typedef struct irinst_s
+{
+  unsigned char op;
+  unsigned char r[3]; // Register operands in encoding order
+  int value;          // Immediate value or function index
+  int magic;          // Second immediate value of OF_RKKR and OF_TABLE instructions
+  int target;         // Index of the instruction jumped to, -1 if none
+  int block;          // Block the instruction belongs to
+  int newoffset;      // Offset once lowered
+  int hoist;          // Block it's moved to the end of out of a loop, -1 if none
+  int copy;           // Register the hoisted result is still copied to, -1 if none
+  bool dead;          // Left out when lowering
+} irinst_t;
+
+typedef struct irblock_s
+{
+  int first;   // First instruction
+  int last;    // One past the last instruction
+  int succ[2]; // Successor blocks, -1 if none
+  int idom;    // Immediate dominator, -1 if unreachable
+  int rpo;     // Position in reverse postorder
+} irblock_t;
+
+typedef struct irexpr_s
+{
+  int op;     // Opcode, -1 if the slot is empty
+  int a;      // Value number of the first operand
+  int b;      // Value number of the second operand
+  int value;  // Immediate value
+  int def;    // Instruction computing it
+} irexpr_t;
+
+typedef struct iralunit_s
+{
+  int first;    // First register of the unit
+  int count;    // Registers moved together
+  int start;    // First point any of them is live at, -1 if never
+  int end;      // Last point any of them is live at
+  int newfirst; // Register the unit is moved to, -1 if not placed yet
+  bool fixed;   // Never moved
+} iralunit_t;
+
+typedef struct iralloc_s
+{
+  int* start;        // First point every register is live at, -1 if never
+  int* end;          // Last point every register is live at
+  int* unitof;       // Unit every register belongs to
+  iralunit_t* units;
+  int numunits;
+  int* calls;        // Instruction of every call
+  int numcalls;
+  bool* across;      // Registers live across every call, window excluded
+} iralloc_t;
+
+typedef struct irfunc_s
+{
+  vm_t* vm;
+  closure_t* closure;
+  int numregs;
+  irinst_t* insts;
+  int numinsts;
+  irblock_t* blocks;
+  int numblocks;
+  int* order;     // Reachable blocks in reverse postorder
+  int numorder;
+  int* preds;     // Predecessors of block b are preds[predstart[b]] .. preds[predstart[b + 1]]
+  int* predstart;
+  int* in;        // Value of every register at the start of every block
+  int* out;       // Value of every register at the end of every block
+  int* vn;        // Value number of every value
+  int numvalues;
+} irfunc_t;
+
+//-----------------------------------------------
+// Returns the register an instruction writes its
+// result to, -1 if none
+//-----------------------------------------------
+static int lux_ir_result(irinst_t* inst)
+{
+  switch(lux_opcode_format(inst->op))
+  {
+    case OF_LDI: return inst->r[0];
+    case OF_RR: return inst->r[1];
+    case OF_RRR: return inst->r[2];
+    case OF_RKR: return inst->r[1];
+    case OF_RKKR: return inst->r[1];
+  }
+
+  return -1;
+}
+
+//-----------------------------------------------
+// Returns the register an instruction writes,
+// including call bases, loop counters and the
+// results of selects and fused multiply adds,
+// -1 if none
+//-----------------------------------------------
+static int lux_ir_written(irinst_t* inst)
+{
+  if(inst->op == OP_CALL || lux_opcode_format(inst->op) == OF_FOR)
+  {
+    return inst->r[0];
+  }
+  if(lux_opcode_format(inst->op) == OF_SEL)
+  {
+    return inst->r[2];
+  }
+  return lux_ir_result(inst);
+}
+
+//-----------------------------------------------
+// Fills 'uses' with the operands an instruction
+// reads that could be read from another register
+// Returns how many there are
+//-----------------------------------------------
+static int lux_ir_uses(irinst_t* inst, unsigned char** uses)
+{
+  switch(lux_opcode_format(inst->op))
+  {
+    case OF_RR:
+    case OF_BR:
+    case OF_RKR:
+    case OF_RKKR:
+    case OF_BRK:
+    case OF_RK:
+    case OF_TABLE:
+    {
+      uses[0] = &inst->r[0];
+      return 1;
+    }
+    case OF_FOR:
+    {
+      // The counter is read and written in place
+      uses[0] = &inst->r[1];
+      return 1;
+    }
+    case OF_RRR:
+    case OF_BRR:
+    case OF_SEL:
+    {
+      // The value a select keeps or an fma adds is read in place
+      uses[0] = &inst->r[0];
+      uses[1] = &inst->r[1];
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------
+// Fills 'regs' with every register operand of an
+// instruction
+// Returns how many there are
+//-----------------------------------------------
+static int lux_ir_registers(irinst_t* inst, unsigned char** regs)
+{
+  switch(lux_opcode_format(inst->op))
+  {
+    case OF_LDI:
+    case OF_CALL:
+    case OF_BR:
+    case OF_BRK:
+    case OF_RK:
+    case OF_TABLE:
+    {
+      regs[0] = &inst->r[0];
+      return 1;
+    }
+    case OF_RR:
+    case OF_BRR:
+    case OF_RKR:
+    case OF_RKKR:
+    case OF_FOR:
+    {
+      regs[0] = &inst->r[0];
+      regs[1] = &inst->r[1];
+      return 2;
+    }
+    case OF_RRR:
+    case OF_SEL:
+    {
+      regs[0] = &inst->r[0];
+      regs[1] = &inst->r[1];
+      regs[2] = &inst->r[2];
+      return 3;
+    }
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------
+// Returns true if an instruction only computes
+// its result from its operands
+//-----------------------------------------------
+static bool lux_ir_is_pure(irinst_t* inst)
+{
+  return lux_ir_result(inst) != -1;
+}
+
+//-----------------------------------------------
+// Returns true if the operands of an opcode can
+// be swapped
+//-----------------------------------------------
+static bool lux_ir_is_commutative(unsigned char op)
+{
+  switch(op)
+  {
+    case OP_ADDI:
+    case OP_MULI:
+    case OP_ADDF:
+    case OP_MULF:
+    case OP_EQI:
+    case OP_NEQI:
+    case OP_EQF:
+    case OP_NEQF:
+    case OP_LAND:
+    case OP_LOR:
+    case OP_BAND:
+    case OP_BXOR:
+    case OP_BOR:
+    case OP_MINI:
+    case OP_MAXI:
+      return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------
+// Updates the values held by registers past an
+// instruction
+//-----------------------------------------------
+static void lux_ir_transfer(irfunc_t* f, irinst_t* inst, int i, int* cur)
+{
+  int def = f->numregs + i;
+  switch(lux_opcode_format(inst->op))
+  {
+    case OF_LDI: cur[inst->r[0]] = def; break;
+    case OF_RR: cur[inst->r[1]] = inst->op == OP_MOV ? cur[inst->r[0]] : def; break;
+    case OF_RRR: cur[inst->r[2]] = def; break;
+    case OF_RKR: cur[inst->r[1]] = def; break;
+    case OF_RKKR: cur[inst->r[1]] = def; break;
+    case OF_FOR: cur[inst->r[0]] = def; break;
+    case OF_SEL: cur[inst->r[2]] = def; break;
+    case OF_CALL:
+    {
+      // The callee's frame overlaps everything from the base up
+      cur[inst->r[0]] = def;
+      for(int r = inst->r[0] + 1; r < f->numregs; r++)
+      {
+        cur[r] = VALUE_CLOBBERED;
+      }
+    }
+    break;
+  }
+}
+
+//-----------------------------------------------
+// Updates the set of live registers going
+// backwards over an instruction
+//-----------------------------------------------
+static void lux_ir_liveness(irfunc_t* f, irinst_t* inst, bool* live)
+{
+  int res = lux_ir_result(inst);
+  if(res != -1)
+  {
+    live[res] = false;
+  }
+
+  if(inst->op == OP_RET)
+  {
+    live[0] = true;
+  }
+  else if(inst->op == OP_CALL || inst->op == OP_TCALL)
+  {
+    closure_t* called = inst->value < f->vm->functiontablesize ? f->vm->functiontable[inst->value] : NULL;
+    int numargs = called ? called->numargs : f->numregs;
+    for(int r = inst->r[0]; r < f->numregs; r++)
+    {
+      live[r] = r > inst->r[0] && r <= inst->r[0] + numargs;
+    }
+  }
+
+  unsigned char* uses[2];
+  int numuses = lux_ir_uses(inst, uses);
+  for(int u = 0; u < numuses; u++)
+  {
+    live[*uses[u]] = true;
+  }
+  if(lux_opcode_format(inst->op) == OF_FOR)
+  {
+    live[inst->r[0]] = true;
+  }
+  else if(lux_opcode_format(inst->op) == OF_SEL)
+  {
+    live[inst->r[2]] = true;
+  }
+}
+
+//-----------------------------------------------
+// Decodes the bytecode of a closure
+// A return is added at the end for jumps past
+// the last instruction, it only gets lowered if
+// something reaches it
+// Returns false if it can't be optimized
+//-----------------------------------------------
+static bool lux_ir_decode(irfunc_t* f, int* index)
+{
+  unsigned char* code = f->closure->code;
+  int i = 0;
+  for(int offset = 0; offset < f->closure->used; offset += lux_opcode_size(code[offset]), i++)
+  {
+    irinst_t* inst = &f->insts[i];
+    memset(inst, 0, sizeof(irinst_t));
+    inst->op = code[offset];
+    inst->target = -1;
+    inst->hoist = -1;
+    inst->copy = -1;
+    index[offset] = i;
+    switch(lux_opcode_format(inst->op))
+    {
+      case OF_LDI:
+      case OF_CALL:
+      case OF_RK:
+        inst->r[0] = code[offset + 1];
+        inst->value = *(int*)(code + offset + 2);
+        break;
+      case OF_RR:
+        inst->r[0] = code[offset + 1];
+        inst->r[1] = code[offset + 2];
+        break;
+      case OF_RRR:
+      case OF_SEL:
+        inst->r[0] = code[offset + 1];
+        inst->r[1] = code[offset + 2];
+        inst->r[2] = code[offset + 3];
+        break;
+      case OF_JMP:
+        inst->target = *(int*)(code + offset + 1);
+        break;
+      case OF_BR:
+        inst->r[0] = code[offset + 1];
+        inst->target = *(int*)(code + offset + 2);
+        break;
+      case OF_BRR:
+        inst->r[0] = code[offset + 1];
+        inst->r[1] = code[offset + 2];
+        inst->target = *(int*)(code + offset + 3);
+        break;
+      case OF_RKR:
+        inst->r[0] = code[offset + 1];
+        inst->value = *(int*)(code + offset + 2);
+        inst->r[1] = code[offset + 6];
+        break;
+      case OF_RKKR:
+        inst->r[0] = code[offset + 1];
+        inst->value = *(int*)(code + offset + 2);
+        inst->magic = *(int*)(code + offset + 6);
+        inst->r[1] = code[offset + 10];
+        break;
+      case OF_TABLE:
+        inst->r[0] = code[offset + 1];
+        inst->value = *(int*)(code + offset + 2);
+        inst->magic = *(int*)(code + offset + 6);
+        break;
+      case OF_BRK:
+        inst->r[0] = code[offset + 1];
+        inst->value = *(int*)(code + offset + 2);
+        inst->target = *(int*)(code + offset + 6);
+        break;
+      case OF_FOR:
+        inst->r[0] = code[offset + 1];
+        inst->r[1] = code[offset + 2];
+        inst->value = *(int*)(code + offset + 3);
+        inst->target = *(int*)(code + offset + 7);
+        break;
+    }
+
+    for(int r = 0; r < 3; r++)
+    {
+      if(inst->r[r] >= f->numregs)
+      {
+        return false;
+      }
+    }
+    if((inst->op == OP_SPILL || inst->op == OP_RELOAD) && (inst->value < 0 || inst->value >= f->closure->numslots))
+    {
+      return false;
+    }
+  }
+
+  memset(&f->insts[i], 0, sizeof(irinst_t));
+  f->insts[i].op = OP_RET;
+  f->insts[i].target = -1;
+  f->insts[i].hoist = -1;
+  f->insts[i].copy = -1;
+  index[f->closure->used] = i;
+
+  // Jump offsets to instruction indices
+  for(i = 0; i < f->numinsts; i++)
+  {
+    if(f->insts[i].target != -1)
+    {
+      if(f->insts[i].target > f->closure->used)
+      {
+        return false;
+      }
+      f->insts[i].target = index[f->insts[i].target];
+    }
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Splits the instructions into basic blocks
+// 'leader' needs space for every instruction
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_ir_build_blocks(irfunc_t* f, int* leader)
+{
+  memset(leader, 0, sizeof(int) * f->numinsts);
+  leader[0] = 1;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    irinst_t* inst = &f->insts[i];
+    if(inst->target != -1)
+    {
+      leader[inst->target] = 1;
+    }
+    // A jump table ends its block too so it can be folded into a jump
+    if((inst->target != -1 || lux_opcode_is_terminator(inst->op) || inst->op == OP_JTAB) && i + 1 < f->numinsts)
+    {
+      leader[i + 1] = 1;
+    }
+  }
+
+  f->numblocks = 0;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    f->numblocks += leader[i];
+  }
+
+  f->blocks = xalloc(f->vm, sizeof(irblock_t) * f->numblocks);
+  if(f->blocks == NULL)
+  {
+    return false;
+  }
+
+  int b = -1;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    if(leader[i])
+    {
+      b++;
+      f->blocks[b].first = i;
+      f->blocks[b].idom = -1;
+      f->blocks[b].rpo = -1;
+    }
+    f->insts[i].block = b;
+    f->blocks[b].last = i + 1;
+  }
+
+  for(b = 0; b < f->numblocks; b++)
+  {
+    irinst_t* inst = &f->insts[f->blocks[b].last - 1];
+    f->blocks[b].succ[0] = inst->target != -1 ? f->insts[inst->target].block : -1;
+    f->blocks[b].succ[1] = !lux_opcode_is_terminator(inst->op) && b + 1 < f->numblocks ? b + 1 : -1;
+  }
+
+  // Predecessor lists
+  f->predstart = xalloc(f->vm, sizeof(int) * (f->numblocks + 1));
+  f->preds = xalloc(f->vm, sizeof(int) * f->numblocks * 2);
+  if(f->predstart == NULL || f->preds == NULL)
+  {
+    return false;
+  }
+
+  memset(f->predstart, 0, sizeof(int) * (f->numblocks + 1));
+  for(b = 0; b < f->numblocks; b++)
+  {
+    for(int s = 0; s < 2; s++)
+    {
+      if(f->blocks[b].succ[s] != -1)
+      {
+        f->predstart[f->blocks[b].succ[s] + 1]++;
+      }
+    }
+  }
+  for(b = 0; b < f->numblocks; b++)
+  {
+    f->predstart[b + 1] += f->predstart[b];
+  }
+  memcpy(leader, f->predstart, sizeof(int) * f->numblocks);
+  for(b = 0; b < f->numblocks; b++)
+  {
+    for(int s = 0; s < 2; s++)
+    {
+      if(f->blocks[b].succ[s] != -1)
+      {
+        f->preds[leader[f->blocks[b].succ[s]]++] = b;
+      }
+    }
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Turns reloads of a spill slot into moves from
+// the register last stored to or loaded from it
+// in the same block, as long as that register
+// still holds the value
+// 'slotreg' needs space for every spill slot
+//-----------------------------------------------
+static void lux_ir_forward_spills(irfunc_t* f, int* slotreg)
+{
+  int numslots = f->closure->numslots;
+  for(int b = 0; b < f->numblocks; b++)
+  {
+    for(int k = 0; k < numslots; k++)
+    {
+      slotreg[k] = -1;
+    }
+
+    for(int i = f->blocks[b].first; i < f->blocks[b].last; i++)
+    {
+      irinst_t* inst = &f->insts[i];
+      int slot = inst->op == OP_SPILL || inst->op == OP_RELOAD ? inst->value : -1;
+      if(inst->op == OP_RELOAD && slotreg[slot] != -1)
+      {
+        inst->op = OP_MOV;
+        inst->r[1] = inst->r[0];
+        inst->r[0] = slotreg[slot];
+        inst->value = 0;
+      }
+
+      // Whatever the instruction writes no longer holds a slot
+      int res = lux_ir_written(inst);
+      for(int k = 0; res != -1 && k < numslots; k++)
+      {
+        if(slotreg[k] == res || (inst->op == OP_CALL && slotreg[k] > res))
+        {
+          slotreg[k] = -1;
+        }
+      }
+
+      if(slot != -1)
+      {
+        slotreg[slot] = inst->op == OP_MOV ? inst->r[1] : inst->r[0];
+      }
+    }
+  }
+}
+
+//-----------------------------------------------
+// Returns the common dominator of two blocks
+//-----------------------------------------------
+static int lux_ir_intersect(irfunc_t* f, int a, int b)
+{
+  while(a != b)
+  {
+    while(f->blocks[a].rpo > f->blocks[b].rpo)
+    {
+      a = f->blocks[a].idom;
+    }
+    while(f->blocks[b].rpo > f->blocks[a].rpo)
+    {
+      b = f->blocks[b].idom;
+    }
+  }
+  return a;
+}
+
+//-----------------------------------------------
+// Returns true if block 'a' dominates block 'b'
+//-----------------------------------------------
+static bool lux_ir_dominates(irfunc_t* f, int a, int b)
+{
+  while(b != a && b != 0)
+  {
+    b = f->blocks[b].idom;
+  }
+  return b == a;
+}
+
+//-----------------------------------------------
+// Orders the reachable blocks and computes their
+// dominators
+// 'stack' needs space for two ints per block
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_ir_build_dominators(irfunc_t* f, int* stack)
+{
+  f->order = xalloc(f->vm, sizeof(int) * f->numblocks);
+  if(f->order == NULL)
+  {
+    return false;
+  }
+
+  // Depth first search, blocks are added to the end of the order as
+  // they're finished
+  int* next = stack + f->numblocks;
+  int depth = 0;
+  int numdone = 0;
+  stack[depth++] = 0;
+  next[0] = 0;
+  f->blocks[0].rpo = 0;
+  while(depth > 0)
+  {
+    int b = stack[depth - 1];
+    if(next[depth - 1] < 2)
+    {
+      int s = f->blocks[b].succ[next[depth - 1]++];
+      if(s != -1 && f->blocks[s].rpo == -1)
+      {
+        f->blocks[s].rpo = 0;
+        next[depth] = 0;
+        stack[depth++] = s;
+      }
+    }
+    else
+    {
+      f->order[f->numblocks - 1 - numdone++] = b;
+      depth--;
+    }
+  }
+
+  // Drop the unreachable blocks from the front
+  f->numorder = numdone;
+  memmove(f->order, f->order + f->numblocks - numdone, sizeof(int) * numdone);
+  for(int i = 0; i < f->numorder; i++)
+  {
+    f->blocks[f->order[i]].rpo = i;
+  }
+
+  f->blocks[0].idom = 0;
+  bool changed = true;
+  while(changed)
+  {
+    changed = false;
+    for(int i = 1; i < f->numorder; i++)
+    {
+      int b = f->order[i];
+      int idom = -1;
+      for(int p = f->predstart[b]; p < f->predstart[b + 1]; p++)
+      {
+        int pred = f->preds[p];
+        if(f->blocks[pred].idom == -1)
+        {
+          continue;
+        }
+        idom = idom == -1 ? pred : lux_ir_intersect(f, pred, idom);
+      }
+      if(idom != f->blocks[b].idom)
+      {
+        f->blocks[b].idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Computes the value of every register at the
+// start and end of every reachable block
+// A merge of different values becomes a phi,
+// phis merging a value with themselves don't
+// 'cur' needs space for every register
+//-----------------------------------------------
+static void lux_ir_build_ssa(irfunc_t* f, int* cur)
+{
+  int numregs = f->numregs;
+  for(int i = 0; i < f->numblocks * numregs; i++)
+  {
+    f->in[i] = VALUE_UNKNOWN;
+    f->out[i] = VALUE_UNKNOWN;
+  }
+
+  bool changed = true;
+  for(int iteration = 0; changed && iteration < 64; iteration++)
+  {
+    changed = false;
+    for(int o = 0; o < f->numorder; o++)
+    {
+      int b = f->order[o];
+      for(int r = 0; r < numregs; r++)
+      {
+        int phi = f->numregs + f->numinsts + b * numregs + r;
+        int value = b == 0 ? r : VALUE_UNKNOWN;
+        for(int p = f->predstart[b]; p < f->predstart[b + 1]; p++)
+        {
+          int w = f->out[f->preds[p] * numregs + r];
+          if(w == VALUE_UNKNOWN || w == phi)
+          {
+            continue;
+          }
+          value = value == VALUE_UNKNOWN || value == w ? w : phi;
+        }
+        f->in[b * numregs + r] = value;
+      }
+
+      memcpy(cur, f->in + b * numregs, sizeof(int) * numregs);
+      for(int i = f->blocks[b].first; i < f->blocks[b].last; i++)
+      {
+        lux_ir_transfer(f, &f->insts[i], i, cur);
+      }
+      if(memcmp(cur, f->out + b * numregs, sizeof(int) * numregs))
+      {
+        memcpy(f->out + b * numregs, cur, sizeof(int) * numregs);
+        changed = true;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------
+// Returns the instruction loading the literal a
+// register holds, NULL if it isn't one
+//-----------------------------------------------
+static irinst_t* lux_ir_literal_of(irfunc_t* f, int* cur, int reg)
+{
+  int value = cur[reg];
+  if(value < f->numregs || value >= f->numregs + f->numinsts)
+  {
+    return NULL;
+  }
+  irinst_t* inst = &f->insts[value - f->numregs];
+  return inst->op == OP_LDI && !inst->dead ? inst : NULL;
+}
+
+//-----------------------------------------------
+// Replaces computations on literals with loads
+// of their result, literal operands with
+// immediates and branches on literals with a
+// jump or nothing
+// Returns true if a branch changed, the blocks
+// have to be rebuilt then
+//-----------------------------------------------
+static bool lux_ir_fold_constants(irfunc_t* f, int* cur)
+{
+  bool branched = false;
+  for(int o = 0; o < f->numorder; o++)
+  {
+    int b = f->order[o];
+    memcpy(cur, f->in + b * f->numregs, sizeof(int) * f->numregs);
+    for(int i = f->blocks[b].first; i < f->blocks[b].last; i++)
+    {
+      irinst_t* inst = &f->insts[i];
+      if(inst->dead)
+      {
+        lux_ir_transfer(f, inst, i, cur);
+        continue;
+      }
+
+      // Selects on a literal or between equal values are decided
+      irinst_t* cond = lux_ir_literal_of(f, cur, inst->r[0]);
+      bool same = cur[inst->r[1]] >= 0 && cur[inst->r[1]] == cur[inst->r[2]];
+      if(inst->op == OP_SEL && (cond != NULL || same))
+      {
+        if(cond != NULL && cond->value != 0 && !same)
+        {
+          inst->op = OP_MOV;
+          inst->r[0] = inst->r[1];
+          inst->r[1] = inst->r[2];
+          inst->r[2] = 0;
+        }
+        else
+        {
+          inst->dead = true;
+        }
+        lux_ir_transfer(f, inst, i, cur);
+        continue;
+      }
+
+      unsigned char* uses[2];
+      int numuses = lux_ir_uses(inst, uses);
+      int format = lux_opcode_format(inst->op);
+      vmregister_t operands[2];
+      bool literal = numuses > 0 && format != OF_FOR;
+      for(int u = 0; u < numuses && literal; u++)
+      {
+        irinst_t* def = lux_ir_literal_of(f, cur, *uses[u]);
+        literal = def != NULL;
+        if(literal)
+        {
+          operands[u].ivalue = def->value;
+        }
+      }
+      if(literal && (format == OF_RKR || format == OF_RKKR || format == OF_BRK))
+      {
+        operands[1].ivalue = inst->value;
+      }
+      else if(numuses < 2)
+      {
+        operands[1].ivalue = 0;
+      }
+
+      vmregister_t res;
+      bool taken;
+      int reg = lux_ir_result(inst);
+      if(literal && reg != -1 && inst->op != OP_MOV && lux_opcode_fold(inst->op, operands[0], operands[1], &res))
+      {
+        inst->op = OP_LDI;
+        inst->r[0] = reg;
+        inst->value = res.ivalue;
+        inst->magic = 0;
+      }
+      else if(format == OF_RRR && !literal && lux_opcode_immediate(inst->op) != OP_NOP)
+      {
+        // A single literal operand becomes an immediate, the load feeding
+        // it usually goes away
+        irinst_t* right = lux_ir_literal_of(f, cur, inst->r[1]);
+        irinst_t* left = lux_ir_is_commutative(inst->op) ? lux_ir_literal_of(f, cur, inst->r[0]) : NULL;
+        if(right != NULL || left != NULL)
+        {
+          inst->value = right != NULL ? right->value : left->value;
+          inst->r[0] = right != NULL ? inst->r[0] : inst->r[1];
+          inst->r[1] = inst->r[2];
+          inst->r[2] = 0;
+          inst->op = lux_opcode_immediate(inst->op);
+        }
+      }
+
+      // Int identities, float ones don't hold for -0 and NaN
+      if(!inst->dead && lux_opcode_format(inst->op) == OF_RKR)
+      {
+        int k = inst->value;
+        unsigned char op = inst->op;
+        if((k == 0 && (op == OP_ADDI_K || op == OP_SUBI_K || op == OP_BOR_K || op == OP_BXOR_K || op == OP_LSFT_K || op == OP_RSFT_K)) ||
+           (k == 1 && (op == OP_MULI_K || op == OP_DIVI_K)))
+        {
+          inst->op = OP_MOV;
+          inst->value = 0;
+        }
+        else if(k == 0 && (op == OP_MULI_K || op == OP_BAND_K))
+        {
+          inst->op = OP_LDI;
+          inst->r[0] = inst->r[1];
+          inst->r[1] = 0;
+        }
+      }
+      else if(literal && inst->op == OP_JTAB)
+      {
+        // Jump straight to where the entry picked goes, the table becomes
+        // unreachable
+        unsigned int entry = (unsigned int)operands[0].ivalue - (unsigned int)inst->value;
+        entry = entry < (unsigned int)inst->magic ? entry : (unsigned int)inst->magic;
+        inst->op = OP_JMP;
+        inst->target = f->insts[i + 1 + entry].target;
+        inst->r[0] = 0;
+        inst->value = 0;
+        inst->magic = 0;
+        branched = true;
+      }
+      else if(literal && inst->target != -1 && lux_opcode_fold_branch(inst->op, operands[0], operands[1], &taken))
+      {
+        if(taken)
+        {
+          inst->op = OP_JMP;
+        }
+        else
+        {
+          inst->dead = true;
+          inst->target = -1;
+        }
+        branched = true;
+      }
+      lux_ir_transfer(f, inst, i, cur);
+    }
+  }
+
+  return branched;
+}
+
+//-----------------------------------------------
+// Rebuilds the blocks after jumps changed
+// 'scratch' needs space for two ints per
+// instruction
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_ir_rebuild_blocks(irfunc_t* f, int* scratch)
+{
+  xfree(f->vm, f->order);
+  xfree(f->vm, f->preds);
+  xfree(f->vm, f->predstart);
+  xfree(f->vm, f->blocks);
+  f->order = NULL;
+  f->preds = NULL;
+  f->predstart = NULL;
+  f->blocks = NULL;
+  return lux_ir_build_blocks(f, scratch) && lux_ir_build_dominators(f, scratch);
+}
+
+//-----------------------------------------------
+// Returns the register holding a value where it
+// gets defined
+//-----------------------------------------------
+static int lux_ir_value_register(irfunc_t* f, int value)
+{
+  if(value < f->numregs)
+  {
+    return value;
+  }
+  else if(value < f->numregs + f->numinsts)
+  {
+    irinst_t* inst = &f->insts[value - f->numregs];
+    return lux_ir_written(inst);
+  }
+  return (value - f->numregs - f->numinsts) % f->numregs;
+}
+
+//-----------------------------------------------
+// Returns the value number of what a register
+// holds, -1 if it isn't equal to anything
+//-----------------------------------------------
+static int lux_ir_number_of(irfunc_t* f, int* cur, int reg)
+{
+  return cur[reg] < 0 ? -1 : f->vn[cur[reg]];
+}
+
+//-----------------------------------------------
+// Numbers values so computations with the same
+// operation on the same values share a number
+// with the dominating one
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_ir_number_values(irfunc_t* f, int* cur)
+{
+  for(int v = 0; v < f->numvalues; v++)
+  {
+    f->vn[v] = v;
+  }
+
+  int size = 16;
+  while(size < f->numinsts * 2)
+  {
+    size *= 2;
+  }
+  irexpr_t* table = xalloc(f->vm, sizeof(irexpr_t) * size);
+  if(table == NULL)
+  {
+    return false;
+  }
+  for(int e = 0; e < size; e++)
+  {
+    table[e].op = -1;
+  }
+
+  for(int o = 0; o < f->numorder; o++)
+  {
+    int b = f->order[o];
+    memcpy(cur, f->in + b * f->numregs, sizeof(int) * f->numregs);
+    for(int i = f->blocks[b].first; i < f->blocks[b].last; i++)
+    {
+      irinst_t* inst = &f->insts[i];
+      // Reloads read slots a spill could have changed since
+      if(lux_ir_is_pure(inst) && inst->op != OP_MOV && inst->op != OP_RELOAD)
+      {
+        irexpr_t key;
+        key.op = inst->op;
+        key.a = -1;
+        key.b = -1;
+        key.value = inst->value;
+        key.def = f->numregs + i;
+
+        unsigned char* uses[2];
+        int numuses = lux_ir_uses(inst, uses);
+        if(numuses > 0)
+        {
+          key.a = lux_ir_number_of(f, cur, *uses[0]);
+        }
+        if(numuses > 1)
+        {
+          key.b = lux_ir_number_of(f, cur, *uses[1]);
+        }
+        if(lux_ir_is_commutative(inst->op) && key.a > key.b)
+        {
+          int t = key.a;
+          key.a = key.b;
+          key.b = t;
+        }
+
+        if((numuses < 1 || key.a != -1) && (numuses < 2 || key.b != -1))
+        {
+          unsigned int hash = (unsigned int)key.op * 31u + (unsigned int)key.a * 131u + (unsigned int)key.b * 1031u + (unsigned int)key.value * 8191u;
+          int e = hash & (size - 1);
+          for(; table[e].op != -1; e = (e + 1) & (size - 1))
+          {
+            irexpr_t* x = &table[e];
+            if(x->op == key.op && x->a == key.a && x->b == key.b && x->value == key.value &&
+               lux_ir_dominates(f, f->insts[x->def - f->numregs].block, b))
+            {
+              f->vn[key.def] = f->vn[x->def];
+              break;
+            }
+          }
+          if(table[e].op == -1)
+          {
+            table[e] = key;
+          }
+        }
+      }
+      lux_ir_transfer(f, inst, i, cur);
+    }
+  }
+
+  xfree(f->vm, table);
+  return true;
+}
+
+//-----------------------------------------------
+// Reads every operand from the register holding
+// its value where it was first computed, turns
+// recomputations into moves and drops moves of
+// a value into a register already holding it
+// Returns true if anything changed
+//-----------------------------------------------
+static bool lux_ir_rewrite(irfunc_t* f, int* cur)
+{
+  bool changed = false;
+  for(int o = 0; o < f->numorder; o++)
+  {
+    int b = f->order[o];
+    memcpy(cur, f->in + b * f->numregs, sizeof(int) * f->numregs);
+    for(int i = f->blocks[b].first; i < f->blocks[b].last; i++)
+    {
+      irinst_t* inst = &f->insts[i];
+      irinst_t original = *inst;
+      if(inst->dead)
+      {
+        lux_ir_transfer(f, &original, i, cur);
+        continue;
+      }
+
+      // Copy propagation
+      unsigned char* uses[2];
+      int numuses = lux_ir_uses(inst, uses);
+      for(int u = 0; u < numuses; u++)
+      {
+        int number = lux_ir_number_of(f, cur, *uses[u]);
+        if(number == -1)
+        {
+          continue;
+        }
+        int reg = lux_ir_value_register(f, number);
+        if(reg != *uses[u] && lux_ir_number_of(f, cur, reg) == number)
+        {
+          *uses[u] = reg;
+          changed = true;
+        }
+      }
+
+      int res = lux_ir_result(inst);
+      if(inst->op == OP_MOV)
+      {
+        int number = lux_ir_number_of(f, cur, inst->r[0]);
+        if(number != -1 && lux_ir_number_of(f, cur, res) == number)
+        {
+          inst->dead = true;
+          changed = true;
+        }
+      }
+      else if(res != -1)
+      {
+        // Common subexpression elimination
+        int number = f->vn[f->numregs + i];
+        int reg = lux_ir_value_register(f, number);
+        if(lux_ir_number_of(f, cur, res) == number)
+        {
+          inst->dead = true;
+          changed = true;
+        }
+        else if(number != f->numregs + i && lux_ir_number_of(f, cur, reg) == number)
+        {
+          inst->op = OP_MOV;
+          inst->r[0] = reg;
+          inst->r[1] = res;
+          changed = true;
+        }
+      }
+
+      lux_ir_transfer(f, &original, i, cur);
+    }
+  }
+
+  return changed;
+}
+
+//-----------------------------------------------
+// Fills 'cur' with the registers live at the end
+// of a block
+//-----------------------------------------------
+static void lux_ir_live_out(irfunc_t* f, bool* live, int b, bool* cur)
+{
+  memset(cur, 0, sizeof(bool) * f->numregs);
+  for(int s = 0; s < 2; s++)
+  {
+    if(f->blocks[b].succ[s] != -1)
+    {
+      for(int r = 0; r < f->numregs; r++)
+      {
+        cur[r] |= live[f->blocks[b].succ[s] * f->numregs + r];
+      }
+    }
+  }
+}
+
+//-----------------------------------------------
+// Computes the registers live at the start of
+// every block
+// 'live' needs space for a set of registers per
+// block plus one
+//-----------------------------------------------
+static void lux_ir_build_liveness(irfunc_t* f, bool* live)
+{
+  int numregs = f->numregs;
+  bool* cur = live + f->numblocks * numregs;
+  memset(live, 0, sizeof(bool) * f->numblocks * numregs);
+  bool iterate = true;
+  while(iterate)
+  {
+    iterate = false;
+    for(int o = f->numorder - 1; o >= 0; o--)
+    {
+      int b = f->order[o];
+      lux_ir_live_out(f, live, b, cur);
+      for(int i = f->blocks[b].last - 1; i >= f->blocks[b].first; i--)
+      {
+        if(!f->insts[i].dead)
+        {
+          lux_ir_liveness(f, &f->insts[i], cur);
+        }
+      }
+
+      if(memcmp(cur, live + b * numregs, sizeof(bool) * numregs))
+      {
+        memcpy(live + b * numregs, cur, sizeof(bool) * numregs);
+        iterate = true;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------
+// Drops unreachable code and results nobody reads
+// 'live' needs space for a set of registers per
+// block plus one
+// Returns true if anything changed
+//-----------------------------------------------
+static bool lux_ir_eliminate_dead_code(irfunc_t* f, bool* live)
+{
+  bool changed = false;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    if(f->blocks[f->insts[i].block].idom == -1 && !f->insts[i].dead)
+    {
+      f->insts[i].dead = true;
+      changed = true;
+    }
+  }
+
+  lux_ir_build_liveness(f, live);
+
+  // Drop results that aren't live past their instruction
+  bool* cur = live + f->numblocks * f->numregs;
+  for(int o = 0; o < f->numorder; o++)
+  {
+    int b = f->order[o];
+    lux_ir_live_out(f, live, b, cur);
+    for(int i = f->blocks[b].last - 1; i >= f->blocks[b].first; i--)
+    {
+      irinst_t* inst = &f->insts[i];
+      if(inst->dead)
+      {
+        continue;
+      }
+
+      // A select or fma nobody reads after it goes too
+      int res = lux_opcode_format(inst->op) == OF_SEL ? inst->r[2] : lux_ir_result(inst);
+      if(res != -1 && !cur[res])
+      {
+        inst->dead = true;
+        changed = true;
+        continue;
+      }
+      lux_ir_liveness(f, inst, cur);
+    }
+  }
+
+  return changed;
+}
+
+//-----------------------------------------------
+// Marks the blocks of the loop closed by the back
+// edges into block 'h'
+// 'stack' needs space for every block
+// Returns the number of blocks in the loop, 0 if
+// nothing jumps back to 'h'
+//-----------------------------------------------
+static int lux_ir_loop_body(irfunc_t* f, int h, bool* inloop, int* stack)
+{
+  memset(inloop, 0, sizeof(bool) * f->numblocks);
+  inloop[h] = true;
+  int size = 1;
+  int depth = 0;
+  bool closed = false;
+  for(int p = f->predstart[h]; p < f->predstart[h + 1]; p++)
+  {
+    int pred = f->preds[p];
+    if(f->blocks[pred].idom == -1 || !lux_ir_dominates(f, h, pred))
+    {
+      continue;
+    }
+    closed = true;
+    if(!inloop[pred])
+    {
+      inloop[pred] = true;
+      stack[depth++] = pred;
+      size++;
+    }
+  }
+
+  // Everything reaching a back edge without going through the header
+  while(depth > 0)
+  {
+    int b = stack[--depth];
+    for(int p = f->predstart[b]; p < f->predstart[b + 1]; p++)
+    {
+      int pred = f->preds[p];
+      if(f->blocks[pred].idom != -1 && !inloop[pred])
+      {
+        inloop[pred] = true;
+        stack[depth++] = pred;
+        size++;
+      }
+    }
+  }
+
+  return closed ? size : 0;
+}
+
+//-----------------------------------------------
+// Returns the block the code hoisted out of a
+// loop can be put at the end of, -1 if there is
+// none
+// It has to be the only way into the header from
+// outside the loop and either fall through or
+// jump unconditionally into it
+//-----------------------------------------------
+static int lux_ir_preheader(irfunc_t* f, int h, bool* inloop)
+{
+  int preheader = -1;
+  for(int p = f->predstart[h]; p < f->predstart[h + 1]; p++)
+  {
+    int pred = f->preds[p];
+    if(inloop[pred] || f->blocks[pred].idom == -1)
+    {
+      continue;
+    }
+    if(preheader != -1 && preheader != pred)
+    {
+      return -1;
+    }
+    preheader = pred;
+  }
+
+  if(preheader == -1)
+  {
+    return -1;
+  }
+  irinst_t* last = &f->insts[f->blocks[preheader].last - 1];
+  if(last->op == OP_JMP || (f->blocks[preheader].succ[0] != h && f->blocks[preheader].succ[1] == h))
+  {
+    return preheader;
+  }
+  return -1;
+}
+
+//-----------------------------------------------
+// Returns true if an instruction can be moved
+// where it may run when it otherwise wouldn't
+//-----------------------------------------------
+static bool lux_ir_is_hoistable(irinst_t* inst)
+{
+  switch(inst->op)
+  {
+    // Trap on a zero divisor
+    case OP_DIVI:
+    case OP_MOD:
+    case OP_DIVF:
+      return false;
+    case OP_DIVI_K:
+    case OP_MOD_K:
+      return inst->value != 0 && inst->value != -1;
+    case OP_DIVF_K:
+    {
+      // Either sign of zero
+      vmregister_t divisor;
+      divisor.ivalue = inst->value;
+      return divisor.fvalue != 0.0f;
+    }
+    // Reads a slot the loop may store to
+    case OP_RELOAD:
+      return false;
+    // Nothing is gained
+    case OP_MOV:
+      return false;
+  }
+
+  return lux_ir_is_pure(inst);
+}
+
+//-----------------------------------------------
+// Returns true if 'value' read from 'reg' by
+// instruction 'i' is the same on every iteration
+// of a loop and already in 'reg' at the end of
+// its preheader
+//-----------------------------------------------
+static bool lux_ir_is_invariant(irfunc_t* f, bool* inloop, int preheader, int reg, int value, int i)
+{
+  if(value < 0)
+  {
+    return false;
+  }
+  if(value >= f->numregs && value < f->numregs + f->numinsts)
+  {
+    // Hoisted code keeps its order
+    irinst_t* def = &f->insts[value - f->numregs];
+    if(inloop[def->block])
+    {
+      return def->hoist != -1 && value - f->numregs < i && lux_ir_result(def) == reg;
+    }
+  }
+  else if(value >= f->numregs + f->numinsts && inloop[(value - f->numregs - f->numinsts) / f->numregs])
+  {
+    return false;
+  }
+
+  // A copy made in the loop carries the value but isn't there yet in front of it
+  return f->out[preheader * f->numregs + reg] == value;
+}
+
+//-----------------------------------------------
+// Returns a register below 'limit' nothing in a
+// loop touches, -1 if there is none
+//-----------------------------------------------
+static int lux_ir_free_register(irfunc_t* f, int h, bool* live, int* defs, bool* taken, int limit)
+{
+  for(int r = 0; r < limit; r++)
+  {
+    // Anything read in the loop that it doesn't write is live into it
+    if(defs[r] == 0 && !taken[r] && !live[h * f->numregs + r])
+    {
+      return r;
+    }
+  }
+  return -1;
+}
+
+//-----------------------------------------------
+// Marks the pure instructions of a loop whose
+// operands don't change in it to be moved in
+// front of it
+// The result has to sit below every call window
+// so the callees can't touch it and can't be read
+// before the instruction on entry. If its register
+// is written elsewhere in the loop the result goes
+// to a register the loop doesn't use, reads in the
+// loop get it from there and the instruction
+// leaves a copy behind
+// 'live' holds the registers live at the start of
+// every block, 'taken' the registers hoisted code
+// already writes
+// Returns true if anything was marked
+//-----------------------------------------------
+static bool lux_ir_hoist_loop(irfunc_t* f, int h, int preheader, bool* inloop, bool* live, int* cur, int* defs, bool* taken)
+{
+  int minbase = f->numregs;
+  memset(defs, 0, sizeof(int) * f->numregs);
+  for(int b = 0; b < f->numblocks; b++)
+  {
+    for(int i = f->blocks[b].first; inloop[b] && i < f->blocks[b].last; i++)
+    {
+      irinst_t* inst = &f->insts[i];
+      int res = lux_ir_written(inst);
+      if(inst->dead || res == -1)
+      {
+        continue;
+      }
+      defs[res]++;
+      if(inst->copy != -1)
+      {
+        defs[inst->copy]++;
+      }
+      if(inst->op == OP_CALL && res < minbase)
+      {
+        minbase = res;
+      }
+    }
+  }
+
+  bool hoisted = false;
+  for(int b = 0; b < f->numblocks; b++)
+  {
+    if(!inloop[b])
+    {
+      continue;
+    }
+
+    memcpy(cur, f->in + b * f->numregs, sizeof(int) * f->numregs);
+    for(int i = f->blocks[b].first; i < f->blocks[b].last; i++)
+    {
+      irinst_t* inst = &f->insts[i];
+      irinst_t original = *inst;
+      if(inst->dead)
+      {
+        lux_ir_transfer(f, &original, i, cur);
+        continue;
+      }
+
+      unsigned char* uses[2];
+      int numuses = lux_ir_uses(inst, uses);
+      bool invariant = inst->hoist == -1 && lux_ir_is_hoistable(inst);
+      for(int u = 0; u < numuses; u++)
+      {
+        int value = cur[*uses[u]];
+
+        // Results hoisted into another register are read from there
+        irinst_t* def = value >= f->numregs && value < f->numregs + f->numinsts ? &f->insts[value - f->numregs] : NULL;
+        if(def != NULL && def->copy != -1 && inloop[def->block])
+        {
+          *uses[u] = lux_ir_result(def);
+        }
+        invariant = invariant && lux_ir_is_invariant(f, inloop, preheader, *uses[u], value, i);
+      }
+
+      int res = lux_ir_result(inst);
+      if(invariant && res < minbase)
+      {
+        // A register the loop reads on entry holds a variable the copy
+        // would have to keep updating, and a copy costs as much as loading
+        // a literal again, only computed temporaries are worth moving
+        int reg = -1;
+        if(!live[h * f->numregs + res] && defs[res] == 1)
+        {
+          reg = res;
+        }
+        else if(!live[h * f->numregs + res] && numuses > 0)
+        {
+          reg = lux_ir_free_register(f, h, live, defs, taken, minbase);
+        }
+        if(reg != -1)
+        {
+          if(reg != res)
+          {
+            // The result is always the last register operand
+            unsigned char* regs[3];
+            *regs[lux_ir_registers(inst, regs) - 1] = reg;
+            inst->copy = res;
+            defs[reg]++;
+          }
+          inst->hoist = preheader;
+          taken[reg] = true;
+          hoisted = true;
+        }
+      }
+      lux_ir_transfer(f, &original, i, cur);
+    }
+  }
+
+  return hoisted;
+}
+
+//-----------------------------------------------
+// Marks loop invariant code to be moved out of
+// every loop with a preheader, outer loops first
+// so code can move out of several at once
+// 'live' holds the registers live at the start of
+// every block
+// Returns true if anything was marked
+//-----------------------------------------------
+static bool lux_ir_hoist_invariants(irfunc_t* f, bool* live, int* cur)
+{
+  int* headers = xalloc(f->vm, sizeof(int) * (f->numblocks * 3 + f->numregs));
+  bool* inloop = xalloc(f->vm, sizeof(bool) * (f->numblocks + f->numregs));
+  if(headers == NULL || inloop == NULL)
+  {
+    xfree(f->vm, inloop);
+    xfree(f->vm, headers);
+    return false;
+  }
+  int* sizes = headers + f->numblocks;
+  int* stack = sizes + f->numblocks;
+  int* defs = stack + f->numblocks;
+  bool* taken = inloop + f->numblocks;
+  memset(taken, 0, sizeof(bool) * f->numregs);
+
+  // Bigger loops can contain smaller ones, never the other way round
+  int numloops = 0;
+  for(int o = 0; o < f->numorder; o++)
+  {
+    int h = f->order[o];
+    int size = lux_ir_loop_body(f, h, inloop, stack);
+    if(size == 0)
+    {
+      continue;
+    }
+    int l = numloops++;
+    for(; l > 0 && sizes[l - 1] < size; l--)
+    {
+      headers[l] = headers[l - 1];
+      sizes[l] = sizes[l - 1];
+    }
+    headers[l] = h;
+    sizes[l] = size;
+  }
+
+  bool hoisted = false;
+  for(int l = 0; l < numloops; l++)
+  {
+    int h = headers[l];
+    lux_ir_loop_body(f, h, inloop, stack);
+    int preheader = lux_ir_preheader(f, h, inloop);
+    if(preheader != -1)
+    {
+      hoisted |= lux_ir_hoist_loop(f, h, preheader, inloop, live, cur, defs, taken);
+    }
+  }
+
+  xfree(f->vm, inloop);
+  xfree(f->vm, headers);
+  return hoisted;
+}
+
+//-----------------------------------------------
+// Moves the hoisted instructions to the end of
+// their preheader, before its jump if it ends in
+// one, leaves their copies behind and rebuilds
+// the blocks
+// 'scratch' needs space for four ints per
+// instruction
+// Returns false on fatal error
+//-----------------------------------------------
+static bool lux_ir_move_hoisted(irfunc_t* f, int* scratch)
+{
+  // Count what goes into every block first so only those get searched
+  int* newfirst = scratch;
+  memset(newfirst, 0, sizeof(int) * f->numblocks);
+  int numinsts = f->numinsts;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    if(f->insts[i].hoist != -1)
+    {
+      newfirst[f->insts[i].hoist]++;
+      numinsts += f->insts[i].copy != -1;
+    }
+  }
+
+  irinst_t* insts = xalloc(f->vm, sizeof(irinst_t) * numinsts);
+  if(insts == NULL)
+  {
+    return false;
+  }
+
+  int n = 0;
+  for(int b = 0; b < f->numblocks; b++)
+  {
+    int count = newfirst[b];
+    newfirst[b] = n;
+    int last = f->blocks[b].last;
+    bool jumps = f->insts[last - 1].op == OP_JMP;
+    for(int i = f->blocks[b].first; i < last - jumps; i++)
+    {
+      irinst_t* inst = &f->insts[i];
+      if(inst->hoist == -1)
+      {
+        insts[n++] = *inst;
+      }
+      else if(inst->copy != -1)
+      {
+        insts[n] = *inst;
+        insts[n].op = OP_MOV;
+        insts[n].r[0] = lux_ir_result(inst);
+        insts[n].r[1] = inst->copy;
+        insts[n].value = 0;
+        insts[n].hoist = -1;
+        insts[n++].copy = -1;
+      }
+    }
+    for(int i = 0; count > 0 && i < f->numinsts; i++)
+    {
+      if(f->insts[i].hoist == b)
+      {
+        insts[n] = f->insts[i];
+        insts[n].hoist = -1;
+        insts[n++].copy = -1;
+        count--;
+      }
+    }
+    if(jumps)
+    {
+      insts[n++] = f->insts[last - 1];
+    }
+  }
+
+  // Jumps always go to the start of a block
+  for(int i = 0; i < n; i++)
+  {
+    if(insts[i].target != -1)
+    {
+      insts[i].target = newfirst[f->insts[insts[i].target].block];
+    }
+  }
+
+  xfree(f->vm, f->insts);
+  f->insts = insts;
+  f->numinsts = n;
+  return lux_ir_rebuild_blocks(f, scratch);
+}
+
+//-----------------------------------------------
+// Returns the number of arguments a call passes,
+// -1 if the callee isn't known
+//-----------------------------------------------
+static int lux_ir_call_args(irfunc_t* f, irinst_t* inst)
+{
+  if(inst->value < 0 || inst->value >= f->vm->functiontablesize || f->vm->functiontable[inst->value] == NULL)
+  {
+    return -1;
+  }
+  return f->vm->functiontable[inst->value]->numargs;
+}
+
+//-----------------------------------------------
+// Extends the live interval of a register to
+// cover a point
+//-----------------------------------------------
+static void lux_ir_extend(iralloc_t* a, int reg, int point)
+{
+  if(a->start[reg] == -1 || point < a->start[reg])
+  {
+    a->start[reg] = point;
+  }
+  if(point > a->end[reg])
+  {
+    a->end[reg] = point;
+  }
+}
+
+//-----------------------------------------------
+// Computes the live interval of every register
+// and what is live across every call
+// Every instruction has two points, 2i where it
+// reads its operands and 2i + 1 where it writes
+// its result
+// Returns false if the registers can't be moved
+//-----------------------------------------------
+static bool lux_ir_build_intervals(irfunc_t* f, bool* live, iralloc_t* a)
+{
+  int numregs = f->numregs;
+  bool* cur = live + f->numblocks * numregs;
+  for(int r = 0; r < numregs; r++)
+  {
+    a->start[r] = -1;
+    a->end[r] = -1;
+  }
+
+  a->numcalls = 0;
+  for(int o = 0; o < f->numorder; o++)
+  {
+    int b = f->order[o];
+    lux_ir_live_out(f, live, b, cur);
+    for(int i = f->blocks[b].last - 1; i >= f->blocks[b].first; i--)
+    {
+      irinst_t* inst = &f->insts[i];
+      if(inst->dead)
+      {
+        continue;
+      }
+
+      for(int r = 0; r < numregs; r++)
+      {
+        if(cur[r])
+        {
+          lux_ir_extend(a, r, 2 * i + 1);
+        }
+      }
+      int res = lux_ir_written(inst);
+      if(res != -1)
+      {
+        lux_ir_extend(a, res, 2 * i + 1);
+      }
+
+      if(inst->op == OP_CALL || inst->op == OP_TCALL)
+      {
+        // The window has to stay where the callee expects it
+        int base = inst->r[0];
+        int numargs = lux_ir_call_args(f, inst);
+        if(numargs == -1 || base <= f->closure->numargs || base + numargs >= numregs)
+        {
+          return false;
+        }
+
+        bool* across = a->across + a->numcalls * numregs;
+        for(int r = 0; r < numregs; r++)
+        {
+          across[r] = cur[r] && (r < base || r > base + numargs);
+        }
+        a->calls[a->numcalls++] = i;
+        lux_ir_extend(a, base, 2 * i + 1);
+      }
+
+      lux_ir_liveness(f, inst, cur);
+      for(int r = 0; r < numregs; r++)
+      {
+        if(cur[r])
+        {
+          lux_ir_extend(a, r, 2 * i);
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Groups the registers into units that get moved
+// as one, the registers of a call window have to
+// stay next to each other
+// 'link' needs space for every register
+//-----------------------------------------------
+static void lux_ir_build_units(irfunc_t* f, iralloc_t* a, bool* link)
+{
+  memset(link, 0, sizeof(bool) * f->numregs);
+  for(int c = 0; c < a->numcalls; c++)
+  {
+    irinst_t* inst = &f->insts[a->calls[c]];
+    for(int r = inst->r[0]; r < inst->r[0] + lux_ir_call_args(f, inst); r++)
+    {
+      link[r] = true;
+    }
+  }
+
+  a->numunits = 0;
+  for(int r = 0; r < f->numregs; r++)
+  {
+    iralunit_t* u;
+    if(r > 0 && link[r - 1])
+    {
+      u = &a->units[a->numunits - 1];
+    }
+    else
+    {
+      // r0 and the arguments never move
+      u = &a->units[a->numunits++];
+      u->first = r;
+      u->count = 0;
+      u->start = -1;
+      u->end = -1;
+      u->fixed = r <= f->closure->numargs;
+      u->newfirst = u->fixed ? r : -1;
+    }
+
+    u->count++;
+    a->unitof[r] = u - a->units;
+    if(a->start[r] != -1)
+    {
+      u->start = u->start == -1 || a->start[r] < u->start ? a->start[r] : u->start;
+      u->end = a->end[r] > u->end ? a->end[r] : u->end;
+    }
+  }
+}
+
+//-----------------------------------------------
+// Returns true if a unit holds a register in a
+// set of registers live across a call
+//-----------------------------------------------
+static bool lux_ir_unit_across(iralunit_t* u, bool* across)
+{
+  for(int r = u->first; r < u->first + u->count; r++)
+  {
+    if(across[r])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+//-----------------------------------------------
+// Narrows where a unit can be placed so whatever
+// is live across a call stays below its window
+//-----------------------------------------------
+static void lux_ir_call_bounds(irfunc_t* f, iralloc_t* a, iralunit_t* u, int* low, int* high)
+{
+  for(int c = 0; c < a->numcalls; c++)
+  {
+    int base = f->insts[a->calls[c]].r[0];
+    iralunit_t* w = &a->units[a->unitof[base]];
+    bool* across = a->across + c * f->numregs;
+    if(w == u)
+    {
+      for(int v = 0; v < a->numunits; v++)
+      {
+        iralunit_t* x = &a->units[v];
+        if(x != u && x->newfirst != -1 && lux_ir_unit_across(x, across))
+        {
+          int least = x->newfirst + x->count - (base - u->first);
+          *low = least > *low ? least : *low;
+        }
+      }
+    }
+    else if(w->newfirst != -1 && lux_ir_unit_across(u, across))
+    {
+      int most = w->newfirst + base - w->first;
+      *high = most < *high ? most : *high;
+    }
+  }
+}
+
+//-----------------------------------------------
+// Places the units with a linear scan over their
+// intervals, taking the lowest free registers
+// 'order' needs space for two ints per register
+// Returns false if a unit couldn't be placed
+//-----------------------------------------------
+static bool lux_ir_place_units(irfunc_t* f, iralloc_t* a, int* order)
+{
+  // Units by the start of their interval
+  int numorder = 0;
+  for(int v = 0; v < a->numunits; v++)
+  {
+    if(a->units[v].start == -1)
+    {
+      continue;
+    }
+    int k = numorder++;
+    for(; k > 0 && a->units[order[k - 1]].start > a->units[v].start; k--)
+    {
+      order[k] = order[k - 1];
+    }
+    order[k] = v;
+  }
+
+  unsigned int busy[8] = { 0 };
+  int* active = order + a->numunits;
+  int numactive = 0;
+  for(int o = 0; o < numorder; o++)
+  {
+    iralunit_t* u = &a->units[order[o]];
+    for(int k = 0; k < numactive; k++)
+    {
+      iralunit_t* v = &a->units[active[k]];
+      if(v->end < u->start)
+      {
+        for(int r = v->newfirst; r < v->newfirst + v->count; r++)
+        {
+          busy[r / 32] &= ~(1u << (r % 32));
+        }
+        active[k--] = active[--numactive];
+      }
+    }
+
+    if(!u->fixed)
+    {
+      // r0 and the arguments keep their registers while they're live
+      unsigned int blocked[8];
+      memcpy(blocked, busy, sizeof(busy));
+      for(int r = 0; r <= f->closure->numargs; r++)
+      {
+        iralunit_t* x = &a->units[r];
+        if(x->start != -1 && x->start <= u->end && u->start <= x->end)
+        {
+          blocked[r / 32] |= 1u << (r % 32);
+        }
+      }
+
+      int low = 0;
+      int high = 256;
+      lux_ir_call_bounds(f, a, u, &low, &high);
+      for(int p = lux_register_set_first_free(blocked, low); p != -1 && p + u->count <= high; p = lux_register_set_first_free(blocked, p + 1))
+      {
+        int k = 1;
+        for(; k < u->count && !(blocked[(p + k) / 32] & (1u << ((p + k) % 32))); k++) {}
+        if(k == u->count)
+        {
+          u->newfirst = p;
+          break;
+        }
+      }
+      if(u->newfirst == -1)
+      {
+        return false;
+      }
+    }
+
+    for(int r = u->newfirst; r < u->newfirst + u->count; r++)
+    {
+      busy[r / 32] |= 1u << (r % 32);
+    }
+    active[numactive++] = order[o];
+  }
+
+  return true;
+}
+
+//-----------------------------------------------
+// Renumbers the registers so values that are
+// never live at the same time share one, which
+// shrinks the frame the closure needs
+// 'live' needs space for a set of registers per
+// block plus one
+// Returns the number of registers the frame
+// needs, unchanged if they were left as is
+//-----------------------------------------------
+static int lux_ir_allocate_registers(irfunc_t* f, bool* live)
+{
+  int numregs = f->numregs;
+  int numcalls = 0;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    numcalls += !f->insts[i].dead && (f->insts[i].op == OP_CALL || f->insts[i].op == OP_TCALL);
+  }
+
+  iralloc_t a;
+  int* ints = xalloc(f->vm, sizeof(int) * (numregs * 5 + numcalls + 1));
+  a.units = xalloc(f->vm, sizeof(iralunit_t) * numregs);
+  a.across = xalloc(f->vm, sizeof(bool) * (numcalls * numregs + 1));
+  bool placed = false;
+  if(ints != NULL && a.units != NULL && a.across != NULL)
+  {
+    a.start = ints;
+    a.end = a.start + numregs;
+    a.unitof = a.end + numregs;
+    a.calls = a.unitof + numregs;
+    int* order = a.calls + numcalls + 1;
+    if(lux_ir_build_intervals(f, live, &a))
+    {
+      lux_ir_build_units(f, &a, (bool*)order);
+      placed = lux_ir_place_units(f, &a, order);
+    }
+  }
+
+  // Only worth it if the frame gets smaller
+  int newnumregs = f->closure->numargs + 1;
+  for(int v = 0; placed && v < a.numunits; v++)
+  {
+    iralunit_t* u = &a.units[v];
+    if(u->start != -1 && u->newfirst + u->count > newnumregs)
+    {
+      newnumregs = u->newfirst + u->count;
+    }
+  }
+  placed = placed && newnumregs < f->closure->numregs;
+
+  for(int i = 0; placed && i < f->numinsts; i++)
+  {
+    unsigned char* regs[3];
+    int numregsused = f->insts[i].dead ? 0 : lux_ir_registers(&f->insts[i], regs);
+    for(int k = 0; k < numregsused; k++)
+    {
+      iralunit_t* u = &a.units[a.unitof[*regs[k]]];
+      *regs[k] = u->newfirst + *regs[k] - u->first;
+    }
+  }
+
+  xfree(f->vm, a.across);
+  xfree(f->vm, a.units);
+  xfree(f->vm, ints);
+  return placed ? newnumregs : f->closure->numregs;
+}
+
+//-----------------------------------------------
+// Encodes the live instructions back into the
+// closure stream
+// Returns false if they don't fit
+//-----------------------------------------------
+static bool lux_ir_lower(irfunc_t* f)
+{
+  int used = 0;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    f->insts[i].newoffset = used;
+    if(!f->insts[i].dead)
+    {
+      used += lux_opcode_size(f->insts[i].op);
+    }
+  }
+  if(used > f->closure->allocated)
+  {
+    // Folded literals can take more space than what they replace
+    unsigned char* grown = xrealloc(f->vm, f->closure->code, used);
+    if(grown == NULL)
+    {
+      return false;
+    }
+    f->closure->code = grown;
+    f->closure->allocated = used;
+  }
+
+  // Every instruction is written from its decoded form so this can be
+  // done in place
+  unsigned char* code = f->closure->code;
+  for(int i = 0; i < f->numinsts; i++)
+  {
+    irinst_t* inst = &f->insts[i];
+    if(inst->dead)
+    {
+      continue;
+    }
+
+    unsigned char* c = code + inst->newoffset;
+    int target = inst->target != -1 ? f->insts[inst->target].newoffset : 0;
+    c[0] = inst->op;
+    switch(lux_opcode_format(inst->op))
+    {
+      case OF_LDI:
+      case OF_CALL:
+      case OF_RK:
+        c[1] = inst->r[0];
+        *(int*)(c + 2) = inst->value;
+        break;
+      case OF_RR:
+        c[1] = inst->r[0];
+        c[2] = inst->r[1];
+        break;
+      case OF_RRR:
+      case OF_SEL:
+        c[1] = inst->r[0];
+        c[2] = inst->r[1];
+        c[3] = inst->r[2];
+        break;
+      case OF_JMP:
+        *(int*)(c + 1) = target;
+        break;
+      case OF_BR:
+        c[1] = inst->r[0];
+        *(int*)(c + 2) = target;
+        break;
+      case OF_BRR:
+        c[1] = inst->r[0];
+        c[2] = inst->r[1];
+        *(int*)(c + 3) = target;
+        break;
+      case OF_RKR:
+        c[1] = inst->r[0];
+        *(int*)(c + 2) = inst->value;
+        c[6] = inst->r[1];
+        break;
+      case OF_RKKR:
+        c[1] = inst->r[0];
+        *(int*)(c + 2) = inst->value;
+        *(int*)(c + 6) = inst->magic;
+        c[10] = inst->r[1];
+        break;
+      case OF_TABLE:
+        c[1] = inst->r[0];
+        *(int*)(c + 2) = inst->value;
+        *(int*)(c + 6) = inst->magic;
+        break;
+      case OF_BRK:
+        c[1] = inst->r[0];
+        *(int*)(c + 2) = inst->value;
+        *(int*)(c + 6) = target;
+        break;
+      case OF_FOR:
+        c[1] = inst->r[0];
+        c[2] = inst->r[1];
+        *(int*)(c + 3) = inst->value;
+        *(int*)(c + 7) = target;
+        break;
+    }
+  }
+
+  f->closure->used = used;
+  return true;
+}
+
+//-----------------------------------------------
+// Frees everything the middle-end allocated
+//-----------------------------------------------
+static void lux_ir_free(irfunc_t* f, void* scratch)
+{
+  xfree(f->vm, scratch);
+  xfree(f->vm, f->vn);
+  xfree(f->vm, f->out);
+  xfree(f->vm, f->in);
+  xfree(f->vm, f->order);
+  xfree(f->vm, f->preds);
+  xfree(f->vm, f->predstart);
+  xfree(f->vm, f->blocks);
+  xfree(f->vm, f->insts);
+}
+
+//-----------------------------------------------
+// Optimizes the bytecode of a finished closure
+// The closure is left untouched if there isn't
+// enough memory
+//-----------------------------------------------
+void lux_optimizer_closure(vm_t* vm, closure_t* closure)
+{
+  if(closure->native || closure->used == 0)
+  {
+    return;
+  }
+
+  irfunc_t f;
+  memset(&f, 0, sizeof(irfunc_t));
+  f.vm = vm;
+  f.closure = closure;
+  f.numregs = closure->numregs;
+  for(int offset = 0; offset < closure->used; offset += lux_opcode_size(closure->code[offset]))
+  {
+    f.numinsts++;
+  }
+  f.numinsts++; // Return added at the end
+
+  // Scratch space shared by the passes, big enough for any of them
+  // Hoisting adds at most a copy per instruction and a block per loop
+  int scratchsize = closure->used + 1;
+  scratchsize = scratchsize > f.numinsts * 4 ? scratchsize : f.numinsts * 4;
+  scratchsize = scratchsize > f.numregs ? scratchsize : f.numregs;
+  scratchsize = scratchsize > closure->numslots ? scratchsize : closure->numslots;
+  int* scratch = xalloc(vm, sizeof(int) * scratchsize);
+  f.insts = xalloc(vm, sizeof(irinst_t) * f.numinsts);
+  if(scratch == NULL || f.insts == NULL || !lux_ir_decode(&f, scratch) ||
+     !lux_ir_build_blocks(&f, scratch) || !lux_ir_build_dominators(&f, scratch))
+  {
+    lux_ir_free(&f, scratch);
+    return;
+  }
+
+  lux_ir_forward_spills(&f, scratch);
+
+  f.numvalues = f.numregs + f.numinsts + f.numblocks * f.numregs;
+  f.in = xalloc(vm, sizeof(int) * f.numblocks * f.numregs);
+  f.out = xalloc(vm, sizeof(int) * f.numblocks * f.numregs);
+  f.vn = xalloc(vm, sizeof(int) * f.numvalues);
+  if(f.in == NULL || f.out == NULL || f.vn == NULL)
+  {
+    lux_ir_free(&f, scratch);
+    return;
+  }
+
+  // Folding branches only ever drops blocks so the value space holds
+  lux_ir_build_ssa(&f, scratch);
+  for(int round = 0; round < 4 && lux_ir_fold_constants(&f, scratch); round++)
+  {
+    if(!lux_ir_rebuild_blocks(&f, scratch))
+    {
+      lux_ir_free(&f, scratch);
+      return;
+    }
+    lux_ir_build_ssa(&f, scratch);
+  }
+  if(!lux_ir_number_values(&f, scratch))
+  {
+    lux_ir_free(&f, scratch);
+    return;
+  }
+  lux_ir_rewrite(&f, scratch);
+
+  // Liveness sets reuse the value numbers, they're no longer needed
+  xfree(vm, f.vn);
+  f.vn = xalloc(vm, sizeof(bool) * (f.numblocks + 1) * f.numregs);
+  if(f.vn == NULL)
+  {
+    lux_ir_free(&f, scratch);
+    return;
+  }
+  for(int round = 0; round < 8 && lux_ir_eliminate_dead_code(&f, (bool*)f.vn); round++) {}
+
+  // Loop invariant code motion works on the rewritten code
+  lux_ir_build_ssa(&f, scratch);
+  lux_ir_build_liveness(&f, (bool*)f.vn);
+  if(lux_ir_hoist_invariants(&f, (bool*)f.vn, scratch))
+  {
+    // Code hoisted past a branch into the header gets a block of its own
+    xfree(vm, f.vn);
+    f.vn = NULL;
+    if(!lux_ir_move_hoisted(&f, scratch) ||
+       (f.vn = xalloc(vm, sizeof(bool) * (f.numblocks + 1) * f.numregs)) == NULL)
+    {
+      lux_ir_free(&f, scratch);
+      return;
+    }
+    // Copies of hoisted results nobody reads anymore
+    for(int round = 0; round < 8 && lux_ir_eliminate_dead_code(&f, (bool*)f.vn); round++) {}
+  }
+  lux_ir_build_liveness(&f, (bool*)f.vn);
+  int numregs = lux_ir_allocate_registers(&f, (bool*)f.vn);
+
+  if(lux_ir_lower(&f))
+  {
+    closure->numregs = numregs;
+  }
+  lux_ir_free(&f, scratch);
+}
@@ -0,0 +1,803 @@
+#include "private.h"
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+static const unsigned char formatsize[] = {1, 6, 6, 3, 4, 5, 6, 7, 7, 10, 6, 11, 11, 4, 10};
+
+//-----------------------------------------------
+// Returns the operand layout of an opcode
+//-----------------------------------------------
+int lux_opcode_format(unsigned char op)
+{
+  switch(op)
+  {
+    case OP_NOP:
+    case OP_RET:
+      return OF_NONE;
+    case OP_LDI:
+    case OP_RELOAD:
+      return OF_LDI;
+    case OP_SPILL:
+      return OF_RK;
+    case OP_CALL:
+    case OP_TCALL:
+      return OF_CALL;
+    case OP_MOV:
+    case OP_ITOF:
+    case OP_FTOI:
+    case OP_LNOT:
+    case OP_BNOT:
+    case OP_NEGI:
+    case OP_NEGF:
+    case OP_SQRTF:
+    case OP_ABSI:
+    case OP_ABSF:
+    case OP_FLOORF:
+    case OP_CLZ:
+    case OP_POPCNT:
+      return OF_RR;
+    case OP_JMP:
+    case OP_CASE:
+      return OF_JMP;
+    case OP_BEQZ:
+    case OP_BNEZ:
+      return OF_BR;
+    case OP_DIVI_P:
+    case OP_MOD_P:
+      return OF_RKR;
+    case OP_DIVI_M:
+    case OP_MOD_M:
+      return OF_RKKR;
+    case OP_MINI:
+    case OP_MAXI:
+    case OP_MINF:
+    case OP_MAXF:
+      return OF_RRR;
+    case OP_SEL:
+    case OP_FMAF:
+      return OF_SEL;
+    case OP_JTAB:
+      return OF_TABLE;
+  }
+
+  if(op >= OP_ADDI && op <= OP_RSFT)
+  {
+    return OF_RRR;
+  }
+  else if(op >= OP_BEQI && op <= OP_BNMTEF)
+  {
+    return OF_BRR;
+  }
+  else if(op >= OP_ADDI_K && op <= OP_RSFT_K)
+  {
+    return OF_RKR;
+  }
+  else if(op >= OP_BEQI_K && op <= OP_BMTEI_K)
+  {
+    return OF_BRK;
+  }
+  else if(op >= OP_FORLT && op <= OP_FORMTE)
+  {
+    return OF_FOR;
+  }
+
+  return OF_NONE;
+}
+
+//-----------------------------------------------
+// Returns the size in bytes of an instruction
+//-----------------------------------------------
+int lux_opcode_size(unsigned char op)
+{
+  return formatsize[lux_opcode_format(op)];
+}
+
+//-----------------------------------------------
+// Returns the position of the jump offset inside
+// an instruction, 0 if it doesn't jump
+//-----------------------------------------------
+int lux_opcode_target(unsigned char op)
+{
+  switch(lux_opcode_format(op))
+  {
+    case OF_JMP: return 1;
+    case OF_BR: return 2;
+    case OF_BRR: return 3;
+    case OF_BRK: return 6;
+    case OF_FOR: return 7;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------
+// Returns the position of the register an
+// instruction writes its result to, 0 if it
+// doesn't write one that could be redirected
+//-----------------------------------------------
+int lux_opcode_result(unsigned char op)
+{
+  switch(lux_opcode_format(op))
+  {
+    case OF_LDI: return 1;
+    case OF_RR: return 2;
+    case OF_RRR: return 3;
+    case OF_RKR: return 6;
+    case OF_RKKR: return 10;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------
+// Fills 'positions' with the position of every
+// register operand inside an instruction
+// Returns how many there are
+//-----------------------------------------------
+int lux_opcode_registers(unsigned char op, int* positions)
+{
+  switch(lux_opcode_format(op))
+  {
+    case OF_LDI:
+    case OF_CALL:
+    case OF_BR:
+    case OF_BRK:
+    case OF_RK:
+    case OF_TABLE:
+      positions[0] = 1;
+      return 1;
+    case OF_RR:
+    case OF_BRR:
+    case OF_FOR:
+      positions[0] = 1;
+      positions[1] = 2;
+      return 2;
+    case OF_RRR:
+    case OF_SEL:
+      positions[0] = 1;
+      positions[1] = 2;
+      positions[2] = 3;
+      return 3;
+    case OF_RKR:
+      positions[0] = 1;
+      positions[1] = 6;
+      return 2;
+    case OF_RKKR:
+      positions[0] = 1;
+      positions[1] = 10;
+      return 2;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------
+// Returns the register-immediate form of a
+// register-register opcode
+// Returns OP_NOP if there is none
+//-----------------------------------------------
+unsigned char lux_opcode_immediate(unsigned char op)
+{
+  switch(op)
+  {
+    case OP_ADDI: return OP_ADDI_K;
+    case OP_SUBI: return OP_SUBI_K;
+    case OP_MULI: return OP_MULI_K;
+    case OP_DIVI: return OP_DIVI_K;
+    case OP_MOD: return OP_MOD_K;
+    case OP_ADDF: return OP_ADDF_K;
+    case OP_SUBF: return OP_SUBF_K;
+    case OP_MULF: return OP_MULF_K;
+    case OP_DIVF: return OP_DIVF_K;
+    case OP_EQI: return OP_EQI_K;
+    case OP_NEQI: return OP_NEQI_K;
+    case OP_EQF: return OP_EQF_K;
+    case OP_NEQF: return OP_NEQF_K;
+    case OP_LTI: return OP_LTI_K;
+    case OP_LTEI: return OP_LTEI_K;
+    case OP_MTI: return OP_MTI_K;
+    case OP_MTEI: return OP_MTEI_K;
+    case OP_LTF: return OP_LTF_K;
+    case OP_LTEF: return OP_LTEF_K;
+    case OP_MTF: return OP_MTF_K;
+    case OP_MTEF: return OP_MTEF_K;
+    case OP_BAND: return OP_BAND_K;
+    case OP_BXOR: return OP_BXOR_K;
+    case OP_BOR: return OP_BOR_K;
+    case OP_LSFT: return OP_LSFT_K;
+    case OP_RSFT: return OP_RSFT_K;
+  }
+
+  return OP_NOP;
+}
+
+//-----------------------------------------------
+// Evaluates an opcode computing a result on
+// literals at compile time, 'r' holds the
+// immediate value of register-immediate ones
+// and is ignored by ones with a single operand
+// Returns false if it can't be folded, like a
+// division by zero which has to fail at runtime
+//-----------------------------------------------
+bool lux_opcode_fold(unsigned char op, vmregister_t l, vmregister_t r, vmregister_t* res)
+{
+  // Int arithmetic wraps like it does at runtime
+  switch(op)
+  {
+    case OP_MOV: *res = l; return true;
+    case OP_NEGI: res->ivalue = (int)(0u - (unsigned int)l.ivalue); return true;
+    case OP_NEGF: res->fvalue = -l.fvalue; return true;
+    case OP_LNOT: res->ivalue = !l.ivalue; return true;
+    case OP_BNOT: res->ivalue = ~l.ivalue; return true;
+    case OP_ITOF: res->fvalue = (float)l.ivalue; return true;
+    case OP_SQRTF: res->fvalue = sqrtf(l.fvalue); return true;
+    case OP_ABSI: res->ivalue = l.ivalue < 0 ? (int)(0u - (unsigned int)l.ivalue) : l.ivalue; return true;
+    case OP_ABSF: res->fvalue = fabsf(l.fvalue); return true;
+    case OP_FLOORF: res->fvalue = floorf(l.fvalue); return true;
+    case OP_CLZ: res->ivalue = lux_count_leading_zeros((unsigned int)l.ivalue); return true;
+    case OP_POPCNT: res->ivalue = lux_count_bits((unsigned int)l.ivalue); return true;
+    case OP_FTOI:
+    {
+      if(!(l.fvalue > -2147483649.0f && l.fvalue < 2147483648.0f))
+      {
+        return false;
+      }
+      res->ivalue = (int)l.fvalue;
+      return true;
+    }
+    case OP_ADDI_K: return lux_opcode_fold(OP_ADDI, l, r, res);
+    case OP_SUBI_K: return lux_opcode_fold(OP_SUBI, l, r, res);
+    case OP_MULI_K: return lux_opcode_fold(OP_MULI, l, r, res);
+    case OP_DIVI_K:
+    case OP_DIVI_M: return lux_opcode_fold(OP_DIVI, l, r, res);
+    case OP_MOD_K:
+    case OP_MOD_M: return lux_opcode_fold(OP_MOD, l, r, res);
+    case OP_ADDF_K: return lux_opcode_fold(OP_ADDF, l, r, res);
+    case OP_SUBF_K: return lux_opcode_fold(OP_SUBF, l, r, res);
+    case OP_MULF_K: return lux_opcode_fold(OP_MULF, l, r, res);
+    case OP_DIVF_K: return lux_opcode_fold(OP_DIVF, l, r, res);
+    case OP_EQI_K: return lux_opcode_fold(OP_EQI, l, r, res);
+    case OP_NEQI_K: return lux_opcode_fold(OP_NEQI, l, r, res);
+    case OP_EQF_K: return lux_opcode_fold(OP_EQF, l, r, res);
+    case OP_NEQF_K: return lux_opcode_fold(OP_NEQF, l, r, res);
+    case OP_LTI_K: return lux_opcode_fold(OP_LTI, l, r, res);
+    case OP_LTEI_K: return lux_opcode_fold(OP_LTEI, l, r, res);
+    case OP_MTI_K: return lux_opcode_fold(OP_MTI, l, r, res);
+    case OP_MTEI_K: return lux_opcode_fold(OP_MTEI, l, r, res);
+    case OP_LTF_K: return lux_opcode_fold(OP_LTF, l, r, res);
+    case OP_LTEF_K: return lux_opcode_fold(OP_LTEF, l, r, res);
+    case OP_MTF_K: return lux_opcode_fold(OP_MTF, l, r, res);
+    case OP_MTEF_K: return lux_opcode_fold(OP_MTEF, l, r, res);
+    case OP_BAND_K: return lux_opcode_fold(OP_BAND, l, r, res);
+    case OP_BXOR_K: return lux_opcode_fold(OP_BXOR, l, r, res);
+    case OP_BOR_K: return lux_opcode_fold(OP_BOR, l, r, res);
+    case OP_LSFT_K: return lux_opcode_fold(OP_LSFT, l, r, res);
+    case OP_RSFT_K: return lux_opcode_fold(OP_RSFT, l, r, res);
+    case OP_DIVI_P:
+    case OP_MOD_P:
+    {
+      // Powers of 2 hold the exponent and the mask
+      vmregister_t d;
+      d.ivalue = op == OP_DIVI_P ? 1 << r.ivalue : r.ivalue + 1;
+      return lux_opcode_fold(op == OP_DIVI_P ? OP_DIVI : OP_MOD, l, d, res);
+    }
+    case OP_ADDI: res->ivalue = (int)((unsigned int)l.ivalue + (unsigned int)r.ivalue); return true;
+    case OP_SUBI: res->ivalue = (int)((unsigned int)l.ivalue - (unsigned int)r.ivalue); return true;
+    case OP_MULI: res->ivalue = (int)((unsigned int)l.ivalue * (unsigned int)r.ivalue); return true;
+    case OP_DIVI:
+    case OP_MOD:
+    {
+      if(r.ivalue == 0 || (l.ivalue == INT_MIN && r.ivalue == -1))
+      {
+        return false;
+      }
+      res->ivalue = op == OP_DIVI ? l.ivalue / r.ivalue : l.ivalue % r.ivalue;
+      return true;
+    }
+    case OP_ADDF: res->fvalue = l.fvalue + r.fvalue; return true;
+    case OP_SUBF: res->fvalue = l.fvalue - r.fvalue; return true;
+    case OP_MULF: res->fvalue = l.fvalue * r.fvalue; return true;
+    case OP_DIVF:
+    {
+      if(r.fvalue == 0.0f)
+      {
+        return false;
+      }
+      res->fvalue = l.fvalue / r.fvalue;
+      return true;
+    }
+    case OP_EQI: res->ivalue = l.ivalue == r.ivalue; return true;
+    case OP_NEQI: res->ivalue = l.ivalue != r.ivalue; return true;
+    case OP_EQF: res->ivalue = l.fvalue == r.fvalue; return true;
+    case OP_NEQF: res->ivalue = l.fvalue != r.fvalue; return true;
+    case OP_LTI: res->ivalue = l.ivalue < r.ivalue; return true;
+    case OP_LTEI: res->ivalue = l.ivalue <= r.ivalue; return true;
+    case OP_MTI: res->ivalue = l.ivalue > r.ivalue; return true;
+    case OP_MTEI: res->ivalue = l.ivalue >= r.ivalue; return true;
+    case OP_LTF: res->ivalue = l.fvalue < r.fvalue; return true;
+    case OP_LTEF: res->ivalue = l.fvalue <= r.fvalue; return true;
+    case OP_MTF: res->ivalue = l.fvalue > r.fvalue; return true;
+    case OP_MTEF: res->ivalue = l.fvalue >= r.fvalue; return true;
+    case OP_MINI: res->ivalue = l.ivalue < r.ivalue ? l.ivalue : r.ivalue; return true;
+    case OP_MAXI: res->ivalue = l.ivalue > r.ivalue ? l.ivalue : r.ivalue; return true;
+    case OP_MINF: res->fvalue = l.fvalue < r.fvalue ? l.fvalue : r.fvalue; return true;
+    case OP_MAXF: res->fvalue = l.fvalue > r.fvalue ? l.fvalue : r.fvalue; return true;
+    case OP_LAND: res->ivalue = l.ivalue && r.ivalue; return true;
+    case OP_LOR: res->ivalue = l.ivalue || r.ivalue; return true;
+    case OP_BAND: res->ivalue = l.ivalue & r.ivalue; return true;
+    case OP_BXOR: res->ivalue = l.ivalue ^ r.ivalue; return true;
+    case OP_BOR: res->ivalue = l.ivalue | r.ivalue; return true;
+    case OP_LSFT:
+    case OP_RSFT:
+    {
+      if(r.ivalue < 0 || r.ivalue > 31)
+      {
+        return false;
+      }
+      res->ivalue = op == OP_LSFT ? (int)((unsigned int)l.ivalue << r.ivalue) : l.ivalue >> r.ivalue;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//-----------------------------------------------
+// Decides a conditional branch on literals at
+// compile time, 'r' holds the immediate value of
+// register-immediate ones
+// Returns false if it isn't a conditional branch
+//-----------------------------------------------
+bool lux_opcode_fold_branch(unsigned char op, vmregister_t l, vmregister_t r, bool* taken)
+{
+  unsigned char cmp;
+  bool negate = false;
+  switch(op)
+  {
+    case OP_BEQZ: *taken = l.ivalue == 0; return true;
+    case OP_BNEZ: *taken = l.ivalue != 0; return true;
+    case OP_BEQI:
+    case OP_BEQI_K: cmp = OP_EQI; break;
+    case OP_BNEQI:
+    case OP_BNEQI_K: cmp = OP_NEQI; break;
+    case OP_BLTI:
+    case OP_BLTI_K: cmp = OP_LTI; break;
+    case OP_BLTEI:
+    case OP_BLTEI_K: cmp = OP_LTEI; break;
+    case OP_BMTI:
+    case OP_BMTI_K: cmp = OP_MTI; break;
+    case OP_BMTEI:
+    case OP_BMTEI_K: cmp = OP_MTEI; break;
+    case OP_BEQF: cmp = OP_EQF; break;
+    case OP_BNEQF: cmp = OP_NEQF; break;
+    case OP_BLTF: cmp = OP_LTF; break;
+    case OP_BLTEF: cmp = OP_LTEF; break;
+    case OP_BMTF: cmp = OP_MTF; break;
+    case OP_BMTEF: cmp = OP_MTEF; break;
+    // Unordered floats take these
+    case OP_BNLTF: cmp = OP_LTF; negate = true; break;
+    case OP_BNLTEF: cmp = OP_LTEF; negate = true; break;
+    case OP_BNMTF: cmp = OP_MTF; negate = true; break;
+    case OP_BNMTEF: cmp = OP_MTEF; negate = true; break;
+    default: return false;
+  }
+
+  vmregister_t res;
+  (void)lux_opcode_fold(cmp, l, r, &res);
+  *taken = (res.ivalue != 0) != negate;
+  return true;
+}
+
+typedef struct phinst_s
+{
+  int offset;    // Offset in the original code
+  int newoffset; // Offset in the optimized code
+  int target;    // Index of the instruction it jumps to, -1 if none
+  bool label;    // Something jumps here
+  bool reached;  // Reachable from the entry
+  bool dead;     // Left out of the optimized code
+} phinst_t;
+
+typedef struct phregs_s
+{
+  unsigned int bits[8];
+} phregs_t;
+
+#define REGS_SET(s, r) ((s)->bits[(r) >> 5] |= 1u << ((r) & 31))
+#define REGS_CLEAR(s, r) ((s)->bits[(r) >> 5] &= ~(1u << ((r) & 31)))
+#define REGS_HAS(s, r) (((s)->bits[(r) >> 5] >> ((r) & 31)) & 1)
+
+//-----------------------------------------------
+// Applies an instruction to the set of registers
+// live after it, leaving the set live before it
+//-----------------------------------------------
+static void lux_peephole_transfer(vm_t* vm, unsigned char* code, phregs_t* live)
+{
+  unsigned char op = code[0];
+  switch(lux_opcode_format(op))
+  {
+    case OF_NONE:
+    {
+      if(op == OP_RET)
+      {
+        REGS_SET(live, 0);
+      }
+    }
+    break;
+    case OF_LDI:
+    {
+      REGS_CLEAR(live, code[1]);
+    }
+    break;
+    case OF_CALL:
+    {
+      // The callee's frame starts at the base register
+      closure_t* called = *(int*)(code + 2) < vm->functiontablesize ? vm->functiontable[*(int*)(code + 2)] : NULL;
+      int numargs = called ? called->numargs : 255 - code[1];
+      for(int i = code[1]; i < 256; i++)
+      {
+        REGS_CLEAR(live, i);
+      }
+      for(int i = 1; i <= numargs && code[1] + i < 256; i++)
+      {
+        REGS_SET(live, code[1] + i);
+      }
+    }
+    break;
+    case OF_RR:
+    {
+      REGS_CLEAR(live, code[2]);
+      REGS_SET(live, code[1]);
+    }
+    break;
+    case OF_RRR:
+    {
+      REGS_CLEAR(live, code[3]);
+      REGS_SET(live, code[1]);
+      REGS_SET(live, code[2]);
+    }
+    break;
+    case OF_BR:
+    case OF_BRK:
+    case OF_RK:
+    case OF_TABLE:
+    {
+      REGS_SET(live, code[1]);
+    }
+    break;
+    case OF_BRR:
+    case OF_FOR:
+    {
+      REGS_SET(live, code[1]);
+      REGS_SET(live, code[2]);
+    }
+    break;
+    case OF_RKR:
+    {
+      REGS_CLEAR(live, code[6]);
+      REGS_SET(live, code[1]);
+    }
+    break;
+    case OF_RKKR:
+    {
+      REGS_CLEAR(live, code[10]);
+      REGS_SET(live, code[1]);
+    }
+    break;
+    case OF_SEL:
+    {
+      REGS_SET(live, code[1]);
+      REGS_SET(live, code[2]);
+      REGS_SET(live, code[3]);
+    }
+    break;
+  }
+}
+
+//-----------------------------------------------
+// Returns true if control never falls through
+// to the next instruction
+//-----------------------------------------------
+bool lux_opcode_is_terminator(unsigned char op)
+{
+  return op == OP_JMP || op == OP_RET || op == OP_TCALL;
+}
+
+//-----------------------------------------------
+// Marks the instructions reachable from the
+// entry, dropped ones just fall through
+//-----------------------------------------------
+static void lux_peephole_reach(closure_t* closure, phinst_t* insts, int numinsts, int* worklist)
+{
+  int numwork = 0;
+  worklist[numwork++] = 0;
+  insts[0].reached = true;
+  while(numwork > 0)
+  {
+    int i = worklist[--numwork];
+    if(i == numinsts)
+    {
+      continue;
+    }
+    unsigned char op = closure->code[insts[i].offset];
+    if(!insts[i].dead && insts[i].target != -1 && !insts[insts[i].target].reached)
+    {
+      insts[insts[i].target].reached = true;
+      worklist[numwork++] = insts[i].target;
+    }
+    if((insts[i].dead || !lux_opcode_is_terminator(op)) && i + 1 < numinsts && !insts[i + 1].reached)
+    {
+      insts[i + 1].reached = true;
+      worklist[numwork++] = i + 1;
+    }
+  }
+}
+
+//-----------------------------------------------
+// Returns the first live instruction from 'i' on
+// The last instruction is always a live sentinel
+//-----------------------------------------------
+static int lux_peephole_skip_dead(phinst_t* insts, int i)
+{
+  while(insts[i].dead)
+  {
+    i++;
+  }
+  return i;
+}
+
+//-----------------------------------------------
+// Runs one round of optimizations over the live
+// instructions of a closure
+// Returns true if anything changed
+//-----------------------------------------------
+static bool lux_peephole_round(vm_t* vm, closure_t* closure, phinst_t* insts, int numinsts, int* worklist, phregs_t* livein)
+{
+  bool changed = false;
+  unsigned char* code = closure->code;
+
+  // Thread jumps to jumps and drop jumps to the next instruction
+  for(int i = 0; i < numinsts; i++)
+  {
+    if(insts[i].dead || insts[i].target == -1)
+    {
+      continue;
+    }
+
+    int t = lux_peephole_skip_dead(insts, insts[i].target);
+    for(int hops = 0; hops < 16 && t < numinsts && code[insts[t].offset] == OP_JMP && !insts[t].dead && t != i && insts[t].target != t; hops++)
+    {
+      t = lux_peephole_skip_dead(insts, insts[t].target);
+    }
+    if(t != insts[i].target)
+    {
+      insts[i].target = t;
+      changed = true;
+    }
+
+    // Jump table entries have to stay where they are
+    if(insts[i].target == lux_peephole_skip_dead(insts, i + 1) && code[insts[i].offset] != OP_CASE)
+    {
+      insts[i].dead = true;
+      changed = true;
+    }
+  }
+
+  // A jump threaded to an instruction dropped later in the loop above has
+  // to land past it, liveness never looks at dead instructions
+  for(int i = 0; i < numinsts; i++)
+  {
+    if(!insts[i].dead && insts[i].target != -1)
+    {
+      insts[i].target = lux_peephole_skip_dead(insts, insts[i].target);
+    }
+  }
+
+  // Drop unreachable code
+  for(int i = 0; i < numinsts; i++)
+  {
+    insts[i].reached = false;
+    insts[i].label = false;
+  }
+  lux_peephole_reach(closure, insts, numinsts, worklist);
+  for(int i = 0; i < numinsts; i++)
+  {
+    if(!insts[i].reached && !insts[i].dead)
+    {
+      insts[i].dead = true;
+      changed = true;
+    }
+    if(!insts[i].dead && insts[i].target != -1)
+    {
+      insts[insts[i].target].label = true;
+    }
+  }
+
+  // Registers live at the start of every instruction
+  bool iterate = true;
+  memset(livein, 0, sizeof(phregs_t) * numinsts);
+  while(iterate)
+  {
+    iterate = false;
+    phregs_t live;
+    memset(&live, 0, sizeof(phregs_t));
+    for(int i = numinsts - 1; i >= 0; i--)
+    {
+      if(insts[i].dead)
+      {
+        continue;
+      }
+
+      unsigned char op = code[insts[i].offset];
+      if(lux_opcode_is_terminator(op))
+      {
+        memset(&live, 0, sizeof(phregs_t));
+      }
+      if(insts[i].target != -1)
+      {
+        for(int w = 0; w < 8; w++)
+        {
+          live.bits[w] |= livein[insts[i].target].bits[w];
+        }
+      }
+      lux_peephole_transfer(vm, code + insts[i].offset, &live);
+      if(memcmp(&live, &livein[i], sizeof(phregs_t)))
+      {
+        livein[i] = live;
+        iterate = true;
+      }
+    }
+  }
+
+  // Write results straight into the register they get moved to and drop
+  // results nobody reads
+  phregs_t live, nextout;
+  memset(&live, 0, sizeof(phregs_t));
+  int next = -1;
+  for(int i = numinsts - 1; i >= 0; i--)
+  {
+    if(insts[i].dead)
+    {
+      continue;
+    }
+
+    unsigned char* inst = code + insts[i].offset;
+    if(lux_opcode_is_terminator(inst[0]))
+    {
+      memset(&live, 0, sizeof(phregs_t));
+    }
+    if(insts[i].target != -1)
+    {
+      for(int w = 0; w < 8; w++)
+      {
+        live.bits[w] |= livein[insts[i].target].bits[w];
+      }
+    }
+
+    int result = lux_opcode_result(inst[0]);
+    if((inst[0] == OP_MOV && inst[1] == inst[2]) || (result && !REGS_HAS(&live, inst[result])))
+    {
+      // Jumps here now land on the next instruction
+      if(insts[i].label && next != -1)
+      {
+        insts[next].label = true;
+      }
+      insts[i].dead = true;
+      changed = true;
+      continue;
+    }
+    else if(result && next != -1 && !insts[next].label)
+    {
+      // The next instruction only moves our result somewhere else
+      unsigned char* mov = code + insts[next].offset;
+      if(mov[0] == OP_MOV && mov[1] == inst[result] && !REGS_HAS(&nextout, mov[1]))
+      {
+        inst[result] = mov[2];
+        insts[next].dead = true;
+        live = nextout;
+        changed = true;
+      }
+    }
+
+    nextout = live;
+    lux_peephole_transfer(vm, inst, &live);
+    next = i;
+  }
+
+  return changed;
+}
+
+//-----------------------------------------------
+// Optimizes the bytecode of a finished closure
+// Runs in place, the closure is left untouched
+// if there isn't enough memory
+//-----------------------------------------------
+void lux_peephole_closure(vm_t* vm, closure_t* closure)
+{
+  if(closure->native || closure->used == 0)
+  {
+    return;
+  }
+
+  // Split into instructions
+  int numinsts = 0;
+  for(int offset = 0; offset < closure->used; offset += lux_opcode_size(closure->code[offset]))
+  {
+    numinsts++;
+  }
+
+  // One extra sentinel for jumps to the end
+  phinst_t* insts = xalloc(vm, sizeof(phinst_t) * (numinsts + 1));
+  int* index = xalloc(vm, sizeof(int) * (closure->used + 1));
+  phregs_t* livein = xalloc(vm, sizeof(phregs_t) * (numinsts + 1));
+  if(insts == NULL || index == NULL || livein == NULL)
+  {
+    xfree(vm, livein);
+    xfree(vm, index);
+    xfree(vm, insts);
+    return;
+  }
+
+  for(int i = 0, offset = 0; i < numinsts; offset += lux_opcode_size(closure->code[offset]), i++)
+  {
+    insts[i].offset = offset;
+    insts[i].dead = false;
+    index[offset] = i;
+  }
+  index[closure->used] = numinsts;
+  insts[numinsts].offset = closure->used;
+  insts[numinsts].target = -1;
+  insts[numinsts].dead = false;
+  memset(&livein[numinsts], 0, sizeof(phregs_t));
+
+  for(int i = 0; i < numinsts; i++)
+  {
+    int target = lux_opcode_target(closure->code[insts[i].offset]);
+    insts[i].target = target ? index[*(int*)(closure->code + insts[i].offset + target)] : -1;
+  }
+
+  // The offset map doubles as the worklist
+  for(int round = 0; round < 8 && lux_peephole_round(vm, closure, insts, numinsts, index, livein); round++) {}
+
+  // Offsets dropped instructions map to
+  int used = 0;
+  for(int i = 0; i < numinsts; i++)
+  {
+    insts[i].newoffset = used;
+    if(!insts[i].dead)
+    {
+      used += lux_opcode_size(closure->code[insts[i].offset]);
+    }
+  }
+
+  // Pack the live instructions
+  int removed = 0;
+  unsigned char* code = closure->code;
+  for(int i = 0; i < numinsts; i++)
+  {
+    if(insts[i].dead)
+    {
+      removed++;
+      continue;
+    }
+
+    unsigned char op = code[insts[i].offset];
+    int size = lux_opcode_size(op);
+    memmove(code + insts[i].newoffset, code + insts[i].offset, size);
+    int target = lux_opcode_target(op);
+    if(target)
+    {
+      *(int*)(code + insts[i].newoffset + target) = insts[i].target < numinsts ? insts[insts[i].target].newoffset : used;
+    }
+  }
+
+  vm->peepholebytes += closure->used - used;
+  vm->peepholeinstructions += removed;
+  closure->used = used;
+
+  xfree(vm, livein);
+  xfree(vm, index);
+  xfree(vm, insts);
+}
@@ -8,6 +8,111 @@
 #define TRY(exp) if(!exp) {return false;}
 #define TRYMEM(exp) if(!exp) {lux_vm_set_error(comp->vm, "Compiler ran out of memory"); return false;}
 
+// Number of registers the vm owned register stack every frame is carved
+// from starts out with, it grows as calls need more
+#ifndef LUX_STACK_SIZE
+  #define LUX_STACK_SIZE 256
+#endif
+
+// Default number of registers the stack can grow to, can be changed at
+// runtime with lux_vm_set_max_stack_size
+#ifndef LUX_MAX_STACK_SIZE
+  #define LUX_MAX_STACK_SIZE (1024 * 1024)
+#endif
+
+// Most arguments a function can take
+#ifndef LUX_MAX_ARGS
+  #define LUX_MAX_ARGS 32
+#endif
+
+// Most local variables a function can have in scope at once, the ones that
+// don't fit in registers are spilled to the frame's spill slots
+#ifndef LUX_MAX_LOCALS
+  #define LUX_MAX_LOCALS 1024
+#endif
+
+// Variables only get registers below this one so temporaries and call
+// windows always have room
+#ifndef LUX_VARIABLE_REGISTERS
+  #define LUX_VARIABLE_REGISTERS 192
+#endif
+
+// Script functions with at most this many bytes of code are inlined at
+// their call sites, 0 turns inlining off
+#ifndef LUX_INLINE_SIZE
+  #define LUX_INLINE_SIZE 64
+#endif
+
+// Most bytes of code inlined into a single function
+#ifndef LUX_INLINE_BUDGET
+  #define LUX_INLINE_BUDGET 2048
+#endif
+
+// Most instructions a pure function called with literal arguments may
+// run when it's evaluated at compile time
+#ifndef LUX_EVAL_STEPS
+  #define LUX_EVAL_STEPS 1000000
+#endif
+
+// Counted for loops with a literal start and limit running at most this
+// many times are fully unrolled
+#ifndef LUX_UNROLL_FULL
+  #define LUX_UNROLL_FULL 8
+#endif
+
+// Copies of the body longer counted loops with a known trip count are
+// unrolled into, 1 turns partial unrolling off
+#ifndef LUX_UNROLL_FACTOR
+  #define LUX_UNROLL_FACTOR 4
+#endif
+
+// Most tokens the body of a loop times its number of copies can have
+// for it to be unrolled
+#ifndef LUX_UNROLL_TOKENS
+  #define LUX_UNROLL_TOKENS 256
+#endif
+
+// Ternaries and if/else assignments whose values have at most this many
+// tokens each compute both and pick one with a select instead of branching
+#ifndef LUX_SELECT_TOKENS
+  #define LUX_SELECT_TOKENS 16
+#endif
+
+// Most case values a single switch can have
+#ifndef LUX_MAX_CASES
+  #define LUX_MAX_CASES 256
+#endif
+
+// Switches with at least LUX_SWITCH_TABLE cases whose values span at most
+// LUX_SWITCH_DENSITY times as many entries as there are cases dispatch
+// through a jump table, other ones binary search their values
+#ifndef LUX_SWITCH_TABLE
+  #define LUX_SWITCH_TABLE 4
+#endif
+#ifndef LUX_SWITCH_DENSITY
+  #define LUX_SWITCH_DENSITY 3
+#endif
+
+// Most clones of script functions specialized for literal arguments a
+// single file can make, 0 turns specialization off
+#ifndef LUX_MAX_CLONES
+  #define LUX_MAX_CLONES 64
+#endif
+
+// Default number of frames on the call stack, can be changed at runtime
+// with lux_vm_set_max_call_depth. Frames are only allocated once a call
+// goes that deep, script calls don't use the C stack so this only guards
+// against runaway recursion
+#ifndef LUX_CALL_DEPTH
+  #define LUX_CALL_DEPTH 65536
+#endif
+
+// Frames kept allocated once the outermost call returns, deeper ones go back
+// to the arena
+#ifndef LUX_CACHED_FRAMES
+  #define LUX_CACHED_FRAMES 16
+#endif
+
 /*
  * Instructions are variable sized always being at least 1 byte
  * General rule is the result is always stored in the last register
@@ -16,7 +121,7 @@ enum
 {            // Size | Byte usage           | Usage
   OP_NOP,    // 1    | <1op>                | No operation
   OP_LDI,    // 6    | <1op,1reg,4value>    | Load value into register
-  OP_CALL,   // 2    | <1op,1reg>           | Call function
+  OP_CALL,   // 6    | <1op,1reg,4index>    | Call function by index with its frame starting at reg
   OP_RET,    // 1    | <1op>                | Return from function
   OP_MOV,    // 3    | <1op,1reg,1reg>      | Move value of register
   OP_ADDI,   // 4    | <1op,1reg,1reg,1reg> | Add two integers
@@ -53,6 +158,82 @@ enum
   OP_RSFT,   // 4    | <1op,1reg,1reg,1reg> | Right shift int
   OP_JMP,    // 5    | <1op,4offset>        | Set cursor to specified offset
   OP_BEQZ,   // 6    | <1op,1reg,4offset>   | Set cursor to specified offset if the register is equal to 0
+  OP_TCALL,  // 6    | <1op,1reg,4index>    | Tail call, replaces the current frame with the callee's
+  OP_BNEZ,   // 6    | <1op,1reg,4offset>   | Set cursor to specified offset if the register is not equal to 0
+  OP_BEQI,   // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if two ints are equal
+  OP_BNEQI,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if two ints are not equal
+  OP_BLTI,   // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if an int is smaller than the other int
+  OP_BLTEI,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if an int is smaller or equals the other int
+  OP_BMTI,   // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if an int is larger than the other int
+  OP_BMTEI,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if an int is larger or equals the other int
+  OP_BEQF,   // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if two floats are equal
+  OP_BNEQF,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if two floats are not equal
+  OP_BLTF,   // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if a float is smaller than the other float
+  OP_BLTEF,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if a float is smaller or equals the other float
+  OP_BMTF,   // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if a float is larger than the other float
+  OP_BMTEF,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset if a float is larger or equals the other float
+  OP_BNLTF,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset unless a float is smaller than the other float
+  OP_BNLTEF, // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset unless a float is smaller or equals the other float
+  OP_BNMTF,  // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset unless a float is larger than the other float
+  OP_BNMTEF, // 7    | <1op,1reg,1reg,4offset> | Set cursor to specified offset unless a float is larger or equals the other float
+  OP_ADDI_K, // 7    | <1op,1reg,4value,1reg> | Add an immediate int
+  OP_SUBI_K, // 7    | <1op,1reg,4value,1reg> | Subtract an immediate int
+  OP_MULI_K, // 7    | <1op,1reg,4value,1reg> | Multiply by an immediate int
+  OP_DIVI_K, // 7    | <1op,1reg,4value,1reg> | Divide by an immediate int
+  OP_MOD_K,  // 7    | <1op,1reg,4value,1reg> | Remainder by an immediate int
+  OP_ADDF_K, // 7    | <1op,1reg,4value,1reg> | Add an immediate float
+  OP_SUBF_K, // 7    | <1op,1reg,4value,1reg> | Subtract an immediate float
+  OP_MULF_K, // 7    | <1op,1reg,4value,1reg> | Multiply by an immediate float
+  OP_DIVF_K, // 7    | <1op,1reg,4value,1reg> | Divide by an immediate float
+  OP_EQI_K,  // 7    | <1op,1reg,4value,1reg> | Checks if an int equals an immediate int
+  OP_NEQI_K, // 7    | <1op,1reg,4value,1reg> | Checks if an int doesn't equal an immediate int
+  OP_EQF_K,  // 7    | <1op,1reg,4value,1reg> | Checks if a float equals an immediate float
+  OP_NEQF_K, // 7    | <1op,1reg,4value,1reg> | Checks if a float doesn't equal an immediate float
+  OP_LTI_K,  // 7    | <1op,1reg,4value,1reg> | Checks if an int is smaller than an immediate int
+  OP_LTEI_K, // 7    | <1op,1reg,4value,1reg> | Checks if an int is smaller or equals an immediate int
+  OP_MTI_K,  // 7    | <1op,1reg,4value,1reg> | Checks if an int is larger than an immediate int
+  OP_MTEI_K, // 7    | <1op,1reg,4value,1reg> | Checks if an int is larger or equals an immediate int
+  OP_LTF_K,  // 7    | <1op,1reg,4value,1reg> | Checks if a float is smaller than an immediate float
+  OP_LTEF_K, // 7    | <1op,1reg,4value,1reg> | Checks if a float is smaller or equals an immediate float
+  OP_MTF_K,  // 7    | <1op,1reg,4value,1reg> | Checks if a float is larger than an immediate float
+  OP_MTEF_K, // 7    | <1op,1reg,4value,1reg> | Checks if a float is larger or equals an immediate float
+  OP_BAND_K, // 7    | <1op,1reg,4value,1reg> | Bitwise AND with an immediate int
+  OP_BXOR_K, // 7    | <1op,1reg,4value,1reg> | Bitwise XOR with an immediate int
+  OP_BOR_K,  // 7    | <1op,1reg,4value,1reg> | Bitwise OR with an immediate int
+  OP_LSFT_K, // 7    | <1op,1reg,4value,1reg> | Left shift int by an immediate int
+  OP_RSFT_K, // 7    | <1op,1reg,4value,1reg> | Right shift int by an immediate int
+  OP_BEQI_K, // 10   | <1op,1reg,4value,4offset> | Set cursor to specified offset if an int equals an immediate int
+  OP_BNEQI_K, // 10   | <1op,1reg,4value,4offset> | Set cursor to specified offset if an int doesn't equal an immediate int
+  OP_BLTI_K, // 10   | <1op,1reg,4value,4offset> | Set cursor to specified offset if an int is smaller than an immediate int
+  OP_BLTEI_K, // 10   | <1op,1reg,4value,4offset> | Set cursor to specified offset if an int is smaller or equals an immediate int
+  OP_BMTI_K, // 10   | <1op,1reg,4value,4offset> | Set cursor to specified offset if an int is larger than an immediate int
+  OP_BMTEI_K, // 10   | <1op,1reg,4value,4offset> | Set cursor to specified offset if an int is larger or equals an immediate int
+  OP_NEGI,   // 3    | <1op,1reg,1reg>      | Negate an int
+  OP_NEGF,   // 3    | <1op,1reg,1reg>      | Negate a float
+  OP_SPILL,  // 6    | <1op,1reg,4slot>     | Store a register into a spill slot of the frame
+  OP_RELOAD, // 6    | <1op,1reg,4slot>     | Load a spill slot of the frame into a register
+  OP_FORLT,  // 11   | <1op,1reg,1reg,4value,4offset> | Add an immediate int to a counter and set cursor to specified offset if it is smaller than a limit
+  OP_FORLTE, // 11   | <1op,1reg,1reg,4value,4offset> | Add an immediate int to a counter and set cursor to specified offset if it is smaller or equals a limit
+  OP_FORMT,  // 11   | <1op,1reg,1reg,4value,4offset> | Add an immediate int to a counter and set cursor to specified offset if it is larger than a limit
+  OP_FORMTE, // 11   | <1op,1reg,1reg,4value,4offset> | Add an immediate int to a counter and set cursor to specified offset if it is larger or equals a limit
+  OP_DIVI_P, // 7    | <1op,1reg,4value,1reg> | Divide by 2 to the power of an immediate int, rounding toward zero
+  OP_MOD_P,  // 7    | <1op,1reg,4value,1reg> | Remainder by a power of 2, the immediate int being one less
+  OP_DIVI_M, // 11   | <1op,1reg,4value,4magic,1reg> | Divide by an immediate int through its magic multiplier
+  OP_MOD_M,  // 11   | <1op,1reg,4value,4magic,1reg> | Remainder by an immediate int through its magic multiplier
+  OP_SEL,    // 4    | <1op,1reg,1reg,1reg> | Copy the second register to the third if the bool in the first is true, the third keeps its value otherwise
+  OP_JTAB,   // 10   | <1op,1reg,4value,4count> | Set cursor to entry r[reg] - value of the count + 1 OP_CASE entries right after it, the last one when out of range
+  OP_CASE,   // 5    | <1op,4offset>        | Jump table entry, set cursor to specified offset
+  OP_SQRTF,  // 3    | <1op,1reg,1reg>      | Square root of a float
+  OP_ABSI,   // 3    | <1op,1reg,1reg>      | Absolute value of an int, wrapping for INT_MIN
+  OP_ABSF,   // 3    | <1op,1reg,1reg>      | Absolute value of a float
+  OP_FLOORF, // 3    | <1op,1reg,1reg>      | Round a float down to a whole float
+  OP_CLZ,    // 3    | <1op,1reg,1reg>      | Count the leading zero bits of an int, 32 for 0
+  OP_POPCNT, // 3    | <1op,1reg,1reg>      | Count the set bits of an int
+  OP_MINI,   // 4    | <1op,1reg,1reg,1reg> | Smaller of two ints
+  OP_MAXI,   // 4    | <1op,1reg,1reg,1reg> | Larger of two ints
+  OP_MINF,   // 4    | <1op,1reg,1reg,1reg> | Smaller of two floats, the second one if they're unordered
+  OP_MAXF,   // 4    | <1op,1reg,1reg,1reg> | Larger of two floats, the second one if they're unordered
+  OP_FMAF,   // 4    | <1op,1reg,1reg,1reg> | Multiply two floats and add the third register to it with a single rounding, the result goes to the third
 };
 
 typedef struct lexer_s lexer_t;
@@ -62,17 +243,63 @@ typedef struct token_s token_t;
 /* compiler.c */
 typedef struct cpvar_s
 {
-  char name[128];
+  char* name;          // Points into the source
+  unsigned int length; // Length of the name
   vmtype_t* type;
-  unsigned char r;
+  unsigned char r;     // Register holding the variable
+  int slot;            // Spill slot holding the variable instead, -1 if none
   int z;
 } cpvar_t;
 
+// Value produced by a short circuit && or ||, laid out as
+//          <jumps to F>
+//   start: mov rreg reg
+//          jmp end
+//   F:     ldi reg jumpif
+//   end:
+typedef struct cpjoin_s
+{
+  int start;          // Offset of the mov
+  int end;            // Offset right after the join
+  int chain;          // Jumps to F linked through their offset fields while compiling
+  int jumps[8];       // Offsets of the offset fields of the jumps to F
+  int jumpc;          // Number of jumps to F, joins with more than 8 aren't recorded
+  bool jumpif;        // Value that skips the right operand, true for ||
+  unsigned char rreg; // Register holding the right operand
+  unsigned char reg;  // Register holding the result
+} cpjoin_t;
+
+// Value of a case in a switch
+typedef struct cpcase_s
+{
+  int value;
+  int clause; // Index of the case clause it belongs to
+} cpcase_t;
+
+// Built-in function compiled to a single instruction
+typedef struct cpintrinsic_s
+{
+  const char* name;
+  int numargs;
+  unsigned char iop; // Opcode taking ints, OP_NOP if there's none
+  unsigned char fop; // Opcode taking floats, OP_NOP if there's none
+} cpintrinsic_t;
+
+// Clone of a script function with some of its arguments fixed to literals
+typedef struct cpclone_s
+{
+  closure_t* original;
+  closure_t* clone;
+  bool known[LUX_MAX_ARGS];          // Arguments fixed in the clone
+  vmregister_t values[LUX_MAX_ARGS]; // Literal of every fixed argument
+} cpclone_t;
+
 enum
 {
   RS_NOT_USED = 0, // Register isn't being used
   RS_VARIABLE,     // Register is used by a variable
   RS_GENERIC,      // Register is used for generic operations
+  RS_ARGUMENT,     // Register holds an argument and its variable
 };
 
 typedef struct compiler_s
@@ -80,21 +307,40 @@ typedef struct compiler_s
   vm_t* vm;     // vm that owns us
   lexer_t* lex; // Lexer for the file we're compiling
   int r[256];   // Keeps track of in use registers
+  unsigned int rbits[8]; // Bit set for every register in use, for finding free ones
+  int rmax;     // Highest register used + 1
   int z;        // Counts nested scopes
-  cpvar_t vars[128]; // Local vars;
+  cpvar_t vars[LUX_MAX_LOCALS]; // Local vars;
   int vc;       // Number of vars
+  int slots;    // Spill slots in use
+  int maxslots; // Most spill slots in use at once in the current function
+  int lastcall; // Offset of the last OP_CALL emitted, -1 if none
+  int lastbinop; // Offset of the last binary operator emitted, -1 if none
+  int lastldi;  // Offset of the last OP_LDI loading a literal, -1 if none
+  int ldirun;   // Offset of the first literal OP_LDI in the back to back run ending at lastldi
+  cpjoin_t joins[16]; // Most recent short circuit joins
+  int jc;       // Number of joins
+  int optlevel; // One of LUX_OPT_*
+  int inlined;  // Bytes of code inlined into the current function
+  cpclone_t clones[LUX_MAX_CLONES]; // Specialized functions made so far
+  int numclones; // Number of clones
 } compiler_t;
 
 void lux_compiler_init(compiler_t* comp, vm_t* vm, lexer_t* lex);
+void lux_compiler_forget_emitted(compiler_t* comp);
 bool lux_compiler_compile_file(compiler_t* comp);
 
 void lux_compiler_clear_registers(compiler_t* comp);
+int lux_register_set_first_free(unsigned int* set, int from);
 bool lux_compiler_alloc_register_generic(compiler_t* comp, unsigned char* reg);
 bool lux_compiler_alloc_register_variable(compiler_t* comp, unsigned char* reg);
+void lux_compiler_reserve_arguments(compiler_t* comp, int numargs);
+bool lux_compiler_alloc_register_window(compiler_t* comp, int num, unsigned char* base);
 void lux_compiler_free_register_generic(compiler_t* comp, unsigned char reg);
 void lux_compiler_free_register_variable(compiler_t* comp, unsigned char reg);
 
 bool lux_compiler_register_var(compiler_t* comp, vmtype_t* type, token_t* name, cpvar_t** var);
+bool lux_compiler_register_arg(compiler_t* comp, vmtype_t* type, token_t* name, unsigned char reg);
 cpvar_t* lux_compiler_get_var(compiler_t* comp, token_t* name);
 void lux_compiler_enter_scope(compiler_t* comp);
 void lux_compiler_leave_scope(compiler_t* comp);
@@ -180,8 +426,11 @@ typedef struct closure_s
   bool (*callback)(vm_t* vm, vmframe_t* frame);
   vmtype_t* rettype;
   int numargs;
-  vmtype_t* args[12];
+  vmtype_t* args[LUX_MAX_ARGS];
   int index;
+  int numregs; // Registers the frame needs, highest register used + 1
+  int numslots; // Spill slots the frame needs
+  bool pure;    // Script function only calling pure functions, it has no side effects
   unsigned char* code;
   int used;
   int allocated;
@@ -192,11 +441,17 @@ typedef struct vmframe_s
 {
   vm_t* vm;
   closure_t* closure;
-  vmregister_t r[256];
-  vmframe_t* next;
+  vmregister_t* r; // Window into vm->stack
+  vmregister_t* s; // Spill slots, carved downwards from the end of vm->stack
+  unsigned char* cursor; // Where to resume once the frame we called returns
+  vmframe_t* caller;
+  vmframe_t* callee; // Kept once allocated so the next call this deep reuses it
 } vmframe_t;
 
-bool lux_vm_call_function_internal(vm_t* vm, closure_t* func, vmframe_t* frame);
+vmframe_t* lux_vm_push_frame(vm_t* vm, closure_t* func, vmregister_t* r);
+bool       lux_vm_grow_stack(vm_t* vm, closure_t* func, int missing);
+bool       lux_vm_call_function_internal(vm_t* vm, closure_t* func, vmregister_t* r);
+bool       lux_vm_evaluate(vm_t* vm, closure_t* func, vmregister_t* args, int steps, vmregister_t* ret);
 
 bool      lux_vm_register_type(vm_t* vm, const char* type, bool can_be_variable);
 vmtype_t* lux_vm_get_type_s(vm_t* vm, const char* type);
@@ -214,7 +469,7 @@ void lux_vm_closure_append_int(vm_t* vm, closure_t* closure, int i);
 void lux_vm_closure_append_float(vm_t* vm, closure_t* closure, float f);
 void lux_vm_closure_append_bytes(vm_t* vm, closure_t* closure, unsigned char* bytes, int num);
 bool lux_vm_closure_last_byte_is(vm_t* vm, closure_t* closure, char b);
-void lux_vm_closure_finish(vm_t* vm, closure_t* closure);
+void lux_vm_closure_finish(vm_t* vm, closure_t* closure, int optlevel);
 
 void lux_vm_set_error(vm_t* vm, char* error);
 void lux_vm_set_error_s(vm_t* vm, char* error, const char* str1);
@@ -224,7 +479,77 @@ void lux_vm_set_error_ts(vm_t* vm, char* error, token_t* token, const char* str)
 void lux_vm_set_error_st(vm_t* vm, char* error, const char* str, token_t* token);
 
 /* interpreter.c */
-bool lux_vm_interpret_frame(vm_t* vm, vmframe_t* frame);
+bool lux_vm_interpret_frame(vm_t* vm, vmframe_t* frame, int* steps);
+
+/* peephole.c */
+// Operand layouts, see the opcode enum above
+enum
+{
+  OF_NONE, // <1op>
+  OF_LDI,  // <1op,1reg,4value>
+  OF_CALL, // <1op,1reg,4index>
+  OF_RR,   // <1op,1reg,1reg>
+  OF_RRR,  // <1op,1reg,1reg,1reg>
+  OF_JMP,  // <1op,4offset>
+  OF_BR,   // <1op,1reg,4offset>
+  OF_BRR,  // <1op,1reg,1reg,4offset>
+  OF_RKR,  // <1op,1reg,4value,1reg>
+  OF_BRK,  // <1op,1reg,4value,4offset>
+  OF_RK,   // <1op,1reg,4value>, reads the register
+  OF_FOR,  // <1op,1reg,1reg,4value,4offset>, steps the first register
+  OF_RKKR, // <1op,1reg,4value,4value,1reg>
+  OF_SEL,  // <1op,1reg,1reg,1reg>, reads the last register too
+  OF_TABLE, // <1op,1reg,4value,4value>, followed by its entries
+};
+
+int  lux_opcode_format(unsigned char op);
+bool lux_opcode_is_terminator(unsigned char op);
+int  lux_opcode_size(unsigned char op);
+int  lux_opcode_target(unsigned char op);
+int  lux_opcode_result(unsigned char op);
+int  lux_opcode_registers(unsigned char op, int* positions);
+unsigned char lux_opcode_immediate(unsigned char op);
+bool lux_opcode_fold(unsigned char op, vmregister_t l, vmregister_t r, vmregister_t* res);
+bool lux_opcode_fold_branch(unsigned char op, vmregister_t l, vmregister_t r, bool* taken);
+
+//-----------------------------------------------
+// Counts the leading zero bits of an int, 32
+// for 0, like OP_CLZ
+//-----------------------------------------------
+static inline int lux_count_leading_zeros(unsigned int value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return value == 0 ? 32 : __builtin_clz(value);
+#else
+  int count = 0;
+  for(unsigned int bit = 0x80000000u; bit != 0 && !(value & bit); bit >>= 1)
+  {
+    count++;
+  }
+  return count;
+#endif
+}
+
+//-----------------------------------------------
+// Counts the set bits of an int, like OP_POPCNT
+//-----------------------------------------------
+static inline int lux_count_bits(unsigned int value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcount(value);
+#else
+  int count = 0;
+  for(; value != 0; value &= value - 1)
+  {
+    count++;
+  }
+  return count;
+#endif
+}
+void lux_peephole_closure(vm_t* vm, closure_t* closure);
+
+/* optimizer.c */
+void lux_optimizer_closure(vm_t* vm, closure_t* closure);
 
 /* debug.c */
 void lux_debug_dump_code_all(vm_t* vm);
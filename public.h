@@ -28,13 +28,45 @@ typedef struct vm_s
   vmtype_t* tbool;  // Asigned to TT_BOOL tokens
   
   closure_t* functions;
-  vmframe_t* frames;
+  closure_t** functiontable; // Functions indexed by closure_t::index
+  int functiontablesize;
+  vmframe_t* frames; // Outermost frame of the call stack, the others hang off it
+  vmframe_t* top;    // Innermost frame running, NULL if none
+  int numframes;
+  int maxframes;     // Call depth limit
+
+  vmregister_t* stack; // Register stack, grows on demand so frames may only hold on to offsets into it
+  int stacksize;
+  int maxstacksize;    // Registers the stack can grow to
+
+  bool peephole;            // Run the peephole pass on compiled functions, on by default
+  int peepholebytes;        // Bytes of code the peephole pass removed
+  int peepholeinstructions; // Instructions the peephole pass removed
+  bool inlining;            // Inline small script functions at their call sites, on by default
+  int inlinedcalls;         // Calls the compiler inlined
+  bool evaluation;          // Run pure functions called with literal arguments at compile time, on by default
+  int evaluatedcalls;       // Calls the compiler replaced by their result
+  bool specialization;      // Call clones of script functions specialized for literal arguments, on by default
+  int specializedcalls;     // Calls the compiler redirected to a clone
+  int clones;               // Clones the compiler made
+  bool unrolling;           // Unroll counted for loops with a known trip count, on by default
+  int unrolledloops;        // Loops the compiler unrolled
+  bool selects;             // Compile simple ternaries and if/else assignments to selects, on by default
+  int selectedbranches;     // Ternaries and if statements the compiler turned into a select
 
   xmemchunk_t* freemem;
 } vm_t;
 
 bool lux_vm_init(vm_t* vm, char* mem, unsigned int memsize);
+// Optimization levels for lux_vm_load_opt
+#define LUX_OPT_NONE     0 // Keep the code as the compiler emitted it
+#define LUX_OPT_PEEPHOLE 1 // Run the peephole pass
+#define LUX_OPT_FULL     2 // Run the SSA middle-end followed by the peephole pass
+
 bool lux_vm_load(vm_t* vm, char* buf);
+bool lux_vm_load_opt(vm_t* vm, char* buf, int optlevel);
+bool lux_vm_set_max_call_depth(vm_t* vm, int depth);
+bool lux_vm_set_max_stack_size(vm_t* vm, int size);
 
 closure_t* lux_vm_get_function(vm_t* vm, const char* name);
 bool lux_vm_call_function(vm_t* vm, closure_t* func, vmregister_t* ret);
@@ -37,7 +37,26 @@ bool lux_vm_init(vm_t* vm, char* mem, unsigned int memsize)
   
   vm->types = NULL;
   vm->functions = NULL;
+  vm->functiontable = NULL;
+  vm->functiontablesize = 0;
   vm->frames = NULL;
+  vm->top = NULL;
+  vm->numframes = 0;
+  vm->maxframes = LUX_CALL_DEPTH;
+  vm->peephole = true;
+  vm->peepholebytes = 0;
+  vm->peepholeinstructions = 0;
+  vm->inlining = true;
+  vm->inlinedcalls = 0;
+  vm->evaluation = true;
+  vm->evaluatedcalls = 0;
+  vm->specialization = true;
+  vm->specializedcalls = 0;
+  vm->clones = 0;
+  vm->unrolling = true;
+  vm->unrolledloops = 0;
+  vm->selects = true;
+  vm->selectedbranches = 0;
 
   if(memsize < sizeof(xmemchunk_t))
   {
@@ -48,6 +67,14 @@ bool lux_vm_init(vm_t* vm, char* mem, unsigned int memsize)
   chunk->size = memsize - sizeof(xmemchunk_t);
   chunk->next = NULL;
 
+  vm->stack = xalloc(vm, sizeof(vmregister_t) * LUX_STACK_SIZE);
+  if(vm->stack == NULL)
+  {
+    return false;
+  }
+  vm->stacksize = LUX_STACK_SIZE;
+  vm->maxstacksize = LUX_MAX_STACK_SIZE;
+
   (void)lux_vm_register_type(vm, "void",  false);
   (void)lux_vm_register_type(vm, "int",   true);
   (void)lux_vm_register_type(vm, "float", true);
@@ -69,12 +96,23 @@ bool lux_vm_init(vm_t* vm, char* mem, unsigned int memsize)
 // Returns false on fatal error
 //-----------------------------------------------
 bool lux_vm_load(vm_t* vm, char* buf)
+{
+  return lux_vm_load_opt(vm, buf, LUX_OPT_FULL);
+}
+
+//-----------------------------------------------
+// Loads and compiles a text buffer into a vm
+// optimizing it at 'optlevel', one of LUX_OPT_*
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_vm_load_opt(vm_t* vm, char* buf, int optlevel)
 {
   lexer_t lexer;
   lux_lexer_init(&lexer, vm, buf);
 
   compiler_t comp;
   lux_compiler_init(&comp, vm, &lexer);
+  comp.optlevel = optlevel;
   if(!lux_compiler_compile_file(&comp))
   {
     vm->errorline = lexer.line;
@@ -104,34 +142,219 @@ closure_t* lux_vm_get_function(vm_t* vm, const char* name)
 }
 
 //-----------------------------------------------
-// Internal implementation for OP_CALL
+// Sets how many frames can be on the call stack
+// Frames are allocated as calls get that deep
 // Returns false on fatal error
 //-----------------------------------------------
-bool lux_vm_call_function_internal(vm_t* vm, closure_t* func, vmframe_t* frame)
+bool lux_vm_set_max_call_depth(vm_t* vm, int depth)
 {
-  //printf("Calling %s internal\n", func->name);
-  vmframe_t newframe;
-  newframe.vm = vm;
-  newframe.closure = func;
-  newframe.next = vm->frames;
-  vm->frames = &newframe;
+  if(depth < 1)
+  {
+    lux_vm_set_error(vm, "Call depth has to be at least 1");
+    return false;
+  }
 
-  for(int i = 0; i < func->numargs; i++)
+  vm->maxframes = depth;
+  return true;
+}
+
+//-----------------------------------------------
+// Sets how many registers the register stack can
+// grow to
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_vm_set_max_stack_size(vm_t* vm, int size)
+{
+  if(size < LUX_STACK_SIZE)
+  {
+    lux_vm_set_error(vm, "Stack size has to be at least LUX_STACK_SIZE");
+    return false;
+  }
+
+  vm->maxstacksize = size;
+  return true;
+}
+
+//-----------------------------------------------
+// Makes room for 'missing' more registers between
+// the register windows and the spill slots calling
+// 'func', moving every frame along with the stack
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_vm_grow_stack(vm_t* vm, closure_t* func, int missing)
+{
+  int size = vm->stacksize * 2;
+  if(size < vm->stacksize + missing)
+  {
+    size = vm->stacksize + missing;
+  }
+  if(size > vm->maxstacksize)
+  {
+    size = vm->maxstacksize;
+  }
+  if(size < vm->stacksize + missing)
+  {
+    lux_vm_set_error_s(vm, "Stack overflow calling '%s'", func->name);
+    return false;
+  }
+
+  vmregister_t* stack = xalloc(vm, sizeof(vmregister_t) * size);
+  if(stack == NULL)
+  {
+    lux_vm_set_error_s(vm, "Ran out of memory for the stack calling '%s'", func->name);
+    return false;
+  }
+
+  // Register windows keep their offset from the start, spill slots theirs from the end
+  vmregister_t* end = vm->stack + vm->stacksize;
+  vmregister_t* spills = vm->top != NULL ? vm->top->s : end;
+  int moved = size - vm->stacksize;
+  memcpy(stack, vm->stack, sizeof(vmregister_t) * (spills - vm->stack));
+  memcpy(stack + (spills - vm->stack) + moved, spills, sizeof(vmregister_t) * (end - spills));
+  for(vmframe_t* frame = vm->top; frame != NULL; frame = frame->caller)
+  {
+    frame->r = stack + (frame->r - vm->stack);
+    frame->s = stack + (frame->s - vm->stack) + moved;
+  }
+
+  xfree(vm, vm->stack);
+  vm->stack = stack;
+  vm->stacksize = size;
+  return true;
+}
+
+//-----------------------------------------------
+// Pushes a frame for 'func' onto the call stack
+// 'r' is the callers register window, r[0] receives
+// the return value and r[1...] already holds the
+// arguments
+// Returns NULL on fatal error
+//-----------------------------------------------
+vmframe_t* lux_vm_push_frame(vm_t* vm, closure_t* func, vmregister_t* r)
+{
+  if(vm->numframes == vm->maxframes)
+  {
+    lux_vm_set_error_s(vm, "Call depth limit reached calling '%s'", func->name);
+    return NULL;
+  }
+
+  // Spill slots sit right below the ones of the caller
+  vmregister_t* s = vm->top != NULL ? vm->top->s : vm->stack + vm->stacksize;
+  s -= func->numslots;
+  if(r + func->numregs > s)
+  {
+    int base = (int)(r - vm->stack);
+    if(!lux_vm_grow_stack(vm, func, (int)(r + func->numregs - s)))
+    {
+      return NULL;
+    }
+    r = vm->stack + base;
+    s = (vm->top != NULL ? vm->top->s : vm->stack + vm->stacksize) - func->numslots;
+  }
+
+  // Frames never move once allocated so callbacks can hold on to theirs
+  vmframe_t* frame = vm->top != NULL ? vm->top->callee : vm->frames;
+  if(frame == NULL)
+  {
+    frame = xalloc(vm, sizeof(vmframe_t));
+    if(frame == NULL)
+    {
+      lux_vm_set_error(vm, "Ran out of memory for the call stack");
+      return NULL;
+    }
+    frame->caller = vm->top;
+    frame->callee = NULL;
+    if(vm->top != NULL)
+    {
+      vm->top->callee = frame;
+    }
+    else
+    {
+      vm->frames = frame;
+    }
+  }
+
+  vm->top = frame;
+  vm->numframes++;
+  frame->vm = vm;
+  frame->closure = func;
+  frame->r = r;
+  frame->s = s;
+  frame->cursor = func->code;
+  return frame;
+}
+
+//-----------------------------------------------
+// Unwinds the call stack back to top and hands
+// the frames cached past LUX_CACHED_FRAMES and
+// the registers a call grew the stack by back to
+// the arena so one deep recursion doesn't keep
+// them forever
+//-----------------------------------------------
+static void lux_vm_unwind_frames(vm_t* vm, vmframe_t* top, int numframes)
+{
+  vm->top = top;
+  vm->numframes = numframes;
+
+  // Nothing lives in the stack once the outermost call returned, shrinking stays in place
+  if(top == NULL && vm->stacksize > LUX_STACK_SIZE)
   {
-    newframe.r[i + 1] = frame->r[i + 1];
+    vm->stack = xrealloc(vm, vm->stack, sizeof(vmregister_t) * LUX_STACK_SIZE);
+    vm->stacksize = LUX_STACK_SIZE;
   }
 
+  vmframe_t* last = top;
+  for(int depth = numframes; depth < LUX_CACHED_FRAMES; depth++)
+  {
+    vmframe_t* next = last != NULL ? last->callee : vm->frames;
+    if(next == NULL)
+    {
+      return;
+    }
+    last = next;
+  }
+
+  vmframe_t* frame = last != NULL ? last->callee : vm->frames;
+  if(last != NULL)
+  {
+    last->callee = NULL;
+  }
+  else
+  {
+    vm->frames = NULL;
+  }
+
+  while(frame != NULL)
+  {
+    vmframe_t* next = frame->callee;
+    xfree(vm, frame);
+    frame = next;
+  }
+}
+
+//-----------------------------------------------
+// Calls a closure from C, script calls between
+// closures stay inside lux_vm_interpret_frame
+// and only come here for native callbacks
+// Returns false on fatal error
+//-----------------------------------------------
+bool lux_vm_call_function_internal(vm_t* vm, closure_t* func, vmregister_t* r)
+{
+  //printf("Calling %s internal\n", func->name);
+  vmframe_t* frame = lux_vm_push_frame(vm, func, r);
+  TRY(frame)
+
   if(!func->native)
   {
-    TRY(lux_vm_interpret_frame(vm, &newframe))
+    TRY(lux_vm_interpret_frame(vm, frame, NULL))
   }
   else
   {
-    TRY(func->callback(vm, &newframe))
+    TRY(func->callback(vm, frame))
   }
 
-  vm->frames = newframe.next;
-  frame->r[0] = newframe.r[0];
+  vm->top = frame->caller;
+  vm->numframes--;
   return true;
 }
 
@@ -143,17 +366,57 @@ bool lux_vm_call_function_internal(vm_t* vm, closure_t* func, vmframe_t* frame)
 bool lux_vm_call_function(vm_t* vm, closure_t* func, vmregister_t* ret)
 {
   //printf("Calling %s public\n", func->name);
-  vmframe_t frame;
-  frame.vm = vm;
-  frame.closure = func;
-  frame.next = vm->frames;
-  vm->frames = &frame;
-  TRY(lux_vm_interpret_frame(vm, &frame))
-  vm->frames = frame.next;
-  *ret = frame.r[0];
+  // Start above the innermost frame in case we're called from a native callback
+  vmregister_t* r = vm->stack;
+  if(vm->top != NULL)
+  {
+    r = vm->top->r + vm->top->closure->numregs;
+  }
+
+  // Unwind whatever a failed call left on the call stack, the stack may have moved
+  int base = (int)(r - vm->stack);
+  vmframe_t* top = vm->top;
+  int numframes = vm->numframes;
+  bool ok = lux_vm_call_function_internal(vm, func, r);
+  lux_vm_unwind_frames(vm, top, numframes);
+  TRY(ok)
+
+  *ret = vm->stack[base];
   return true;
 }
 
+//-----------------------------------------------
+// Runs a pure script function at compile time
+// with 'args' as its arguments, running at most
+// 'steps' instructions
+// Returns false if it didn't finish, the call
+// stack is left as it was either way
+//-----------------------------------------------
+bool lux_vm_evaluate(vm_t* vm, closure_t* func, vmregister_t* args, int steps, vmregister_t* ret)
+{
+  vmregister_t* r = vm->stack;
+  if(vm->top != NULL)
+  {
+    r = vm->top->r + vm->top->closure->numregs;
+  }
+
+  int base = (int)(r - vm->stack);
+  vmframe_t* top = vm->top;
+  int numframes = vm->numframes;
+  vmframe_t* frame = lux_vm_push_frame(vm, func, r);
+  TRY(frame)
+
+  for(int i = 0; i < func->numargs; i++)
+  {
+    frame->r[i + 1] = args[i];
+  }
+
+  bool finished = lux_vm_interpret_frame(vm, frame, &steps);
+  lux_vm_unwind_frames(vm, top, numframes);
+  *ret = vm->stack[base];
+  return finished;
+}
+
 //-----------------------------------------------
 // Tries to register a type
 // Returns false on fatal error
@@ -220,26 +483,43 @@ closure_t* lux_vm_register_function_s(vm_t* vm, const char* name, vmtype_t* rett
     return NULL;
   }
 
+  int index = vm->functions == NULL ? 0 : vm->functions->index + 1;
+  if(index >= vm->functiontablesize)
+  {
+    // Grow the index -> closure table in steps of 16
+    closure_t** table = xrealloc(vm, vm->functiontable, sizeof(closure_t*) * (vm->functiontablesize + 16));
+    if(table == NULL)
+    {
+      lux_vm_set_error(vm, "Ran out of memory for the function table");
+      return NULL;
+    }
+    vm->functiontable = table;
+    vm->functiontablesize += 16;
+  }
+
   closure_t* fp = xalloc(vm, sizeof(closure_t));
+  if(fp == NULL)
+  {
+    lux_vm_set_error_s(vm, "Ran out of memory registering '%s'", name);
+    return NULL;
+  }
+
   strncpy(fp->name, name, 128);
   fp->name[127] = '\0';
   fp->native = false;
   fp->rettype = rettype;
   fp->numargs = 0;
+  fp->numregs = 1;
+  fp->numslots = 0;
+  fp->pure = false;
   fp->code = NULL;
   fp->used = 0;
   fp->allocated = 0;
   fp->next = vm->functions;
-  if(vm->functions == NULL)
-  {
-    fp->index = 0;
-  }
-  else
-  {
-    fp->index = vm->functions->index + 1;
-  }
+  fp->index = index;
 
   vm->functions = fp;
+  vm->functiontable[index] = fp;
   return fp;
 }
 
@@ -319,14 +599,15 @@ bool lux_vm_register_native_function(vm_t* vm, const char* signature, bool (*cal
       return false;
     }
 
-    if(closure->numargs == 12)
+    if(closure->numargs == LUX_MAX_ARGS)
     {
-      lux_vm_set_error(vm, "A function can have up to 12 arguments max");
+      lux_vm_set_error(vm, "A function has too many arguments");
       return false;
     }
 
     closure->args[closure->numargs] = type;
     closure->numargs++;
+    closure->numregs = closure->numargs + 1;
 
     lux_lexer_get_token(&lexer, &token);
     if(*token.buf == ')')
@@ -389,7 +670,7 @@ bool lux_vm_closure_ensure_free(vm_t* vm, closure_t* closure, int size)
     return true;
   }
 
-  closure->allocated += 64;
+  closure->allocated += size < 64 ? 64 : size + 64;
 
   closure->code = xrealloc(vm, closure->code, closure->allocated);
 
@@ -454,11 +735,22 @@ bool lux_vm_closure_last_byte_is(vm_t* vm, closure_t* closure, char b)
 }
 
 //-----------------------------------------------
-// Packs the closure stream into its smallest
+// Runs the optimizations 'optlevel' asks for and
+// packs the closure stream into its smallest
 // possible allocation size
 //-----------------------------------------------
-void lux_vm_closure_finish(vm_t* vm, closure_t* closure)
+void lux_vm_closure_finish(vm_t* vm, closure_t* closure, int optlevel)
 {
+  if(optlevel >= LUX_OPT_FULL)
+  {
+    lux_optimizer_closure(vm, closure);
+  }
+
+  if(optlevel >= LUX_OPT_PEEPHOLE && vm->peephole)
+  {
+    lux_peephole_closure(vm, closure);
+  }
+
   closure->allocated = closure->used;
   closure->code = xrealloc(vm, closure->code, closure->allocated);
 }